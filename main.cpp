@@ -1,7 +1,56 @@
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <chrono>
+#include <cstdio>
 #include <vector>
+#include <array>
 #include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <sstream>
+#include <stdexcept>
+#include <cstdint>
+#include <climits>
+#include <cmath>
+#include <cerrno>
+#include <csignal>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <iterator>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <type_traits>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__)
+#define TGA_X86_SIMD
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 #pragma pack(push, 1)
@@ -10,582 +59,8796 @@ struct TGAHeader
     char idLength;
     char colorMapType;
     char dataTypeCode;
-    short colorMapOrigin;
-    short colorMapLength;
+    uint16_t colorMapOrigin;
+    uint16_t colorMapLength;
     char colorMapDepth;
-    short xOrigin;
-    short yOrigin;
-    short width;
-    short height;
+    uint16_t xOrigin;
+    uint16_t yOrigin;
+    uint16_t width;
+    uint16_t height;
     char pixelDepth;
     char imageDescriptor;
 };
 #pragma pack(pop)
 
 
-#pragma pack(push, 1)
-struct TGAImage
+/* Read-only memory mapping of a whole file */
+class MappedFile
 {
-    TGAHeader header;
-    vector<uint8_t> data;
-};
-#pragma pack(pop)
+public:
+    explicit MappedFile(const string &filename)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw runtime_error("Failed to open the TGA file: " + filename);
+        }
 
+        struct stat info;
+        if (fstat(fd, &info) != 0)
+        {
+            close(fd);
+            throw runtime_error("Failed to stat the TGA file: " + filename);
+        }
 
-TGAImage loadTGA(const string &filename)
-{
-    TGAImage image;
-    ifstream file(filename, ios::binary);
+        length = static_cast<size_t>(info.st_size);
+        if (length > 0)
+        {
+            void *address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address == MAP_FAILED)
+            {
+                close(fd);
+                throw runtime_error("Failed to map the TGA file: " + filename);
+            }
+            bytes = static_cast<const uint8_t *>(address);
+            madvise(address, length, MADV_SEQUENTIAL);
+        }
+        close(fd);
+    }
 
-    if (!file.is_open())
+    ~MappedFile()
     {
-        throw runtime_error("Failed to open the TGA file: " + filename);
+        if (bytes != nullptr)
+        {
+            munmap(const_cast<uint8_t *>(bytes), length);
+        }
     }
 
-    // Read TGAHeader members individually
-    file.read(&image.header.idLength, sizeof(image.header.idLength));
-    file.read(&image.header.colorMapType, sizeof(image.header.colorMapType));
-    file.read(&image.header.dataTypeCode, sizeof(image.header.dataTypeCode));
-    file.read(reinterpret_cast<char *>(&image.header.colorMapOrigin), sizeof(image.header.colorMapOrigin));
-    file.read(reinterpret_cast<char *>(&image.header.colorMapLength), sizeof(image.header.colorMapLength));
-    file.read(&image.header.colorMapDepth, sizeof(image.header.colorMapDepth));
-    file.read(reinterpret_cast<char *>(&image.header.xOrigin), sizeof(image.header.xOrigin));
-    file.read(reinterpret_cast<char *>(&image.header.yOrigin), sizeof(image.header.yOrigin));
-    file.read(reinterpret_cast<char *>(&image.header.width), sizeof(image.header.width));
-    file.read(reinterpret_cast<char *>(&image.header.height), sizeof(image.header.height));
-    file.read(&image.header.pixelDepth, sizeof(image.header.pixelDepth));
-    file.read(&image.header.imageDescriptor, sizeof(image.header.imageDescriptor));
-
-    unsigned int imageSize = image.header.width * image.header.height * (image.header.pixelDepth / 8);
-    image.data.resize(imageSize);
-    file.read(reinterpret_cast<char *>(image.data.data()), imageSize);
-
-    file.close();
-    return image;
-}
-/* Multiply Blend Method */
-TGAImage blendImagesMultiply(const TGAImage &topLayer, const TGAImage &bottomLayer)
-{
-    TGAImage blendedImage;
-    blendedImage.header = topLayer.header;
-    unsigned int imageSize = topLayer.header.width * topLayer.header.height * (topLayer.header.pixelDepth / 8);
-    blendedImage.data.resize(imageSize);
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
 
-    int channels = topLayer.header.pixelDepth / 8;
+    const uint8_t *data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const uint8_t *bytes = nullptr;
+    size_t length = 0;
+};
 
-    for (unsigned int i = 0; i < imageSize; i += channels)
+/*
+ * Buffer Pool
+ *
+ * Recycles 64-byte aligned pixel blocks. A chain keeps needing buffers of the same size, so handing back a block
+ * that is already faulted in beats allocating and page-faulting a fresh multi-megabyte vector for every step.
+ */
+class BufferPool
+{
+public:
+    ~BufferPool()
     {
-        for (int j = 0; j < channels; ++j)
+        for (const FreeBlock &block : freeBlocks)
         {
-            float topColor = static_cast<float>(topLayer.data[i + j]) / 255.0f;
-            float bottomColor = static_cast<float>(bottomLayer.data[i + j]) / 255.0f;
-
-            float blendedColor = topColor * bottomColor;
-            blendedImage.data[i + j] = static_cast<uint8_t>(blendedColor * 255.0f);
+            free(block.bytes);
         }
     }
 
-    return blendedImage;
-}
-
-/* Screen Blend Method */
-TGAImage blendImagesScreen(const TGAImage &topLayer, const TGAImage &bottomLayer)
-{
+    /* Returns a block of at least size bytes; its real capacity is stored in capacity */
+    uint8_t *acquire(size_t size, size_t &capacity)
+    {
+        if (size == 0)
+        {
+            capacity = 0;
+            return nullptr;
+        }
 
-    TGAImage blendedImage;
-    blendedImage.header = topLayer.header;
-    unsigned int imageSize = topLayer.header.width * topLayer.header.height * (topLayer.header.pixelDepth / 8);
-    blendedImage.data.resize(imageSize);
+        {
+            lock_guard<mutex> guard(lock);
+            size_t best = freeBlocks.size();
+            for (size_t i = 0; i < freeBlocks.size(); ++i)
+            {
+                // Don't hand out blocks that would waste more than half their size
+                if (freeBlocks[i].capacity >= size && freeBlocks[i].capacity / 2 <= size &&
+                    (best == freeBlocks.size() || freeBlocks[i].capacity < freeBlocks[best].capacity))
+                {
+                    best = i;
+                }
+            }
+            if (best != freeBlocks.size())
+            {
+                uint8_t *bytes = freeBlocks[best].bytes;
+                capacity = freeBlocks[best].capacity;
+                freeBlocks.erase(freeBlocks.begin() + best);
+                return bytes;
+            }
+            ++allocationCount;
+            allocatedByteCount += size;
+        }
 
-    int channels = topLayer.header.pixelDepth / 8;
+        capacity = (size + kAlignment - 1) / kAlignment * kAlignment;
+        void *bytes = aligned_alloc(kAlignment, capacity);
+        if (bytes == nullptr)
+        {
+            throw bad_alloc();
+        }
+        return static_cast<uint8_t *>(bytes);
+    }
 
-    for (unsigned int i = 0; i < imageSize; i += channels)
+    void release(uint8_t *bytes, size_t capacity)
     {
-        for (int j = 0; j < channels; ++j)
+        if (bytes == nullptr)
         {
-            float topColor = static_cast<float>(topLayer.data[i + j]) / 255.0f;
-            float bottomColor = static_cast<float>(bottomLayer.data[i + j]) / 255.0f;
+            return;
+        }
 
-            float blendedColor = 1.0f - (1.0f - topColor) * (1.0f - bottomColor);
-            blendedImage.data[i + j] = static_cast<uint8_t>(blendedColor * 255.0f);
+        lock_guard<mutex> guard(lock);
+        freeBlocks.push_back(FreeBlock{bytes, capacity});
+        if (freeBlocks.size() > kMaxFreeBlocks)
+        {
+            free(freeBlocks.front().bytes);
+            freeBlocks.erase(freeBlocks.begin());
         }
     }
 
-    return blendedImage;
-}
-
-/* Subtract blend method */
-TGAImage blendImagesSubtract(const TGAImage &topLayer, const TGAImage &bottomLayer)
-{
-    TGAImage blendedImage;
-    blendedImage.header = topLayer.header;
-    size_t imageSize = topLayer.header.width * topLayer.header.height * (topLayer.header.pixelDepth / 8);
-    blendedImage.data.resize(imageSize);
+    /* Number of blocks that had to be freshly allocated */
+    size_t allocations()
+    {
+        lock_guard<mutex> guard(lock);
+        return allocationCount;
+    }
 
-    int channels = topLayer.header.pixelDepth / 8;
+    /* Bytes requested by those fresh allocations */
+    size_t allocatedBytes()
+    {
+        lock_guard<mutex> guard(lock);
+        return allocatedByteCount;
+    }
 
-    for (unsigned int i = 0; i < imageSize; i += channels)
+private:
+    struct FreeBlock
     {
-        for (int j = 0; j < channels; ++j)
-        {
-            int topColor = static_cast<int>(topLayer.data[i + j]);
-            int bottomColor = static_cast<int>(bottomLayer.data[i + j]);
+        uint8_t *bytes;
+        size_t capacity;
+    };
 
-            int blendedColor = bottomColor - topColor;
-            blendedColor = max(0, blendedColor);
+    static const size_t kAlignment = 64;
+    static const size_t kMaxFreeBlocks = 4;
 
-            blendedImage.data[i + j] = static_cast<uint8_t>(blendedColor);
-        }
-    }
+    mutex lock;
+    vector<FreeBlock> freeBlocks;
+    size_t allocationCount = 0;
+    size_t allocatedByteCount = 0;
+};
 
-    return blendedImage;
+BufferPool &bufferPool()
+{
+    static BufferPool pool;
+    return pool;
 }
 
-/* Addition Blend Method */
-TGAImage blendImagesAddition(const TGAImage &topLayer, const TGAImage &bottomLayer)
+/*
+ * Pixel storage that either owns a pooled block or views a slice of a mapped file. A mapped buffer is read in
+ * place; asking for mutable access copies it into owned memory first.
+ */
+class PixelBuffer
 {
+public:
+    PixelBuffer() = default;
 
-    TGAImage blendedImage;
-    blendedImage.header = topLayer.header;
-    size_t imageSize = topLayer.header.width * topLayer.header.height * (topLayer.header.pixelDepth / 8);
-    blendedImage.data.resize(imageSize);
+    PixelBuffer(const PixelBuffer &other) : file(other.file), offset(other.offset), length(other.length)
+    {
+        if (!file && length > 0)
+        {
+            block = bufferPool().acquire(length, capacity);
+            memcpy(block, other.block, length);
+        }
+    }
 
-    int channels = topLayer.header.pixelDepth / 8;
+    PixelBuffer(PixelBuffer &&other) noexcept
+        : block(other.block), capacity(other.capacity), file(move(other.file)), offset(other.offset),
+          length(other.length)
+    {
+        other.block = nullptr;
+        other.capacity = 0;
+        other.length = 0;
+    }
 
-    for (unsigned int i = 0; i < imageSize; i += channels)
+    PixelBuffer &operator=(PixelBuffer other) noexcept
     {
-        for (int j = 0; j < channels; ++j)
-        {
-            int topColor = static_cast<int>(topLayer.data[i + j]);
-            int bottomColor = static_cast<int>(bottomLayer.data[i + j]);
+        swap(block, other.block);
+        swap(capacity, other.capacity);
+        swap(file, other.file);
+        swap(offset, other.offset);
+        swap(length, other.length);
+        return *this;
+    }
 
-            int blendedColor = bottomColor + topColor;
-            blendedColor = min(255, blendedColor);
+    ~PixelBuffer() { bufferPool().release(block, capacity); }
 
-            blendedImage.data[i + j] = static_cast<uint8_t>(blendedColor);
-        }
+    static PixelBuffer mapped(shared_ptr<const MappedFile> file, size_t offset, size_t length)
+    {
+        PixelBuffer buffer;
+        buffer.file = move(file);
+        buffer.offset = offset;
+        buffer.length = length;
+        return buffer;
     }
 
-    return blendedImage;
-}
+    bool isMapped() const { return file != nullptr; }
 
-/* Overlay Blend Method */
-TGAImage blendImagesOverlay(const TGAImage &topLayer, const TGAImage &bottomLayer)
-{
+    /* Faults a mapped view in ahead of use, so the first pass over it does not stall on the disk */
+    void prefetch() const
+    {
+        if (file)
+        {
+            volatile uint8_t sink = 0;
+            for (size_t i = 0; i < length; i += 4096)
+            {
+                sink = sink ^ data()[i];
+            }
+        }
+    }
+    size_t size() const { return length; }
 
-    TGAImage blendedImage;
-    blendedImage.header = topLayer.header;
-    unsigned int imageSize = topLayer.header.width * topLayer.header.height * (topLayer.header.pixelDepth / 8);
-    blendedImage.data.resize(imageSize);
+    const uint8_t *data() const { return file ? file->data() + offset : block; }
 
-    int channels = topLayer.header.pixelDepth / 8;
+    uint8_t *data()
+    {
+        makeOwned();
+        return block;
+    }
+
+    uint8_t operator[](size_t i) const { return data()[i]; }
+    uint8_t &operator[](size_t i) { return data()[i]; }
 
-    for (unsigned int i = 0; i < imageSize; i += channels)
+    /* Sizes the buffer for bytes that are about to be overwritten; the contents are left uninitialized */
+    void allocate(size_t newLength)
     {
-        float alpha = 1.0f;
-        if (channels == 4) {
-            alpha = static_cast<float>(topLayer.data[i + 3]) / 255.0f;
+        file.reset();
+        if (newLength > capacity)
+        {
+            bufferPool().release(block, capacity);
+            block = bufferPool().acquire(newLength, capacity);
         }
+        length = newLength;
+    }
 
-        for (int j = 0; j < channels; ++j)
+    /* Like vector::resize: keeps the existing bytes and zero-fills any growth */
+    void resize(size_t newLength)
+    {
+        makeOwned();
+        if (newLength > capacity)
         {
-            if (j == 3) {
-                continue;
-            }
-
-            float topColor = static_cast<float>(topLayer.data[i + j]) / 255.0f;
-            float bottomColor = static_cast<float>(bottomLayer.data[i + j]) / 255.0f;
+            size_t newCapacity;
+            uint8_t *newBlock = bufferPool().acquire(newLength, newCapacity);
+            memcpy(newBlock, block, length);
+            bufferPool().release(block, capacity);
+            block = newBlock;
+            capacity = newCapacity;
+        }
+        if (newLength > length)
+        {
+            memset(block + length, 0, newLength - length);
+        }
+        length = newLength;
+    }
 
-            float blendedColor = 0.0f;
-            if (bottomColor <= 0.5f)
-            {
-                blendedColor = 2.0f * topColor * bottomColor;
-            }
-            else
-            {
-                blendedColor = 1.0f - 2.0f * (1.0f - topColor) * (1.0f - bottomColor);
-            }
+    void clear()
+    {
+        file.reset();
+        length = 0;
+    }
 
-            blendedColor = (alpha * blendedColor) + ((1.0f - alpha) * bottomColor); // Apply alpha blending
-            blendedImage.data[i + j] = static_cast<uint8_t>(blendedColor * 255.0f);
+private:
+    void makeOwned()
+    {
+        if (file)
+        {
+            shared_ptr<const MappedFile> source = move(file);
+            allocate(length);
+            memcpy(block, source->data() + offset, length);
         }
     }
 
-    return blendedImage;
-}
+    uint8_t *block = nullptr;
+    size_t capacity = 0;
+    shared_ptr<const MappedFile> file;
+    size_t offset = 0;
+    size_t length = 0;
+};
 
-/* Add channel */
-TGAImage addToChannel(const TGAImage &inputImage, char channel, int n)
+struct TGAImage
 {
-    TGAImage modifiedImage;
-    modifiedImage.header = inputImage.header;
-    unsigned int imageSize = inputImage.header.width * inputImage.header.height * (inputImage.header.pixelDepth / 8);
-    modifiedImage.data.resize(imageSize);
+    TGAHeader header;
+    PixelBuffer data;
+};
 
-    int channels = inputImage.header.pixelDepth / 8;
+/*
+ * The pixel grid a loaded image's header describes, with every size worked out in 64 bits: a TGA side can be 65535
+ * pixels, so a 32-bit image reaches 16 GB and even one row times the height overflows 32-bit arithmetic.
+ */
+struct ImageLayout
+{
+    size_t width;
+    size_t height;
+    int channels;
+    size_t rowBytes;
+    size_t bytes;
+};
 
-    for (unsigned int i = 0; i < imageSize; i += channels)
+/* Throws unless the pixels are 8, 24 or 32 bits, the sizes loadTGA converts every format to */
+ImageLayout imageLayout(const TGAHeader &header)
+{
+    int depth = static_cast<uint8_t>(header.pixelDepth);
+    if (depth != 8 && depth != 24 && depth != 32)
     {
-        for (int j = 0; j < channels; ++j)
-        {
-            if ((j == 0 && channel == 'R') || (j == 1 && channel == 'G') || (j == 2 && channel == 'B'))
-            {
-                modifiedImage.data[i + j] = min(255, max(0, static_cast<int>(inputImage.data[i + j]) + n));
-            }
-            else
-            {
-                modifiedImage.data[i + j] = inputImage.data[i + j];
-            }
-        }
+        throw runtime_error("Unsupported pixel depth of " + to_string(depth) + " bits");
     }
-
-    return modifiedImage;
+    ImageLayout layout;
+    layout.width = header.width;
+    layout.height = header.height;
+    layout.channels = depth / 8;
+    layout.rowBytes = layout.width * layout.channels;
+    layout.bytes = layout.rowBytes * layout.height;
+    return layout;
 }
 
-/* Scale Channel */
-TGAImage scaleChannel(const TGAImage &inputImage, char channel, float n)
+/*
+ * Profiler
+ *
+ * --profile records one trace event per load, save, fused run of per-pixel ops and geometric op. Each event holds
+ * its wall time, bytes read and written, fresh pool allocations and, where perf_event_open is allowed, CPU cycles
+ * and last-level cache misses summed over the chain's threads. Events are written as Chrome trace JSON (load it in
+ * chrome://tracing or Perfetto), and a summary is printed at exit.
+ */
+struct ProfileEvent
 {
-    TGAImage modifiedImage;
-    modifiedImage.header = inputImage.header;
-    unsigned int imageSize = inputImage.header.width * inputImage.header.height * (inputImage.header.pixelDepth / 8);
-    modifiedImage.data.resize(imageSize);
+    string category;
+    string name;
+    double start;
+    double duration;
+    unsigned thread;
+    size_t bytesRead;
+    size_t bytesWritten;
+    size_t allocations;
+    size_t allocatedBytes;
+    bool haveCounters;
+    uint64_t cycles;
+    uint64_t cacheMisses;
+};
 
-    int channels = inputImage.header.pixelDepth / 8;
+class Profiler
+{
+public:
+    ~Profiler()
+    {
+        for (int fd : counterFds)
+        {
+            close(fd);
+        }
+    }
+
+    bool enabled() const { return on; }
 
-    for (unsigned int i = 0; i < imageSize; i += channels)
+    void start(const string &filename)
     {
-        for (int j = 0; j < channels; ++j)
+        traceFilename = filename;
+        origin = chrono::steady_clock::now();
+        on = true;
+        attachThread();
+    }
+
+    /* Starts counting hardware events on the calling thread; the pool's workers call this as they start */
+    void attachThread()
+    {
+        if (!on)
         {
-            if ((j == 0 && channel == 'R') || (j == 1 && channel == 'G') || (j == 2 && channel == 'B'))
-            {
-                modifiedImage.data[i + j] = min(255.0f, max(0.0f, static_cast<float>(inputImage.data[i + j]) * n));
-            }
-            else
+            return;
+        }
+#ifdef __linux__
+        pid_t thread = static_cast<pid_t>(syscall(SYS_gettid));
+        int cycles = openCounter(thread, PERF_COUNT_HW_CPU_CYCLES);
+        int misses = cycles >= 0 ? openCounter(thread, PERF_COUNT_HW_CACHE_MISSES) : -1;
+        lock_guard<mutex> guard(lock);
+        if (cycles >= 0 && misses >= 0)
+        {
+            counterFds.push_back(cycles);
+            counterFds.push_back(misses);
+        }
+        else
+        {
+            if (cycles >= 0)
             {
-                modifiedImage.data[i + j] = inputImage.data[i + j];
+                close(cycles);
             }
+            countersMissing = true;
         }
+#else
+        countersMissing = true;
+#endif
     }
-    return modifiedImage;
-}
-
 
-/* Combine Channels */
-TGAImage combineChannels(const TGAImage &redImage, const TGAImage &greenImage, const TGAImage &blueImage)
-{
-    TGAImage combinedImage;
-    combinedImage.header = redImage.header;
-    unsigned int imageSize = redImage.header.width * redImage.header.height * (redImage.header.pixelDepth / 8);
-    combinedImage.data.resize(imageSize);
+    double now() const { return chrono::duration<double, micro>(chrono::steady_clock::now() - origin).count(); }
 
-    int channels = redImage.header.pixelDepth / 8;
+    /* Cycles and cache misses so far, summed over every attached thread; false when any thread has no counters */
+    bool readCounters(uint64_t &cycles, uint64_t &cacheMisses)
+    {
+        lock_guard<mutex> guard(lock);
+        cycles = 0;
+        cacheMisses = 0;
+        for (size_t i = 0; i < counterFds.size(); ++i)
+        {
+            uint64_t value = 0;
+            if (read(counterFds[i], &value, sizeof(value)) != static_cast<ssize_t>(sizeof(value)))
+            {
+                return false;
+            }
+            (i % 2 == 0 ? cycles : cacheMisses) += value;
+        }
+        return !countersMissing && !counterFds.empty();
+    }
 
-    for (unsigned int i = 0; i < imageSize; i += channels)
+    unsigned threadNumber()
     {
-        combinedImage.data[i] = redImage.data[i];
-        combinedImage.data[i + 1] = greenImage.data[i + 1];
-        combinedImage.data[i + 2] = blueImage.data[i + 2];
+        static atomic<unsigned> nextThread{0};
+        static thread_local unsigned number = nextThread++;
+        return number;
     }
 
-    return combinedImage;
-}
+    void record(ProfileEvent event)
+    {
+        lock_guard<mutex> guard(lock);
+        events.push_back(move(event));
+    }
 
-TGAImage extractChannel(const TGAImage &inputImage, char channel)
-{
-    TGAImage extractedImage;
-    extractedImage.header = inputImage.header;
-    unsigned int imageSize = inputImage.header.width * inputImage.header.height * (inputImage.header.pixelDepth / 8);
-    extractedImage.data.resize(imageSize);
+    /* Writes the trace file and prints a per-event summary; runs at exit, so it reports errors instead of throwing */
+    void finish()
+    {
+        if (!on)
+        {
+            return;
+        }
+        on = false;
 
-    int channels = inputImage.header.pixelDepth / 8;
+        ofstream trace(traceFilename);
+        trace << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        for (size_t i = 0; i < events.size(); ++i)
+        {
+            const ProfileEvent &event = events[i];
+            trace << "  {\"name\": \"" << escaped(event.name) << "\", \"cat\": \"" << event.category
+                  << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread << fixed << setprecision(3)
+                  << ", \"ts\": " << event.start << ", \"dur\": " << event.duration
+                  << ", \"args\": {\"bytesRead\": " << event.bytesRead << ", \"bytesWritten\": " << event.bytesWritten
+                  << ", \"GBps\": " << throughput(event) << ", \"allocations\": " << event.allocations
+                  << ", \"allocatedBytes\": " << event.allocatedBytes;
+            if (event.haveCounters)
+            {
+                trace << ", \"cycles\": " << event.cycles << ", \"llcMisses\": " << event.cacheMisses;
+            }
+            trace << "}}" << (i + 1 < events.size() ? ",\n" : "\n");
+        }
+        trace << "]}\n";
+        if (!trace)
+        {
+            cout << "Error: Could not write file: " << traceFilename << "\n";
+        }
 
-    for (unsigned int i = 0; i < imageSize; i += channels)
-    {
-        for (int j = 0; j < channels; ++j)
+        printf("%-9s %-40s %10s %10s %10s %8s %6s %12s %10s\n", "category", "event", "ms", "read MB", "write MB",
+               "GB/s", "alloc", "cycles", "LLC miss");
+        for (const ProfileEvent &event : events)
         {
-            if ((j == 0 && channel == 'R') || (j == 1 && channel == 'G') || (j == 2 && channel == 'B'))
+            string name = event.name.size() > 40 ? event.name.substr(0, 37) + "..." : event.name;
+            printf("%-9s %-40s %10.3f %10.2f %10.2f %8.2f %6zu", event.category.c_str(), name.c_str(),
+                   event.duration / 1e3, event.bytesRead / 1e6, event.bytesWritten / 1e6, throughput(event),
+                   event.allocations);
+            if (event.haveCounters)
             {
-                extractedImage.data[i + j] = inputImage.data[i + j];
+                printf(" %12llu %10llu\n", static_cast<unsigned long long>(event.cycles),
+                       static_cast<unsigned long long>(event.cacheMisses));
             }
             else
             {
-                extractedImage.data[i + j] = 0;
+                printf(" %12s %10s\n", "-", "-");
             }
         }
+        if (countersMissing)
+        {
+            printf("Hardware counters are unavailable (perf_event_open was refused or is not supported).\n");
+        }
+        printf("Trace written to %s\n", traceFilename.c_str());
     }
-    return extractedImage;
-}
 
-/* Rotate 180 Degrees */
-TGAImage rotate180(const TGAImage &inputImage)
-{
-    TGAImage rotatedImage;
-    rotatedImage.header = inputImage.header;
-    unsigned int imageSize = inputImage.header.width * inputImage.header.height * (inputImage.header.pixelDepth / 8);
-    rotatedImage.data.resize(imageSize);
+private:
+#ifdef __linux__
+    static int openCounter(pid_t thread, uint64_t config)
+    {
+        perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.size = sizeof(attributes);
+        attributes.config = config;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attributes, thread, -1, -1, 0));
+    }
+#endif
 
-    int channels = inputImage.header.pixelDepth / 8;
+    static double throughput(const ProfileEvent &event)
+    {
+        return event.duration > 0 ? (event.bytesRead + event.bytesWritten) / (event.duration * 1e3) : 0.0;
+    }
 
-    for (int y = 0; y < inputImage.header.height; ++y)
+    static string escaped(const string &text)
     {
-        for (int x = 0; x < inputImage.header.width; ++x)
+        string out;
+        for (char c : text)
         {
-            unsigned int srcIndex = (y * inputImage.header.width + x) * channels;
-            unsigned int dstIndex = ((inputImage.header.height - y - 1) * inputImage.header.width + (inputImage.header.width - x - 1)) * channels;
-
-            for (int c = 0; c < channels; ++c)
+            if (c == '"' || c == '\\')
             {
-                rotatedImage.data[dstIndex + c] = inputImage.data[srcIndex + c];
+                out += '\\';
+            }
+            if (static_cast<unsigned char>(c) >= 0x20)
+            {
+                out += c;
             }
         }
+        return out;
     }
 
-    return rotatedImage;
+    atomic<bool> on{false};
+    bool countersMissing = false;
+    string traceFilename;
+    chrono::steady_clock::time_point origin;
+    mutex lock;
+    vector<int> counterFds;
+    vector<ProfileEvent> events;
+};
+
+Profiler &profiler()
+{
+    static Profiler instance;
+    return instance;
 }
 
-void saveTGA(const string &filename, const TGAImage &image)
+/* Times its own lifetime as one trace event; costs a flag check when profiling is off */
+class ProfileScope
 {
-    ofstream file(filename, ios::binary);
+public:
+    ProfileScope(const char *category, const string &name, size_t bytesRead = 0, size_t bytesWritten = 0)
+    {
+        if (!profiler().enabled())
+        {
+            return;
+        }
+        active = true;
+        event.category = category;
+        event.name = name;
+        event.bytesRead = bytesRead;
+        event.bytesWritten = bytesWritten;
+        event.thread = profiler().threadNumber();
+        startAllocations = bufferPool().allocations();
+        startAllocatedBytes = bufferPool().allocatedBytes();
+        event.haveCounters = profiler().readCounters(startCycles, startCacheMisses);
+        event.start = profiler().now();
+    }
 
-    if (!file.is_open())
+    ~ProfileScope()
     {
-        throw runtime_error("Error: Could not open file: " + filename);
+        if (!active)
+        {
+            return;
+        }
+        event.duration = profiler().now() - event.start;
+        uint64_t cycles = 0;
+        uint64_t cacheMisses = 0;
+        event.haveCounters = profiler().readCounters(cycles, cacheMisses) && event.haveCounters;
+        event.cycles = cycles - startCycles;
+        event.cacheMisses = cacheMisses - startCacheMisses;
+        event.allocations = bufferPool().allocations() - startAllocations;
+        event.allocatedBytes = bufferPool().allocatedBytes() - startAllocatedBytes;
+        profiler().record(move(event));
     }
 
-    file.write(reinterpret_cast<const char *>(&image.header), sizeof(TGAHeader));
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
 
-    unsigned int imageSize = image.header.width * image.header.height * (image.header.pixelDepth / 8);
-    file.write(reinterpret_cast<const char *>(image.data.data()), imageSize);
+    void setBytes(size_t bytesRead, size_t bytesWritten)
+    {
+        event.bytesRead = bytesRead;
+        event.bytesWritten = bytesWritten;
+    }
+
+private:
+    bool active = false;
+    ProfileEvent event{};
+    size_t startAllocations = 0;
+    size_t startAllocatedBytes = 0;
+    uint64_t startCycles = 0;
+    uint64_t startCacheMisses = 0;
+};
+
+
+/*
+ * TGA Codec
+ *
+ * Supports uncompressed and RLE color-mapped (1, 9), true-color (2, 10) and grayscale (3, 11) images. Images are
+ * normalized on load: the ID field is skipped, color maps and 15/16-bit pixels are expanded to 24/32-bit BGR(A),
+ * and 8-bit grayscale stays one channel per pixel.
+ */
+enum TGADataType
+{
+    kColorMapped = 1,
+    kTrueColor = 2,
+    kGrayscale = 3,
+    kRleColorMapped = 9,
+    kRleTrueColor = 10,
+    kRleGrayscale = 11
+};
+
+/* Number of pixels, starting at the first one, that repeat its value (at least 1, at most count) */
+size_t repeatLength(const uint8_t *pixels, size_t count, int bpp)
+{
+    size_t i = 1;
+#ifdef TGA_X86_SIMD
+    // A 16-byte pattern of the first pixel repeated; bpp 3 uses 15 of the bytes, i.e. five pixels per compare
+    int perVector = 16 / bpp;
+    int fullMask = (1 << (perVector * bpp)) - 1;
+    uint8_t repeated[16];
+    for (int k = 0; k < 16; ++k)
+    {
+        repeated[k] = pixels[k % bpp];
+    }
+    __m128i pattern = _mm_loadu_si128(reinterpret_cast<const __m128i *>(repeated));
+    i = 0;
+    for (; (i + perVector) * bpp <= count * bpp && i * bpp + 16 <= count * bpp; i += perVector)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + i * bpp));
+        int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern)) & fullMask;
+        if (equal != fullMask)
+        {
+            return i + __builtin_ctz(~equal) / bpp;
+        }
+    }
+    i = max<size_t>(i, 1);
+#endif
+    for (; i < count; ++i)
+    {
+        if (memcmp(pixels + i * bpp, pixels, bpp) != 0)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+/* Number of pixels before the first pair of equal neighbours, i.e. the length of a raw packet (at most count) */
+size_t literalLength(const uint8_t *pixels, size_t count, int bpp)
+{
+    size_t i = 0;
+#ifdef TGA_X86_SIMD
+    // Compares every pixel with its right-hand neighbour, a vector at a time
+    int perVector = 16 / bpp;
+    int pixelMask = (1 << bpp) - 1;
+    for (; (i + 1) * bpp + 16 <= count * bpp; i += perVector)
+    {
+        __m128i current = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + i * bpp));
+        __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + (i + 1) * bpp));
+        int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(current, next));
+        if (equal == 0)
+        {
+            continue;
+        }
+        for (int k = 0; k < perVector; ++k)
+        {
+            if (((equal >> (k * bpp)) & pixelMask) == pixelMask)
+            {
+                return max<size_t>(1, i + k);
+            }
+        }
+    }
+#endif
+    for (; i + 1 < count; ++i)
+    {
+        if (memcmp(pixels + i * bpp, pixels + (i + 1) * bpp, bpp) == 0)
+        {
+            return max<size_t>(1, i);
+        }
+    }
+    return count;
+}
+
+/* RLE-encodes one scanline; packets never cross rows, as the spec requires */
+void encodeRleRow(const uint8_t *row, size_t width, int bpp, vector<uint8_t> &out)
+{
+    size_t x = 0;
+    while (x < width)
+    {
+        size_t count = min<size_t>(128, width - x);
+        const uint8_t *pixel = row + x * bpp;
+        size_t run = repeatLength(pixel, count, bpp);
+        if (run >= 2)
+        {
+            out.push_back(static_cast<uint8_t>(0x80 | (run - 1)));
+            out.insert(out.end(), pixel, pixel + bpp);
+            x += run;
+            continue;
+        }
+
+        size_t literal = literalLength(pixel, count, bpp);
+        out.push_back(static_cast<uint8_t>(literal - 1));
+        out.insert(out.end(), pixel, pixel + literal * bpp);
+        x += literal;
+    }
+}
+
+/* Decodes pixelCount RLE pixels into dst and returns the number of source bytes consumed */
+size_t decodeRle(const uint8_t *src, size_t srcSize, uint8_t *dst, size_t pixelCount, int bpp)
+{
+    size_t in = 0;
+    size_t decoded = 0;
+    while (decoded < pixelCount)
+    {
+        if (in >= srcSize)
+        {
+            throw runtime_error("Truncated RLE data");
+        }
+        uint8_t packet = src[in++];
+        size_t count = (packet & 0x7F) + 1;
+        if (count > pixelCount - decoded)
+        {
+            throw runtime_error("RLE packet runs past the end of the image");
+        }
+
+        uint8_t *out = dst + decoded * bpp;
+        if (packet & 0x80)
+        {
+            if (srcSize - in < static_cast<size_t>(bpp))
+            {
+                throw runtime_error("Truncated RLE data");
+            }
+            if (bpp == 1)
+            {
+                memset(out, src[in], count);
+            }
+            else
+            {
+                for (size_t k = 0; k < count; ++k)
+                {
+                    memcpy(out + k * bpp, src + in, bpp);
+                }
+            }
+            in += bpp;
+        }
+        else
+        {
+            size_t bytes = count * bpp;
+            if (srcSize - in < bytes)
+            {
+                throw runtime_error("Truncated RLE data");
+            }
+            memcpy(out, src + in, bytes);
+            in += bytes;
+        }
+        decoded += count;
+    }
+    return in;
+}
+
+/* Expands a 15/16-bit ARRRRRGGGGGBBBBB pixel to 24-bit BGR */
+void expand16To24(const uint8_t *src, uint8_t *dst)
+{
+    unsigned value = src[0] | (src[1] << 8);
+    unsigned blue = value & 0x1F;
+    unsigned green = (value >> 5) & 0x1F;
+    unsigned red = (value >> 10) & 0x1F;
+    dst[0] = static_cast<uint8_t>((blue << 3) | (blue >> 2));
+    dst[1] = static_cast<uint8_t>((green << 3) | (green >> 2));
+    dst[2] = static_cast<uint8_t>((red << 3) | (red >> 2));
+}
+
+/* Byte offset of the pixel data: after the header, the image ID and the color map */
+size_t pixelDataOffset(const TGAHeader &header)
+{
+    size_t offset = sizeof(TGAHeader) + static_cast<uint8_t>(header.idLength);
+    if (header.colorMapType == 1)
+    {
+        offset += static_cast<size_t>(header.colorMapLength) *
+                  ((static_cast<uint8_t>(header.colorMapDepth) + 7) / 8);
+    }
+    return offset;
+}
+
+/* Maps the file and parses the header straight from the mapping; raw 8/24/32-bit pixels are read in place */
+TGAImage loadTGA(const string &filename)
+{
+    ProfileScope scope("io", "loadTGA " + filename);
+    TGAImage image;
+    auto file = make_shared<const MappedFile>(filename);
+
+    if (file->size() < sizeof(TGAHeader))
+    {
+        throw runtime_error("Failed to read the TGA header: " + filename);
+    }
+    memcpy(&image.header, file->data(), sizeof(TGAHeader));
+    TGAHeader &header = image.header;
+
+    int type = static_cast<uint8_t>(header.dataTypeCode);
+    bool rle = type == kRleColorMapped || type == kRleTrueColor || type == kRleGrayscale;
+    int baseType = rle ? type - 8 : type;
+    int depth = static_cast<uint8_t>(header.pixelDepth);
+    int mapDepth = static_cast<uint8_t>(header.colorMapDepth);
+    bool validDepth = (baseType == kColorMapped && (depth == 8 || depth == 16) &&
+                       (mapDepth == 15 || mapDepth == 16 || mapDepth == 24 || mapDepth == 32)) ||
+                      (baseType == kTrueColor && (depth == 15 || depth == 16 || depth == 24 || depth == 32)) ||
+                      (baseType == kGrayscale && depth == 8);
+    if (!validDepth)
+    {
+        throw runtime_error("Unsupported TGA image type " + to_string(type) + " with " + to_string(depth) +
+                            "-bit pixels: " + filename);
+    }
+
+    // Skip the image ID, then the color map (which only color-mapped images use)
+    size_t mapOffset = sizeof(TGAHeader) + static_cast<uint8_t>(header.idLength);
+    size_t mapEntries = header.colorMapType == 1 ? header.colorMapLength : 0;
+    int mapEntryBytes = (mapDepth + 7) / 8;
+    size_t offset = pixelDataOffset(header);
+    if (offset > file->size())
+    {
+        throw runtime_error("Truncated TGA file: " + filename);
+    }
+
+    int storedBytes = (depth + 7) / 8;
+    size_t pixelCount = static_cast<size_t>(header.width) * header.height;
+    size_t available = file->size() - offset;
+    const uint8_t *stored = file->data() + offset;
+
+    if (!rle && baseType != kColorMapped && storedBytes != 2)
+    {
+        if (available < pixelCount * storedBytes)
+        {
+            throw runtime_error("Truncated TGA file: " + filename);
+        }
+        image.data = PixelBuffer::mapped(file, offset, pixelCount * storedBytes);
+    }
+    else
+    {
+        PixelBuffer decoded;
+        if (rle)
+        {
+            decoded.allocate(pixelCount * storedBytes);
+            try
+            {
+                decodeRle(stored, available, decoded.data(), pixelCount, storedBytes);
+            }
+            catch (const runtime_error &error)
+            {
+                throw runtime_error(string(error.what()) + ": " + filename);
+            }
+            stored = as_const(decoded).data();
+        }
+        else if (available < pixelCount * storedBytes)
+        {
+            throw runtime_error("Truncated TGA file: " + filename);
+        }
+
+        if (baseType == kColorMapped)
+        {
+            const uint8_t *colorMap = file->data() + mapOffset;
+            int firstEntry = header.colorMapOrigin;
+            int outBytes = mapEntryBytes == 4 ? 4 : 3;
+            image.data.allocate(pixelCount * outBytes);
+            uint8_t *pixels = image.data.data();
+            for (size_t i = 0; i < pixelCount; ++i)
+            {
+                size_t index = storedBytes == 1 ? stored[i] : (stored[2 * i] | (stored[2 * i + 1] << 8));
+                if (index < static_cast<size_t>(firstEntry) || index - firstEntry >= mapEntries)
+                {
+                    throw runtime_error("Color map index out of range: " + filename);
+                }
+                const uint8_t *entry = colorMap + (index - firstEntry) * mapEntryBytes;
+                if (mapEntryBytes == 2)
+                {
+                    expand16To24(entry, pixels + i * 3);
+                }
+                else
+                {
+                    memcpy(pixels + i * outBytes, entry, outBytes);
+                }
+            }
+            header.pixelDepth = static_cast<char>(outBytes * 8);
+        }
+        else if (storedBytes == 2)
+        {
+            image.data.allocate(pixelCount * 3);
+            uint8_t *pixels = image.data.data();
+            for (size_t i = 0; i < pixelCount; ++i)
+            {
+                expand16To24(stored + i * 2, pixels + i * 3);
+            }
+            header.pixelDepth = 24;
+        }
+        else
+        {
+            image.data = move(decoded);
+        }
+    }
+
+    // Converted images get 8 alpha bits only when they have a fourth channel
+    if (baseType == kColorMapped || storedBytes == 2)
+    {
+        header.imageDescriptor = static_cast<char>((header.imageDescriptor & 0x30) | (header.pixelDepth == 32 ? 8 : 0));
+    }
+    header.idLength = 0;
+    header.colorMapType = 0;
+    header.colorMapOrigin = 0;
+    header.colorMapLength = 0;
+    header.colorMapDepth = 0;
+    header.dataTypeCode = static_cast<char>(baseType == kGrayscale ? kGrayscale : kTrueColor);
+
+    // Mapped pixels are only read by the first op that touches them
+    if (!image.data.isMapped())
+    {
+        scope.setBytes(file->size(), image.data.size());
+    }
+    return image;
+}
+/*
+ * The float blend kernels double as the scalar tail of the SIMD kernels further down. They are kept out of line so
+ * that they are never recompiled inside an AVX-512 function, where the implied FMA would change their rounding.
+ */
+#define TGA_NOINLINE __attribute__((noinline))
+
+/* Multiply Blend Kernel */
+TGA_NOINLINE void multiplyPixels(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end, int channels)
+{
+    for (size_t i = begin; i < end; i += channels)
+    {
+        for (int j = 0; j < channels; ++j)
+        {
+            float topColor = static_cast<float>(top[i + j]) / 255.0f;
+            float bottomColor = static_cast<float>(bottom[i + j]) / 255.0f;
+
+            float blendedColor = topColor * bottomColor;
+            dst[i + j] = static_cast<uint8_t>(blendedColor * 255.0f);
+        }
+    }
+}
+
+/* Screen Blend Kernel */
+TGA_NOINLINE void screenPixels(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end, int channels)
+{
+    for (size_t i = begin; i < end; i += channels)
+    {
+        for (int j = 0; j < channels; ++j)
+        {
+            float topColor = static_cast<float>(top[i + j]) / 255.0f;
+            float bottomColor = static_cast<float>(bottom[i + j]) / 255.0f;
+
+            float blendedColor = 1.0f - (1.0f - topColor) * (1.0f - bottomColor);
+            dst[i + j] = static_cast<uint8_t>(blendedColor * 255.0f);
+        }
+    }
+}
+
+/* Subtract Blend Kernel */
+void subtractPixels(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end, int channels)
+{
+    for (size_t i = begin; i < end; i += channels)
+    {
+        for (int j = 0; j < channels; ++j)
+        {
+            int topColor = static_cast<int>(top[i + j]);
+            int bottomColor = static_cast<int>(bottom[i + j]);
+
+            int blendedColor = bottomColor - topColor;
+            blendedColor = max(0, blendedColor);
+
+            dst[i + j] = static_cast<uint8_t>(blendedColor);
+        }
+    }
+}
+
+/* Addition Blend Kernel */
+void additionPixels(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end, int channels)
+{
+    for (size_t i = begin; i < end; i += channels)
+    {
+        for (int j = 0; j < channels; ++j)
+        {
+            int topColor = static_cast<int>(top[i + j]);
+            int bottomColor = static_cast<int>(bottom[i + j]);
+
+            int blendedColor = bottomColor + topColor;
+            blendedColor = min(255, blendedColor);
+
+            dst[i + j] = static_cast<uint8_t>(blendedColor);
+        }
+    }
+}
+
+/* Overlay Blend Kernel */
+TGA_NOINLINE void overlayPixels(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end, int channels)
+{
+    for (size_t i = begin; i < end; i += channels)
+    {
+        float alpha = 1.0f;
+        if (channels == 4) {
+            alpha = static_cast<float>(top[i + 3]) / 255.0f;
+        }
+
+        for (int j = 0; j < channels; ++j)
+        {
+            if (j == 3) {
+                dst[i + j] = 0; // The alpha channel is not carried over
+                continue;
+            }
+
+            float topColor = static_cast<float>(top[i + j]) / 255.0f;
+            float bottomColor = static_cast<float>(bottom[i + j]) / 255.0f;
+
+            float blendedColor = 0.0f;
+            if (bottomColor <= 0.5f)
+            {
+                blendedColor = 2.0f * topColor * bottomColor;
+            }
+            else
+            {
+                blendedColor = 1.0f - 2.0f * (1.0f - topColor) * (1.0f - bottomColor);
+            }
+
+            blendedColor = (alpha * blendedColor) + ((1.0f - alpha) * bottomColor); // Apply alpha blending
+            dst[i + j] = static_cast<uint8_t>(blendedColor * 255.0f);
+        }
+    }
+}
+
+/*
+ * SIMD Blend Kernels
+ *
+ * Each kernel reproduces the scalar kernel above bit for bit. The float blends (multiply, screen, overlay) run
+ * the same IEEE operations in the same order, just several lanes at a time; subtract and addition map directly
+ * onto saturating byte arithmetic. Leftover bytes fall through to the scalar kernels.
+ */
+typedef void (*BlendKernel)(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end,
+                            int channels);
+
+struct BlendKernels
+{
+    BlendKernel multiply;
+    BlendKernel screen;
+    BlendKernel subtract;
+    BlendKernel addition;
+    BlendKernel overlay;
+    const char *name;
+};
+
+#ifdef TGA_X86_SIMD
+#define TGA_TARGET_AVX2 __attribute__((target("avx2")))
+#define TGA_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+
+/* SSE2 */
+struct MultiplyBlendSSE2
+{
+    static __m128 apply(__m128 top, __m128 bottom) { return _mm_mul_ps(top, bottom); }
+};
+
+struct ScreenBlendSSE2
+{
+    static __m128 apply(__m128 top, __m128 bottom)
+    {
+        __m128 one = _mm_set1_ps(1.0f);
+        return _mm_sub_ps(one, _mm_mul_ps(_mm_sub_ps(one, top), _mm_sub_ps(one, bottom)));
+    }
+};
+
+struct OverlayBlendSSE2
+{
+    static __m128 apply(__m128 top, __m128 bottom)
+    {
+        __m128 one = _mm_set1_ps(1.0f);
+        __m128 two = _mm_set1_ps(2.0f);
+        __m128 dark = _mm_mul_ps(_mm_mul_ps(two, top), bottom);
+        __m128 light = _mm_sub_ps(one, _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(one, top)), _mm_sub_ps(one, bottom)));
+        __m128 useDark = _mm_cmple_ps(bottom, _mm_set1_ps(0.5f));
+        return _mm_or_ps(_mm_and_ps(useDark, dark), _mm_andnot_ps(useDark, light));
+    }
+};
+
+/* Widens 16 bytes to four vectors of normalized floats (value / 255) */
+static inline void loadNormalizedSSE2(const uint8_t *src, __m128 out[4])
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    __m128i low = _mm_unpacklo_epi8(bytes, zero);
+    __m128i high = _mm_unpackhi_epi8(bytes, zero);
+    __m128 scale = _mm_set1_ps(255.0f);
+    out[0] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(low, zero)), scale);
+    out[1] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(low, zero)), scale);
+    out[2] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(high, zero)), scale);
+    out[3] = _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(high, zero)), scale);
+}
+
+/* Scales four vectors back by 255 and truncates them to bytes, like static_cast<uint8_t> */
+static inline void storeDenormalizedSSE2(uint8_t *dst, const __m128 in[4])
+{
+    __m128 scale = _mm_set1_ps(255.0f);
+    __m128i a = _mm_cvttps_epi32(_mm_mul_ps(in[0], scale));
+    __m128i b = _mm_cvttps_epi32(_mm_mul_ps(in[1], scale));
+    __m128i c = _mm_cvttps_epi32(_mm_mul_ps(in[2], scale));
+    __m128i d = _mm_cvttps_epi32(_mm_mul_ps(in[3], scale));
+    __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), bytes);
+}
+
+template <typename Blend>
+void floatBlendSSE2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end)
+{
+    size_t i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+        __m128 topColor[4], bottomColor[4], blendedColor[4];
+        loadNormalizedSSE2(top + i, topColor);
+        loadNormalizedSSE2(bottom + i, bottomColor);
+        for (int k = 0; k < 4; ++k)
+        {
+            blendedColor[k] = Blend::apply(topColor[k], bottomColor[k]);
+        }
+        storeDenormalizedSSE2(dst + i, blendedColor);
+    }
+}
+
+void multiplyPixelsSSE2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end,
+                        int channels)
+{
+    size_t vectorEnd = begin + (end - begin) / 16 * 16;
+    floatBlendSSE2<MultiplyBlendSSE2>(dst, top, bottom, begin, vectorEnd);
+    multiplyPixels(dst, top, bottom, vectorEnd, end, 1);
+}
+
+void screenPixelsSSE2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end,
+                      int channels)
+{
+    size_t vectorEnd = begin + (end - begin) / 16 * 16;
+    floatBlendSSE2<ScreenBlendSSE2>(dst, top, bottom, begin, vectorEnd);
+    screenPixels(dst, top, bottom, vectorEnd, end, 1);
+}
+
+void subtractPixelsSSE2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end,
+                        int channels)
+{
+    size_t i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+        __m128i topColor = _mm_loadu_si128(reinterpret_cast<const __m128i *>(top + i));
+        __m128i bottomColor = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_subs_epu8(bottomColor, topColor));
+    }
+    subtractPixels(dst, top, bottom, i, end, 1);
+}
+
+void additionPixelsSSE2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end,
+                        int channels)
+{
+    size_t i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+        __m128i topColor = _mm_loadu_si128(reinterpret_cast<const __m128i *>(top + i));
+        __m128i bottomColor = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_adds_epu8(bottomColor, topColor));
+    }
+    additionPixels(dst, top, bottom, i, end, 1);
+}
+
+void overlayPixelsSSE2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end,
+                       int channels)
+{
+    size_t vectorEnd = begin + (end - begin) / 16 * 16;
+    if (channels != 4)
+    {
+        // Without an alpha channel overlay is a plain per-byte blend
+        floatBlendSSE2<OverlayBlendSSE2>(dst, top, bottom, begin, vectorEnd);
+        overlayPixels(dst, top, bottom, vectorEnd, end, 1);
+        return;
+    }
+
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 colorMask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+    for (size_t i = begin; i < vectorEnd; i += 16)
+    {
+        // One BGRA pixel per vector; lane 3 holds the top layer's alpha
+        __m128 topColor[4], bottomColor[4], blendedColor[4];
+        loadNormalizedSSE2(top + i, topColor);
+        loadNormalizedSSE2(bottom + i, bottomColor);
+        for (int k = 0; k < 4; ++k)
+        {
+            __m128 alpha = _mm_shuffle_ps(topColor[k], topColor[k], _MM_SHUFFLE(3, 3, 3, 3));
+            __m128 blended = OverlayBlendSSE2::apply(topColor[k], bottomColor[k]);
+            blended = _mm_add_ps(_mm_mul_ps(alpha, blended), _mm_mul_ps(_mm_sub_ps(one, alpha), bottomColor[k]));
+            blendedColor[k] = _mm_and_ps(blended, colorMask);
+        }
+        storeDenormalizedSSE2(dst + i, blendedColor);
+    }
+    overlayPixels(dst, top, bottom, vectorEnd, end, channels);
+}
+
+/* AVX2 */
+struct MultiplyBlendAVX2
+{
+    TGA_TARGET_AVX2 static __m256 apply(__m256 top, __m256 bottom) { return _mm256_mul_ps(top, bottom); }
+};
+
+struct ScreenBlendAVX2
+{
+    TGA_TARGET_AVX2 static __m256 apply(__m256 top, __m256 bottom)
+    {
+        __m256 one = _mm256_set1_ps(1.0f);
+        return _mm256_sub_ps(one, _mm256_mul_ps(_mm256_sub_ps(one, top), _mm256_sub_ps(one, bottom)));
+    }
+};
+
+struct OverlayBlendAVX2
+{
+    TGA_TARGET_AVX2 static __m256 apply(__m256 top, __m256 bottom)
+    {
+        __m256 one = _mm256_set1_ps(1.0f);
+        __m256 two = _mm256_set1_ps(2.0f);
+        __m256 dark = _mm256_mul_ps(_mm256_mul_ps(two, top), bottom);
+        __m256 light = _mm256_sub_ps(one, _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(one, top)),
+                                                        _mm256_sub_ps(one, bottom)));
+        __m256 useDark = _mm256_cmp_ps(bottom, _mm256_set1_ps(0.5f), _CMP_LE_OQ);
+        return _mm256_blendv_ps(light, dark, useDark);
+    }
+};
+
+TGA_TARGET_AVX2 static inline void loadNormalizedAVX2(const uint8_t *src, __m256 out[2])
+{
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    __m256 scale = _mm256_set1_ps(255.0f);
+    out[0] = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes)), scale);
+    out[1] = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8))), scale);
+}
+
+TGA_TARGET_AVX2 static inline void storeDenormalizedAVX2(uint8_t *dst, const __m256 in[2])
+{
+    __m256 scale = _mm256_set1_ps(255.0f);
+    __m256i a = _mm256_cvttps_epi32(_mm256_mul_ps(in[0], scale));
+    __m256i b = _mm256_cvttps_epi32(_mm256_mul_ps(in[1], scale));
+    __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), bytes);
+}
+
+template <typename Blend>
+TGA_TARGET_AVX2 void floatBlendAVX2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                    size_t end)
+{
+    for (size_t i = begin; i + 16 <= end; i += 16)
+    {
+        __m256 topColor[2], bottomColor[2], blendedColor[2];
+        loadNormalizedAVX2(top + i, topColor);
+        loadNormalizedAVX2(bottom + i, bottomColor);
+        blendedColor[0] = Blend::apply(topColor[0], bottomColor[0]);
+        blendedColor[1] = Blend::apply(topColor[1], bottomColor[1]);
+        storeDenormalizedAVX2(dst + i, blendedColor);
+    }
+}
+
+TGA_TARGET_AVX2 void multiplyPixelsAVX2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                        size_t end, int channels)
+{
+    size_t vectorEnd = begin + (end - begin) / 16 * 16;
+    floatBlendAVX2<MultiplyBlendAVX2>(dst, top, bottom, begin, vectorEnd);
+    multiplyPixels(dst, top, bottom, vectorEnd, end, 1);
+}
+
+TGA_TARGET_AVX2 void screenPixelsAVX2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                      size_t end, int channels)
+{
+    size_t vectorEnd = begin + (end - begin) / 16 * 16;
+    floatBlendAVX2<ScreenBlendAVX2>(dst, top, bottom, begin, vectorEnd);
+    screenPixels(dst, top, bottom, vectorEnd, end, 1);
+}
+
+TGA_TARGET_AVX2 void subtractPixelsAVX2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                        size_t end, int channels)
+{
+    size_t i = begin;
+    for (; i + 32 <= end; i += 32)
+    {
+        __m256i topColor = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(top + i));
+        __m256i bottomColor = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bottom + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_subs_epu8(bottomColor, topColor));
+    }
+    subtractPixels(dst, top, bottom, i, end, 1);
+}
+
+TGA_TARGET_AVX2 void additionPixelsAVX2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                        size_t end, int channels)
+{
+    size_t i = begin;
+    for (; i + 32 <= end; i += 32)
+    {
+        __m256i topColor = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(top + i));
+        __m256i bottomColor = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bottom + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_adds_epu8(bottomColor, topColor));
+    }
+    additionPixels(dst, top, bottom, i, end, 1);
+}
+
+TGA_TARGET_AVX2 void overlayPixelsAVX2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                       size_t end, int channels)
+{
+    size_t vectorEnd = begin + (end - begin) / 16 * 16;
+    if (channels != 4)
+    {
+        floatBlendAVX2<OverlayBlendAVX2>(dst, top, bottom, begin, vectorEnd);
+        overlayPixels(dst, top, bottom, vectorEnd, end, 1);
+        return;
+    }
+
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 colorMask = _mm256_castsi256_ps(_mm256_set_epi32(0, -1, -1, -1, 0, -1, -1, -1));
+    for (size_t i = begin; i < vectorEnd; i += 16)
+    {
+        // Two BGRA pixels per vector, one in each 128-bit lane
+        __m256 topColor[2], bottomColor[2], blendedColor[2];
+        loadNormalizedAVX2(top + i, topColor);
+        loadNormalizedAVX2(bottom + i, bottomColor);
+        for (int k = 0; k < 2; ++k)
+        {
+            __m256 alpha = _mm256_shuffle_ps(topColor[k], topColor[k], _MM_SHUFFLE(3, 3, 3, 3));
+            __m256 blended = OverlayBlendAVX2::apply(topColor[k], bottomColor[k]);
+            blended = _mm256_add_ps(_mm256_mul_ps(alpha, blended),
+                                    _mm256_mul_ps(_mm256_sub_ps(one, alpha), bottomColor[k]));
+            blendedColor[k] = _mm256_and_ps(blended, colorMask);
+        }
+        storeDenormalizedAVX2(dst + i, blendedColor);
+    }
+    overlayPixels(dst, top, bottom, vectorEnd, end, channels);
+}
+
+/* AVX-512 */
+/*
+ * AVX-512F implies FMA, and GCC would otherwise contract a multiply feeding an add into a single fused op with a
+ * different rounding than the scalar code. The explicit-rounding forms are never contracted; like the conversions
+ * below they use the all-lanes maskz variants to keep GCC's -Wmaybe-uninitialized quiet.
+ */
+TGA_TARGET_AVX512 static inline __m512 multiplyAVX512(__m512 a, __m512 b)
+{
+    return _mm512_maskz_mul_round_ps(0xFFFF, a, b, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+
+TGA_TARGET_AVX512 static inline __m512 addAVX512(__m512 a, __m512 b)
+{
+    return _mm512_maskz_add_round_ps(0xFFFF, a, b, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+
+TGA_TARGET_AVX512 static inline __m512 subtractAVX512(__m512 a, __m512 b)
+{
+    return _mm512_maskz_sub_round_ps(0xFFFF, a, b, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+}
+struct MultiplyBlendAVX512
+{
+    TGA_TARGET_AVX512 static __m512 apply(__m512 top, __m512 bottom) { return multiplyAVX512(top, bottom); }
+};
+
+struct ScreenBlendAVX512
+{
+    TGA_TARGET_AVX512 static __m512 apply(__m512 top, __m512 bottom)
+    {
+        __m512 one = _mm512_set1_ps(1.0f);
+        return subtractAVX512(one, multiplyAVX512(subtractAVX512(one, top), subtractAVX512(one, bottom)));
+    }
+};
+
+struct OverlayBlendAVX512
+{
+    TGA_TARGET_AVX512 static __m512 apply(__m512 top, __m512 bottom)
+    {
+        __m512 one = _mm512_set1_ps(1.0f);
+        __m512 two = _mm512_set1_ps(2.0f);
+        __m512 dark = multiplyAVX512(multiplyAVX512(two, top), bottom);
+        __m512 light = subtractAVX512(one, multiplyAVX512(multiplyAVX512(two, subtractAVX512(one, top)),
+                                                        subtractAVX512(one, bottom)));
+        __mmask16 useDark = _mm512_cmp_ps_mask(bottom, _mm512_set1_ps(0.5f), _CMP_LE_OQ);
+        return _mm512_mask_blend_ps(useDark, light, dark);
+    }
+};
+
+TGA_TARGET_AVX512 static inline __m512 loadNormalizedAVX512(const uint8_t *src)
+{
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+    __m512 values = _mm512_maskz_cvtepi32_ps(0xFFFF, _mm512_maskz_cvtepu8_epi32(0xFFFF, bytes));
+    return _mm512_div_ps(values, _mm512_set1_ps(255.0f));
+}
+
+TGA_TARGET_AVX512 static inline void storeDenormalizedAVX512(uint8_t *dst, __m512 color)
+{
+    __m512i values = _mm512_maskz_cvttps_epi32(0xFFFF, multiplyAVX512(color, _mm512_set1_ps(255.0f)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm512_maskz_cvtepi32_epi8(0xFFFF, values));
+}
+
+template <typename Blend>
+TGA_TARGET_AVX512 void floatBlendAVX512(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                        size_t end)
+{
+    for (size_t i = begin; i + 16 <= end; i += 16)
+    {
+        storeDenormalizedAVX512(dst + i, Blend::apply(loadNormalizedAVX512(top + i), loadNormalizedAVX512(bottom + i)));
+    }
+}
+
+TGA_TARGET_AVX512 void multiplyPixelsAVX512(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                            size_t end, int channels)
+{
+    size_t vectorEnd = begin + (end - begin) / 16 * 16;
+    floatBlendAVX512<MultiplyBlendAVX512>(dst, top, bottom, begin, vectorEnd);
+    multiplyPixels(dst, top, bottom, vectorEnd, end, 1);
+}
+
+TGA_TARGET_AVX512 void screenPixelsAVX512(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                          size_t end, int channels)
+{
+    size_t vectorEnd = begin + (end - begin) / 16 * 16;
+    floatBlendAVX512<ScreenBlendAVX512>(dst, top, bottom, begin, vectorEnd);
+    screenPixels(dst, top, bottom, vectorEnd, end, 1);
+}
+
+TGA_TARGET_AVX512 void subtractPixelsAVX512(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                            size_t end, int channels)
+{
+    size_t i = begin;
+    for (; i + 64 <= end; i += 64)
+    {
+        __m512i topColor = _mm512_loadu_si512(top + i);
+        __m512i bottomColor = _mm512_loadu_si512(bottom + i);
+        _mm512_storeu_si512(dst + i, _mm512_subs_epu8(bottomColor, topColor));
+    }
+    subtractPixels(dst, top, bottom, i, end, 1);
+}
+
+TGA_TARGET_AVX512 void additionPixelsAVX512(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                            size_t end, int channels)
+{
+    size_t i = begin;
+    for (; i + 64 <= end; i += 64)
+    {
+        __m512i topColor = _mm512_loadu_si512(top + i);
+        __m512i bottomColor = _mm512_loadu_si512(bottom + i);
+        _mm512_storeu_si512(dst + i, _mm512_adds_epu8(bottomColor, topColor));
+    }
+    additionPixels(dst, top, bottom, i, end, 1);
+}
+
+TGA_TARGET_AVX512 void overlayPixelsAVX512(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                           size_t end, int channels)
+{
+    size_t vectorEnd = begin + (end - begin) / 16 * 16;
+    if (channels != 4)
+    {
+        floatBlendAVX512<OverlayBlendAVX512>(dst, top, bottom, begin, vectorEnd);
+        overlayPixels(dst, top, bottom, vectorEnd, end, 1);
+        return;
+    }
+
+    __m512 one = _mm512_set1_ps(1.0f);
+    for (size_t i = begin; i < vectorEnd; i += 16)
+    {
+        // Four BGRA pixels per vector, one in each 128-bit lane
+        __m512 topColor = loadNormalizedAVX512(top + i);
+        __m512 bottomColor = loadNormalizedAVX512(bottom + i);
+        __m512 alpha = _mm512_shuffle_ps(topColor, topColor, _MM_SHUFFLE(3, 3, 3, 3));
+        __m512 blended = OverlayBlendAVX512::apply(topColor, bottomColor);
+        blended = addAVX512(multiplyAVX512(alpha, blended), multiplyAVX512(subtractAVX512(one, alpha), bottomColor));
+        storeDenormalizedAVX512(dst + i, _mm512_maskz_mov_ps(0x7777, blended));
+    }
+    overlayPixels(dst, top, bottom, vectorEnd, end, channels);
+}
+#endif
+
+/* Every tier of blend kernels the CPU supports, scalar first and widest last; detected once on first use */
+const vector<BlendKernels> &supportedBlendKernels()
+{
+    static const vector<BlendKernels> tiers = []() {
+        vector<BlendKernels> supported = {
+            {multiplyPixels, screenPixels, subtractPixels, additionPixels, overlayPixels, "scalar"}};
+#ifdef TGA_X86_SIMD
+        __builtin_cpu_init();
+        supported.push_back({multiplyPixelsSSE2, screenPixelsSSE2, subtractPixelsSSE2, additionPixelsSSE2,
+                             overlayPixelsSSE2, "sse2"});
+        if (__builtin_cpu_supports("avx2"))
+        {
+            supported.push_back({multiplyPixelsAVX2, screenPixelsAVX2, subtractPixelsAVX2, additionPixelsAVX2,
+                                 overlayPixelsAVX2, "avx2"});
+        }
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        {
+            supported.push_back({multiplyPixelsAVX512, screenPixelsAVX512, subtractPixelsAVX512,
+                                 additionPixelsAVX512, overlayPixelsAVX512, "avx512"});
+        }
+#endif
+        return supported;
+    }();
+    return tiers;
+}
+
+/* The widest blend kernels the CPU supports */
+const BlendKernels &blendKernels()
+{
+    return supportedBlendKernels().back();
+}
+
+/*
+ * Compositing Kernels
+ *
+ * The compositing ops (Porter-Duff over, in, out and atop, and the separable blend modes composited source-over)
+ * take alpha into account and work on premultiplied BGRA32. The running image is premultiplied where a run of them
+ * starts and un-premultiplied where it ends, both fused into the run's tiles, so it is converted once however many
+ * layers are composited onto it. Layers stay straight and are premultiplied as they are read. Everything but the
+ * final division by alpha is 8-bit fixed point with exact rounding, so the SIMD kernels match the scalar ones bit
+ * for bit. The division is the reference integer formula (c * 510 + a) / (2 * a) in the scalar kernel; the SIMD
+ * kernels divide in float instead, and golden mode checks every tier of them against the integer one.
+ *
+ * The running image is the source and the layer the destination, as for the blends above: "over b.tga" puts the
+ * running image over b.tga.
+ */
+enum class CompositeMode
+{
+    Over,
+    In,
+    Out,
+    Atop,
+    Multiply,
+    Screen,
+    Subtract,
+    Addition,
+    Overlay
+};
+
+const char *const kCompositeModeNames[] = {"over",     "in",     "out",      "atop",    "multiply",
+                                           "screen",   "subtract", "addition", "overlay"};
+const int kCompositeModes = 9;
+
+/* round(a * b / 255) for a, b in [0, 255] */
+static inline int multiply255(int a, int b)
+{
+    int t = a * b + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+/* Premultiply Kernel */
+void premultiplyPixels(uint8_t *dst, const uint8_t *src, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i += 4)
+    {
+        int alpha = src[i + 3];
+        for (int j = 0; j < 3; ++j)
+        {
+            dst[i + j] = static_cast<uint8_t>(multiply255(src[i + j], alpha));
+        }
+        dst[i + 3] = static_cast<uint8_t>(alpha);
+    }
+}
+
+/* Unpremultiply Kernel: round(color * 255 / alpha), saturated; fully transparent pixels come out black */
+void unpremultiplyPixels(uint8_t *dst, const uint8_t *src, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i += 4)
+    {
+        int alpha = src[i + 3];
+        for (int j = 0; j < 3; ++j)
+        {
+            dst[i + j] = alpha == 0 ? 0 : static_cast<uint8_t>(min(255, (src[i + j] * 510 + alpha) / (2 * alpha)));
+        }
+        dst[i + 3] = static_cast<uint8_t>(alpha);
+    }
+}
+
+/* Composite Kernel: top is premultiplied, bottom straight, dst premultiplied; dst may be top */
+template <CompositeMode Mode>
+void compositePixels(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i += 4)
+    {
+        int topAlpha = top[i + 3];
+        int bottomAlpha = bottom[i + 3];
+        int alpha = topAlpha + multiply255(bottomAlpha, 255 - topAlpha);
+        if (Mode == CompositeMode::In)
+        {
+            alpha = multiply255(topAlpha, bottomAlpha);
+        }
+        else if (Mode == CompositeMode::Out)
+        {
+            alpha = multiply255(topAlpha, 255 - bottomAlpha);
+        }
+        else if (Mode == CompositeMode::Atop)
+        {
+            alpha = bottomAlpha;
+        }
+
+        for (int j = 0; j < 3; ++j)
+        {
+            int s = top[i + j];
+            int d = multiply255(bottom[i + j], bottomAlpha);
+            // What each layer shows where the other one is transparent
+            int uncovered = multiply255(s, 255 - bottomAlpha) + multiply255(d, 255 - topAlpha);
+            int color = 0;
+            switch (Mode)
+            {
+            case CompositeMode::Over:
+                color = s + multiply255(d, 255 - topAlpha);
+                break;
+            case CompositeMode::In:
+                color = multiply255(s, bottomAlpha);
+                break;
+            case CompositeMode::Out:
+                color = multiply255(s, 255 - bottomAlpha);
+                break;
+            case CompositeMode::Atop:
+                color = multiply255(s, bottomAlpha) + multiply255(d, 255 - topAlpha);
+                break;
+            case CompositeMode::Multiply:
+                color = uncovered + multiply255(s, d);
+                break;
+            case CompositeMode::Screen:
+                color = s + d - multiply255(s, d);
+                break;
+            case CompositeMode::Subtract:
+                color = uncovered + max(0, multiply255(d, topAlpha) - multiply255(s, bottomAlpha));
+                break;
+            case CompositeMode::Addition:
+                color = uncovered + min(multiply255(topAlpha, bottomAlpha),
+                                        multiply255(s, bottomAlpha) + multiply255(d, topAlpha));
+                break;
+            case CompositeMode::Overlay:
+                // Dark or light by the bottom layer's straight color, like the overlay blend: 2 * d <= bottomAlpha
+                color = uncovered + (2 * d <= bottomAlpha ? 2 * multiply255(s, d)
+                                                          : multiply255(topAlpha, bottomAlpha) -
+                                                                2 * multiply255(max(0, bottomAlpha - d),
+                                                                                max(0, topAlpha - s)));
+                break;
+            }
+            dst[i + j] = static_cast<uint8_t>(min(255, max(0, color)));
+        }
+        dst[i + 3] = static_cast<uint8_t>(alpha);
+    }
+}
+
+typedef void (*CompositeKernel)(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end);
+typedef void (*AlphaKernel)(uint8_t *dst, const uint8_t *src, size_t begin, size_t end);
+
+struct CompositeKernels
+{
+    CompositeKernel modes[kCompositeModes];
+    AlphaKernel premultiply;
+    AlphaKernel unpremultiply;
+    const char *name;
+};
+
+const CompositeKernels kScalarCompositeKernels = {
+    {compositePixels<CompositeMode::Over>, compositePixels<CompositeMode::In>, compositePixels<CompositeMode::Out>,
+     compositePixels<CompositeMode::Atop>, compositePixels<CompositeMode::Multiply>,
+     compositePixels<CompositeMode::Screen>, compositePixels<CompositeMode::Subtract>,
+     compositePixels<CompositeMode::Addition>, compositePixels<CompositeMode::Overlay>},
+    premultiplyPixels,
+    unpremultiplyPixels,
+    "scalar"};
+
+#ifdef TGA_X86_SIMD
+/* SSE2: two BGRA pixels per vector of 16-bit lanes */
+static inline __m128i multiply255SSE2(__m128i a, __m128i b)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(a, b), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static inline __m128i broadcastAlphaSSE2(__m128i pixels)
+{
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+template <CompositeMode Mode>
+static inline __m128i compositeSSE2(__m128i s, __m128i bottom)
+{
+    __m128i full = _mm_set1_epi16(255);
+    __m128i topAlpha = broadcastAlphaSSE2(s);
+    __m128i bottomAlpha = broadcastAlphaSSE2(bottom);
+    __m128i topClear = _mm_sub_epi16(full, topAlpha);
+    __m128i bottomClear = _mm_sub_epi16(full, bottomAlpha);
+    __m128i d = multiply255SSE2(bottom, bottomAlpha);
+    __m128i uncovered = _mm_add_epi16(multiply255SSE2(s, bottomClear), multiply255SSE2(d, topClear));
+    __m128i alpha = _mm_add_epi16(topAlpha, multiply255SSE2(bottomAlpha, topClear));
+    __m128i color;
+    switch (Mode)
+    {
+    case CompositeMode::Over:
+        color = _mm_add_epi16(s, multiply255SSE2(d, topClear));
+        break;
+    case CompositeMode::In:
+        color = multiply255SSE2(s, bottomAlpha);
+        alpha = multiply255SSE2(topAlpha, bottomAlpha);
+        break;
+    case CompositeMode::Out:
+        color = multiply255SSE2(s, bottomClear);
+        alpha = multiply255SSE2(topAlpha, bottomClear);
+        break;
+    case CompositeMode::Atop:
+        color = _mm_add_epi16(multiply255SSE2(s, bottomAlpha), multiply255SSE2(d, topClear));
+        alpha = bottomAlpha;
+        break;
+    case CompositeMode::Multiply:
+        color = _mm_add_epi16(uncovered, multiply255SSE2(s, d));
+        break;
+    case CompositeMode::Screen:
+        color = _mm_sub_epi16(_mm_add_epi16(s, d), multiply255SSE2(s, d));
+        break;
+    case CompositeMode::Subtract:
+        color = _mm_add_epi16(uncovered,
+                              _mm_subs_epu16(multiply255SSE2(d, topAlpha), multiply255SSE2(s, bottomAlpha)));
+        break;
+    case CompositeMode::Addition:
+        color = _mm_add_epi16(uncovered, _mm_min_epi16(multiply255SSE2(topAlpha, bottomAlpha),
+                                                       _mm_add_epi16(multiply255SSE2(s, bottomAlpha),
+                                                                     multiply255SSE2(d, topAlpha))));
+        break;
+    case CompositeMode::Overlay:
+    {
+        __m128i dark = _mm_slli_epi16(multiply255SSE2(s, d), 1);
+        __m128i light = _mm_sub_epi16(multiply255SSE2(topAlpha, bottomAlpha),
+                                      _mm_slli_epi16(multiply255SSE2(_mm_subs_epu16(bottomAlpha, d),
+                                                                     _mm_subs_epu16(topAlpha, s)),
+                                                     1));
+        __m128i useLight = _mm_cmpgt_epi16(_mm_slli_epi16(d, 1), bottomAlpha);
+        color = _mm_add_epi16(uncovered,
+                              _mm_or_si128(_mm_andnot_si128(useLight, dark), _mm_and_si128(useLight, light)));
+        break;
+    }
+    }
+    // Lane 3 of each pixel takes the alpha; packing with unsigned saturation clamps the colors to [0, 255]
+    __m128i alphaLanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    return _mm_or_si128(_mm_andnot_si128(alphaLanes, color), _mm_and_si128(alphaLanes, alpha));
+}
+
+template <CompositeMode Mode>
+void compositePixelsSSE2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin, size_t end)
+{
+    __m128i zero = _mm_setzero_si128();
+    size_t i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(top + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + i));
+        __m128i low = compositeSSE2<Mode>(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(b, zero));
+        __m128i high = compositeSSE2<Mode>(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(b, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(low, high));
+    }
+    compositePixels<Mode>(dst, top, bottom, i, end);
+}
+
+void premultiplyPixelsSSE2(uint8_t *dst, const uint8_t *src, size_t begin, size_t end)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i alphaLanes = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+    size_t i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        low = multiply255SSE2(low, broadcastAlphaSSE2(low));
+        high = multiply255SSE2(high, broadcastAlphaSSE2(high));
+        __m128i colors = _mm_packus_epi16(low, high);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_or_si128(_mm_andnot_si128(alphaLanes, colors), _mm_and_si128(alphaLanes, bytes)));
+    }
+    premultiplyPixels(dst, src, i, end);
+}
+
+void unpremultiplyPixelsSSE2(uint8_t *dst, const uint8_t *src, size_t begin, size_t end)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i alphaLanes = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+    __m128 scale = _mm_set1_ps(255.0f);
+    __m128 half = _mm_set1_ps(0.5f);
+    size_t i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+        // One pixel per vector; a zero alpha divides to infinity or NaN, which converts and packs to 0
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i words[2] = {_mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero)};
+        __m128i rounded[4];
+        for (int k = 0; k < 4; ++k)
+        {
+            __m128i lanes = k % 2 == 0 ? _mm_unpacklo_epi16(words[k / 2], zero)
+                                       : _mm_unpackhi_epi16(words[k / 2], zero);
+            __m128 color = _mm_cvtepi32_ps(lanes);
+            __m128 alpha = _mm_shuffle_ps(color, color, _MM_SHUFFLE(3, 3, 3, 3));
+            rounded[k] = _mm_cvttps_epi32(_mm_add_ps(_mm_div_ps(_mm_mul_ps(color, scale), alpha), half));
+        }
+        __m128i colors = _mm_packus_epi16(_mm_packs_epi32(rounded[0], rounded[1]),
+                                          _mm_packs_epi32(rounded[2], rounded[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_or_si128(_mm_andnot_si128(alphaLanes, colors), _mm_and_si128(alphaLanes, bytes)));
+    }
+    unpremultiplyPixels(dst, src, i, end);
+}
+
+/* AVX2: the same lane layout, in both 128-bit halves */
+TGA_TARGET_AVX2 static inline __m256i multiply255AVX2(__m256i a, __m256i b)
+{
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(a, b), _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+TGA_TARGET_AVX2 static inline __m256i broadcastAlphaAVX2(__m256i pixels)
+{
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pixels, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+template <CompositeMode Mode>
+TGA_TARGET_AVX2 static inline __m256i compositeAVX2(__m256i s, __m256i bottom)
+{
+    __m256i full = _mm256_set1_epi16(255);
+    __m256i topAlpha = broadcastAlphaAVX2(s);
+    __m256i bottomAlpha = broadcastAlphaAVX2(bottom);
+    __m256i topClear = _mm256_sub_epi16(full, topAlpha);
+    __m256i bottomClear = _mm256_sub_epi16(full, bottomAlpha);
+    __m256i d = multiply255AVX2(bottom, bottomAlpha);
+    __m256i uncovered = _mm256_add_epi16(multiply255AVX2(s, bottomClear), multiply255AVX2(d, topClear));
+    __m256i alpha = _mm256_add_epi16(topAlpha, multiply255AVX2(bottomAlpha, topClear));
+    __m256i color;
+    switch (Mode)
+    {
+    case CompositeMode::Over:
+        color = _mm256_add_epi16(s, multiply255AVX2(d, topClear));
+        break;
+    case CompositeMode::In:
+        color = multiply255AVX2(s, bottomAlpha);
+        alpha = multiply255AVX2(topAlpha, bottomAlpha);
+        break;
+    case CompositeMode::Out:
+        color = multiply255AVX2(s, bottomClear);
+        alpha = multiply255AVX2(topAlpha, bottomClear);
+        break;
+    case CompositeMode::Atop:
+        color = _mm256_add_epi16(multiply255AVX2(s, bottomAlpha), multiply255AVX2(d, topClear));
+        alpha = bottomAlpha;
+        break;
+    case CompositeMode::Multiply:
+        color = _mm256_add_epi16(uncovered, multiply255AVX2(s, d));
+        break;
+    case CompositeMode::Screen:
+        color = _mm256_sub_epi16(_mm256_add_epi16(s, d), multiply255AVX2(s, d));
+        break;
+    case CompositeMode::Subtract:
+        color = _mm256_add_epi16(uncovered,
+                                 _mm256_subs_epu16(multiply255AVX2(d, topAlpha), multiply255AVX2(s, bottomAlpha)));
+        break;
+    case CompositeMode::Addition:
+        color = _mm256_add_epi16(uncovered, _mm256_min_epi16(multiply255AVX2(topAlpha, bottomAlpha),
+                                                             _mm256_add_epi16(multiply255AVX2(s, bottomAlpha),
+                                                                              multiply255AVX2(d, topAlpha))));
+        break;
+    case CompositeMode::Overlay:
+    {
+        __m256i dark = _mm256_slli_epi16(multiply255AVX2(s, d), 1);
+        __m256i light = _mm256_sub_epi16(multiply255AVX2(topAlpha, bottomAlpha),
+                                         _mm256_slli_epi16(multiply255AVX2(_mm256_subs_epu16(bottomAlpha, d),
+                                                                           _mm256_subs_epu16(topAlpha, s)),
+                                                           1));
+        __m256i useLight = _mm256_cmpgt_epi16(_mm256_slli_epi16(d, 1), bottomAlpha);
+        color = _mm256_add_epi16(uncovered, _mm256_blendv_epi8(dark, light, useLight));
+        break;
+    }
+    }
+    return _mm256_blend_epi16(color, alpha, 0x88);
+}
+
+template <CompositeMode Mode>
+TGA_TARGET_AVX2 void compositePixelsAVX2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, size_t begin,
+                                         size_t end)
+{
+    __m256i zero = _mm256_setzero_si256();
+    size_t i = begin;
+    for (; i + 32 <= end; i += 32)
+    {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(top + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bottom + i));
+        __m256i low = compositeAVX2<Mode>(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(b, zero));
+        __m256i high = compositeAVX2<Mode>(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(b, zero));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_packus_epi16(low, high));
+    }
+    compositePixels<Mode>(dst, top, bottom, i, end);
+}
+
+TGA_TARGET_AVX2 void premultiplyPixelsAVX2(uint8_t *dst, const uint8_t *src, size_t begin, size_t end)
+{
+    __m256i zero = _mm256_setzero_si256();
+    size_t i = begin;
+    for (; i + 32 <= end; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        __m256i low = _mm256_unpacklo_epi8(bytes, zero);
+        __m256i high = _mm256_unpackhi_epi8(bytes, zero);
+        low = _mm256_blend_epi16(multiply255AVX2(low, broadcastAlphaAVX2(low)), low, 0x88);
+        high = _mm256_blend_epi16(multiply255AVX2(high, broadcastAlphaAVX2(high)), high, 0x88);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_packus_epi16(low, high));
+    }
+    premultiplyPixels(dst, src, i, end);
+}
+
+TGA_TARGET_AVX2 void unpremultiplyPixelsAVX2(uint8_t *dst, const uint8_t *src, size_t begin, size_t end)
+{
+    __m256 scale = _mm256_set1_ps(255.0f);
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m128i alphaLanes = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+    size_t i = begin;
+    for (; i + 16 <= end; i += 16)
+    {
+        // Two pixels per vector, one in each 128-bit lane
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m256i rounded[2];
+        for (int k = 0; k < 2; ++k)
+        {
+            __m256 color = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(k == 0 ? bytes : _mm_srli_si128(bytes, 8)));
+            __m256 alpha = _mm256_shuffle_ps(color, color, _MM_SHUFFLE(3, 3, 3, 3));
+            rounded[k] = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_div_ps(_mm256_mul_ps(color, scale), alpha), half));
+        }
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(rounded[0], rounded[1]), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i colors = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_or_si128(_mm_andnot_si128(alphaLanes, colors), _mm_and_si128(alphaLanes, bytes)));
+    }
+    unpremultiplyPixels(dst, src, i, end);
+}
+#endif
+
+/* Every tier of compositing kernels the CPU supports, scalar first and widest last; detected once on first use */
+const vector<CompositeKernels> &supportedCompositeKernels()
+{
+    static const vector<CompositeKernels> tiers = []() {
+        vector<CompositeKernels> supported = {kScalarCompositeKernels};
+#ifdef TGA_X86_SIMD
+        __builtin_cpu_init();
+        supported.push_back({{compositePixelsSSE2<CompositeMode::Over>, compositePixelsSSE2<CompositeMode::In>,
+                              compositePixelsSSE2<CompositeMode::Out>, compositePixelsSSE2<CompositeMode::Atop>,
+                              compositePixelsSSE2<CompositeMode::Multiply>, compositePixelsSSE2<CompositeMode::Screen>,
+                              compositePixelsSSE2<CompositeMode::Subtract>,
+                              compositePixelsSSE2<CompositeMode::Addition>, compositePixelsSSE2<CompositeMode::Overlay>},
+                             premultiplyPixelsSSE2,
+                             unpremultiplyPixelsSSE2,
+                             "sse2"});
+        if (__builtin_cpu_supports("avx2"))
+        {
+            supported.push_back(
+                {{compositePixelsAVX2<CompositeMode::Over>, compositePixelsAVX2<CompositeMode::In>,
+                  compositePixelsAVX2<CompositeMode::Out>, compositePixelsAVX2<CompositeMode::Atop>,
+                  compositePixelsAVX2<CompositeMode::Multiply>, compositePixelsAVX2<CompositeMode::Screen>,
+                  compositePixelsAVX2<CompositeMode::Subtract>, compositePixelsAVX2<CompositeMode::Addition>,
+                  compositePixelsAVX2<CompositeMode::Overlay>},
+                 premultiplyPixelsAVX2,
+                 unpremultiplyPixelsAVX2,
+                 "avx2"});
+        }
+#endif
+        return supported;
+    }();
+    return tiers;
+}
+
+/* The widest compositing kernels the CPU supports */
+const CompositeKernels &compositeKernels()
+{
+    return supportedCompositeKernels().back();
+}
+
+/*
+ * Point Kernels
+ *
+ * Each kernel is a template on the pixel size (1 for Gray8, 3 for BGR24, 4 for BGRA32) and the byte offset of its
+ * target channel, so the per-byte channel test folds away and every instantiation is a straight-line loop the
+ * compiler can unroll and vectorize. The untemplated overloads pick an instantiation once per call.
+ */
+/* Byte offset of a named channel within a pixel: TGA stores B, G, R(, A), and grayscale has only the one value */
+int channelOffset(char channel, int channels)
+{
+    if (channels == 1)
+    {
+        return 0;
+    }
+    return channel == 'B' ? 0 : channel == 'G' ? 1 : 2;
+}
+
+template <typename Body>
+void dispatchPixelFormat(int channels, int offset, Body body)
+{
+    switch (channels * 4 + offset)
+    {
+    case 1 * 4 + 0:
+        body(integral_constant<int, 1>(), integral_constant<int, 0>());
+        break;
+    case 3 * 4 + 0:
+        body(integral_constant<int, 3>(), integral_constant<int, 0>());
+        break;
+    case 3 * 4 + 1:
+        body(integral_constant<int, 3>(), integral_constant<int, 1>());
+        break;
+    case 3 * 4 + 2:
+        body(integral_constant<int, 3>(), integral_constant<int, 2>());
+        break;
+    case 4 * 4 + 0:
+        body(integral_constant<int, 4>(), integral_constant<int, 0>());
+        break;
+    case 4 * 4 + 1:
+        body(integral_constant<int, 4>(), integral_constant<int, 1>());
+        break;
+    case 4 * 4 + 2:
+        body(integral_constant<int, 4>(), integral_constant<int, 2>());
+        break;
+    default:
+        throw runtime_error("Unsupported pixel size of " + to_string(channels) + " bytes");
+    }
+}
+
+/* Add Channel Kernel */
+template <int Channels, int Target>
+void addToChannelPixels(uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int n)
+{
+    for (size_t i = begin; i < end; i += Channels)
+    {
+        for (int j = 0; j < Channels; ++j)
+        {
+            dst[i + j] = j == Target ? min(255, max(0, static_cast<int>(src[i + j]) + n)) : src[i + j];
+        }
+    }
+}
+
+void addToChannelPixels(uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels, char channel, int n)
+{
+    // Anything past 255 either way already clamps every value, and keeps the kernel's sum from overflowing
+    n = clamp(n, -255, 255);
+    dispatchPixelFormat(channels, channelOffset(channel, channels), [&](auto format, auto target) {
+        addToChannelPixels<decltype(format)::value, decltype(target)::value>(dst, src, begin, end, n);
+    });
+}
+
+/* Scale Channel Kernel */
+template <int Channels, int Target>
+void scaleChannelPixels(uint8_t *dst, const uint8_t *src, size_t begin, size_t end, float n)
+{
+    for (size_t i = begin; i < end; i += Channels)
+    {
+        for (int j = 0; j < Channels; ++j)
+        {
+            dst[i + j] = j == Target ? min(255.0f, max(0.0f, static_cast<float>(src[i + j]) * n)) : src[i + j];
+        }
+    }
+}
+
+void scaleChannelPixels(uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels, char channel, float n)
+{
+    dispatchPixelFormat(channels, channelOffset(channel, channels), [&](auto format, auto target) {
+        scaleChannelPixels<decltype(format)::value, decltype(target)::value>(dst, src, begin, end, n);
+    });
+}
+
+/* Combine Channels Kernel */
+template <int Channels>
+void combineChannelsPixels(uint8_t *dst, const uint8_t *red, const uint8_t *green, const uint8_t *blue,
+                           size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i += Channels)
+    {
+        dst[i] = blue[i];
+        dst[i + 1] = green[i + 1];
+        dst[i + 2] = red[i + 2];
+        for (int j = 3; j < Channels; ++j)
+        {
+            dst[i + j] = 0;
+        }
+    }
+}
+
+void combineChannelsPixels(uint8_t *dst, const uint8_t *red, const uint8_t *green, const uint8_t *blue,
+                           size_t begin, size_t end, int channels)
+{
+    if (channels == 4)
+    {
+        combineChannelsPixels<4>(dst, red, green, blue, begin, end);
+    }
+    else if (channels == 3)
+    {
+        combineChannelsPixels<3>(dst, red, green, blue, begin, end);
+    }
+    else
+    {
+        throw runtime_error("combine needs 24 or 32-bit color images");
+    }
+}
+
+/* Extract Channel Kernel */
+template <int Channels, int Target>
+void extractChannelPixels(uint8_t *dst, const uint8_t *src, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; i += Channels)
+    {
+        for (int j = 0; j < Channels; ++j)
+        {
+            dst[i + j] = j == Target ? src[i + j] : 0;
+        }
+    }
+}
+
+void extractChannelPixels(uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels, char channel)
+{
+    dispatchPixelFormat(channels, channelOffset(channel, channels), [&](auto format, auto target) {
+        extractChannelPixels<decltype(format)::value, decltype(target)::value>(dst, src, begin, end);
+    });
+}
+
+/* Fill Kernel */
+void fillPixels(uint8_t *dst, size_t begin, size_t end, int channels, const array<uint8_t, 4> &value)
+{
+    if (all_of(value.begin(), value.begin() + channels, [&](uint8_t v) { return v == value[0]; }))
+    {
+        memset(dst + begin, value[0], end - begin);
+        return;
+    }
+    for (size_t i = begin; i < end; i += channels)
+    {
+        for (int j = 0; j < channels; ++j)
+        {
+            dst[i + j] = value[j];
+        }
+    }
+}
+
+/*
+ * Channel Lookup Tables
+ *
+ * Any chain of add/scale/extract ops maps each 8-bit channel value through a fixed function, so a run of them is
+ * compiled into one 256-entry table per channel position and applied in a single pass. Tables are indexed by byte
+ * position within a pixel (B, G, R, A); grayscale images, whose one value every channel op touches, use the separate
+ * gray table.
+ */
+struct ChannelLut
+{
+    uint8_t table[4][256];
+    uint8_t gray[256];
+
+    const uint8_t (*tablesFor(int channels) const)[256] { return channels == 1 ? &gray : table; }
+};
+
+ChannelLut identityLut()
+{
+    ChannelLut lut;
+    for (int j = 0; j < 4; ++j)
+    {
+        for (int v = 0; v < 256; ++v)
+        {
+            lut.table[j][v] = static_cast<uint8_t>(v);
+        }
+    }
+    memcpy(lut.gray, lut.table[0], sizeof(lut.gray));
+    return lut;
+}
+
+/* LUT Kernel */
+void lutPixels(uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels, const ChannelLut &lut)
+{
+    const uint8_t(*tables)[256] = lut.tablesFor(channels);
+    for (size_t i = begin; i < end; i += channels)
+    {
+        for (int j = 0; j < channels; ++j)
+        {
+            dst[i + j] = tables[j][src[i + j]];
+        }
+    }
+}
+
+typedef void (*LutKernel)(uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels,
+                          const ChannelLut &lut);
+
+#ifdef TGA_X86_SIMD
+#define TGA_TARGET_VBMI __attribute__((target("avx512f,avx512bw,avx512vbmi")))
+
+/*
+ * AVX-512 VBMI looks up 64 bytes at once: vpermi2b covers 128 table entries from two registers, so each table takes
+ * two lookups plus a select on the index's top bit. Every channel's table is looked up for all lanes and the lanes
+ * belonging to that channel are blended in.
+ */
+TGA_TARGET_VBMI void lutPixelsVBMI(uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels,
+                                   const ChannelLut &lut)
+{
+    if (channels != 1 && channels != 3 && channels != 4)
+    {
+        lutPixels(dst, src, begin, end, channels, lut);
+        return;
+    }
+
+    const uint8_t(*tables)[256] = lut.tablesFor(channels);
+    __m512i quarters[4][4];
+    for (int j = 0; j < channels; ++j)
+    {
+        for (int q = 0; q < 4; ++q)
+        {
+            quarters[j][q] = _mm512_loadu_si512(tables[j] + q * 64);
+        }
+    }
+
+    // Lane l of a vector that starts phase bytes into a pixel belongs to channel (phase + l) % channels
+    __mmask64 laneMasks[4][4] = {};
+    for (int phase = 0; phase < channels; ++phase)
+    {
+        for (int lane = 0; lane < 64; ++lane)
+        {
+            laneMasks[phase][(phase + lane) % channels] |= __mmask64(1) << lane;
+        }
+    }
+
+    size_t i = begin;
+    for (; i + 64 <= end; i += 64)
+    {
+        int phase = static_cast<int>((i - begin) % channels);
+        __m512i index = _mm512_loadu_si512(src + i);
+        __mmask64 upperHalf = _mm512_movepi8_mask(index);
+        __m512i result = _mm512_setzero_si512();
+        for (int j = 0; j < channels; ++j)
+        {
+            __m512i low = _mm512_permutex2var_epi8(quarters[j][0], index, quarters[j][1]);
+            __m512i high = _mm512_permutex2var_epi8(quarters[j][2], index, quarters[j][3]);
+            __m512i looked = _mm512_mask_blend_epi8(upperHalf, low, high);
+            result = _mm512_mask_blend_epi8(laneMasks[phase][j], result, looked);
+        }
+        _mm512_storeu_si512(dst + i, result);
+    }
+
+    // The tail starts on a pixel boundary only when 64 bytes are a whole number of pixels, so finish byte by byte
+    for (; i < end; ++i)
+    {
+        dst[i] = tables[(i - begin) % channels][src[i]];
+    }
+}
+#endif
+
+const LutKernel &lutKernel()
+{
+    static const LutKernel kernel = []() {
+        LutKernel selected = lutPixels;
+#ifdef TGA_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512bw"))
+        {
+            selected = lutPixelsVBMI;
+        }
+#endif
+        return selected;
+    }();
+    return kernel;
+}
+
+/*
+ * Thread Pool
+ *
+ * Each participant owns a task deque. Workers pop from the back of their own deque and steal from the front of the
+ * others when it runs dry, so uneven tiles even out. The thread that calls parallelFor works through the queues
+ * as well instead of blocking, which keeps nested calls from deadlocking.
+ */
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threadCount) : queues(max(1u, threadCount))
+    {
+        for (unsigned i = 1; i < queues.size(); ++i)
+        {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> guard(sleepLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    unsigned size() const { return static_cast<unsigned>(queues.size()); }
+
+    /* Calls body(i) for every i in [0, count) and returns once all calls have finished */
+    void parallelFor(size_t count, const function<void(size_t)> &body)
+    {
+        if (workers.empty() || count <= 1)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                body(i);
+            }
+            return;
+        }
+
+        Batch batch;
+        batch.body = &body;
+        batch.remaining = count;
+        for (size_t i = 0; i < count; ++i)
+        {
+            Queue &queue = queues[i % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_back(Task{&batch, i});
+        }
+        {
+            lock_guard<mutex> guard(sleepLock);
+            pending += count;
+        }
+        wake.notify_all();
+
+        Task task;
+        while (true)
+        {
+            {
+                unique_lock<mutex> guard(batch.lock);
+                if (batch.remaining == 0)
+                {
+                    break;
+                }
+            }
+            if (takeTask(currentQueue, task))
+            {
+                runTask(task);
+                continue;
+            }
+            // Everything left of this batch is already running on other threads
+            unique_lock<mutex> guard(batch.lock);
+            batch.done.wait(guard, [&batch]() { return batch.remaining == 0; });
+        }
+
+        if (batch.error)
+        {
+            rethrow_exception(batch.error);
+        }
+    }
+
+private:
+    struct Batch
+    {
+        const function<void(size_t)> *body = nullptr;
+        size_t remaining = 0;
+        exception_ptr error;
+        mutex lock;
+        condition_variable done;
+    };
+
+    struct Task
+    {
+        Batch *batch;
+        size_t index;
+    };
+
+    struct Queue
+    {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    bool takeTask(unsigned self, Task &task)
+    {
+        for (size_t k = 0; k < queues.size(); ++k)
+        {
+            Queue &queue = queues[(self + k) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.tasks.empty())
+            {
+                continue;
+            }
+            if (k == 0)
+            {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            else
+            {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            --pending;
+            return true;
+        }
+        return false;
+    }
+
+    static void runTask(const Task &task)
+    {
+        Batch &batch = *task.batch;
+        exception_ptr error;
+        try
+        {
+            (*batch.body)(task.index);
+        }
+        catch (...)
+        {
+            error = current_exception();
+        }
+
+        // The batch lives on the caller's stack, so it must not be touched after this lock is released
+        lock_guard<mutex> guard(batch.lock);
+        if (error && !batch.error)
+        {
+            batch.error = error;
+        }
+        if (--batch.remaining == 0)
+        {
+            batch.done.notify_all();
+        }
+    }
+
+    void workerLoop(unsigned index)
+    {
+        profiler().attachThread();
+        currentQueue = index;
+        Task task;
+        while (true)
+        {
+            if (takeTask(index, task))
+            {
+                runTask(task);
+                continue;
+            }
+            unique_lock<mutex> guard(sleepLock);
+            wake.wait(guard, [this]() { return stopping || pending > 0; });
+            if (stopping && pending == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    vector<Queue> queues;
+    vector<thread> workers;
+    atomic<size_t> pending{0};
+    bool stopping = false;
+    mutex sleepLock;
+    condition_variable wake;
+    static thread_local unsigned currentQueue;
+};
+
+thread_local unsigned ThreadPool::currentQueue = 0;
+
+/* Set by --threads; 0 uses every hardware thread */
+unsigned requestedThreadCount = 0;
+
+ThreadPool &threadPool()
+{
+    static ThreadPool pool(requestedThreadCount != 0 ? requestedThreadCount : thread::hardware_concurrency());
+    return pool;
+}
+
+/* Bytes per tile; small enough that a tile stays in L2 across every op of a fused run */
+const size_t kFusedTileBytes = 64 * 1024;
+
+/* Splits [0, imageSize) into pixel-aligned tiles and runs body(begin, end) for each of them on the pool */
+void forEachTile(size_t imageSize, int channels, const function<void(size_t, size_t)> &body)
+{
+    size_t tileBytes = kFusedTileBytes - kFusedTileBytes % channels;
+    size_t tiles = (imageSize + tileBytes - 1) / tileBytes;
+    threadPool().parallelFor(tiles, [&](size_t tile) {
+        size_t begin = tile * tileBytes;
+        body(begin, min(imageSize, begin + tileBytes));
+    });
+}
+
+/* Multiply Blend Method */
+TGAImage blendImagesMultiply(const TGAImage &topLayer, const TGAImage &bottomLayer)
+{
+    TGAImage blendedImage;
+    blendedImage.header = topLayer.header;
+    size_t imageSize = imageLayout(topLayer.header).bytes;
+    blendedImage.data.allocate(imageSize);
+
+    int channels = topLayer.header.pixelDepth / 8;
+    uint8_t *pixels = blendedImage.data.data();
+    forEachTile(imageSize, channels, [&](size_t begin, size_t end) {
+        blendKernels().multiply(pixels, topLayer.data.data(), bottomLayer.data.data(), begin, end, channels);
+    });
+
+    return blendedImage;
+}
+
+/* Screen Blend Method */
+TGAImage blendImagesScreen(const TGAImage &topLayer, const TGAImage &bottomLayer)
+{
+    TGAImage blendedImage;
+    blendedImage.header = topLayer.header;
+    size_t imageSize = imageLayout(topLayer.header).bytes;
+    blendedImage.data.allocate(imageSize);
+
+    int channels = topLayer.header.pixelDepth / 8;
+    uint8_t *pixels = blendedImage.data.data();
+    forEachTile(imageSize, channels, [&](size_t begin, size_t end) {
+        blendKernels().screen(pixels, topLayer.data.data(), bottomLayer.data.data(), begin, end, channels);
+    });
+
+    return blendedImage;
+}
+
+/* Subtract blend method */
+TGAImage blendImagesSubtract(const TGAImage &topLayer, const TGAImage &bottomLayer)
+{
+    TGAImage blendedImage;
+    blendedImage.header = topLayer.header;
+    size_t imageSize = imageLayout(topLayer.header).bytes;
+    blendedImage.data.allocate(imageSize);
+
+    int channels = topLayer.header.pixelDepth / 8;
+    uint8_t *pixels = blendedImage.data.data();
+    forEachTile(imageSize, channels, [&](size_t begin, size_t end) {
+        blendKernels().subtract(pixels, topLayer.data.data(), bottomLayer.data.data(), begin, end, channels);
+    });
+
+    return blendedImage;
+}
+
+/* Addition Blend Method */
+TGAImage blendImagesAddition(const TGAImage &topLayer, const TGAImage &bottomLayer)
+{
+    TGAImage blendedImage;
+    blendedImage.header = topLayer.header;
+    size_t imageSize = imageLayout(topLayer.header).bytes;
+    blendedImage.data.allocate(imageSize);
+
+    int channels = topLayer.header.pixelDepth / 8;
+    uint8_t *pixels = blendedImage.data.data();
+    forEachTile(imageSize, channels, [&](size_t begin, size_t end) {
+        blendKernels().addition(pixels, topLayer.data.data(), bottomLayer.data.data(), begin, end, channels);
+    });
+
+    return blendedImage;
+}
+
+/* Overlay Blend Method */
+TGAImage blendImagesOverlay(const TGAImage &topLayer, const TGAImage &bottomLayer)
+{
+    TGAImage blendedImage;
+    blendedImage.header = topLayer.header;
+    size_t imageSize = imageLayout(topLayer.header).bytes;
+    blendedImage.data.allocate(imageSize);
+
+    int channels = topLayer.header.pixelDepth / 8;
+    uint8_t *pixels = blendedImage.data.data();
+    forEachTile(imageSize, channels, [&](size_t begin, size_t end) {
+        blendKernels().overlay(pixels, topLayer.data.data(), bottomLayer.data.data(), begin, end, channels);
+    });
+
+    return blendedImage;
+}
+
+/* Add channel */
+TGAImage addToChannel(const TGAImage &inputImage, char channel, int n)
+{
+    TGAImage modifiedImage;
+    modifiedImage.header = inputImage.header;
+    size_t imageSize = imageLayout(inputImage.header).bytes;
+    modifiedImage.data.allocate(imageSize);
+
+    int channels = inputImage.header.pixelDepth / 8;
+    uint8_t *pixels = modifiedImage.data.data();
+    forEachTile(imageSize, channels, [&](size_t begin, size_t end) {
+        addToChannelPixels(pixels, inputImage.data.data(), begin, end, channels, channel, n);
+    });
+
+    return modifiedImage;
+}
+
+/* Scale Channel */
+TGAImage scaleChannel(const TGAImage &inputImage, char channel, float n)
+{
+    TGAImage modifiedImage;
+    modifiedImage.header = inputImage.header;
+    size_t imageSize = imageLayout(inputImage.header).bytes;
+    modifiedImage.data.allocate(imageSize);
+
+    int channels = inputImage.header.pixelDepth / 8;
+    uint8_t *pixels = modifiedImage.data.data();
+    forEachTile(imageSize, channels, [&](size_t begin, size_t end) {
+        scaleChannelPixels(pixels, inputImage.data.data(), begin, end, channels, channel, n);
+    });
+
+    return modifiedImage;
+}
+
+
+/* Combine Channels */
+TGAImage combineChannels(const TGAImage &redImage, const TGAImage &greenImage, const TGAImage &blueImage)
+{
+    TGAImage combinedImage;
+    combinedImage.header = redImage.header;
+    size_t imageSize = imageLayout(redImage.header).bytes;
+    combinedImage.data.allocate(imageSize);
+
+    int channels = redImage.header.pixelDepth / 8;
+    uint8_t *pixels = combinedImage.data.data();
+    forEachTile(imageSize, channels, [&](size_t begin, size_t end) {
+        combineChannelsPixels(pixels, redImage.data.data(), greenImage.data.data(), blueImage.data.data(), begin, end,
+                              channels);
+    });
+
+    return combinedImage;
+}
+
+TGAImage extractChannel(const TGAImage &inputImage, char channel)
+{
+    TGAImage extractedImage;
+    extractedImage.header = inputImage.header;
+    size_t imageSize = imageLayout(inputImage.header).bytes;
+    extractedImage.data.allocate(imageSize);
+
+    int channels = inputImage.header.pixelDepth / 8;
+    uint8_t *pixels = extractedImage.data.data();
+    forEachTile(imageSize, channels, [&](size_t begin, size_t end) {
+        extractChannelPixels(pixels, inputImage.data.data(), begin, end, channels, channel);
+    });
+
+    return extractedImage;
+}
+
+/* Composite: premultiplies the top layer, composites and un-premultiplies again, tile by tile */
+TGAImage compositeImages(const TGAImage &topLayer, const TGAImage &bottomLayer, CompositeMode mode)
+{
+    TGAImage compositedImage;
+    compositedImage.header = topLayer.header;
+    size_t imageSize = imageLayout(topLayer.header).bytes;
+    compositedImage.data.allocate(imageSize);
+
+    uint8_t *pixels = compositedImage.data.data();
+    const CompositeKernels &kernels = compositeKernels();
+    forEachTile(imageSize, 4, [&](size_t begin, size_t end) {
+        kernels.premultiply(pixels, topLayer.data.data(), begin, end);
+        kernels.modes[static_cast<int>(mode)](pixels, pixels, bottomLayer.data.data(), begin, end);
+        kernels.unpremultiply(pixels, pixels, begin, end);
+    });
+
+    return compositedImage;
+}
+
+/* Copies a row of width pixels from src to dst in reverse pixel order */
+void reversePixelsScalar(uint8_t *dst, const uint8_t *src, int width, int channels)
+{
+    for (int x = 0; x < width; ++x)
+    {
+        size_t srcIndex = static_cast<size_t>(x) * channels;
+        size_t dstIndex = static_cast<size_t>(width - x - 1) * channels;
+
+        for (int c = 0; c < channels; ++c)
+        {
+            dst[dstIndex + c] = src[srcIndex + c];
+        }
+    }
+}
+
+typedef void (*ReverseKernel)(uint8_t *dst, const uint8_t *src, int width, int channels);
+
+#ifdef TGA_X86_SIMD
+#define TGA_TARGET_SSSE3 __attribute__((target("ssse3")))
+
+/*
+ * SSSE3 reverses 16 gray pixels or 4 BGRA pixels per shuffle. For BGR, each 16-byte load ends at a 4-pixel group and
+ * the shuffle moves those 12 bytes to the front; the 4 bytes stored past the group are overwritten by the next one.
+ * Pixels are written front to back and the last few are left to the scalar loop.
+ */
+TGA_TARGET_SSSE3 void reversePixelsSSSE3(uint8_t *dst, const uint8_t *src, int width, int channels)
+{
+    int x = 0;
+    if (channels == 1)
+    {
+        const __m128i order = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + width - x - 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_shuffle_epi8(group, order));
+        }
+    }
+    else if (channels == 4)
+    {
+        for (; x + 4 <= width; x += 4)
+        {
+            __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + (width - x - 4) * 4));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x * 4), _mm_shuffle_epi32(group, 0x1B));
+        }
+    }
+    else if (channels == 3)
+    {
+        const __m128i order = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, -1, -1, -1, -1);
+        // The load starts 4 bytes before its group and the store runs 4 bytes past it
+        for (; x + 4 <= width - 2 && (x + 4) * 3 + 4 <= width * 3; x += 4)
+        {
+            __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + (width - x - 4) * 3 - 4));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x * 3), _mm_shuffle_epi8(group, order));
+        }
+    }
+    reversePixelsScalar(dst + static_cast<size_t>(x) * channels, src, width - x, channels);
+}
+#endif
+
+void reversePixels(uint8_t *dst, const uint8_t *src, int width, int channels)
+{
+    static const ReverseKernel kernel = []() {
+        ReverseKernel selected = reversePixelsScalar;
+#ifdef TGA_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("ssse3"))
+        {
+            selected = reversePixelsSSSE3;
+        }
+#endif
+        return selected;
+    }();
+    kernel(dst, src, width, channels);
+}
+
+/* Reverses a row within itself, through a per-thread scratch row that is only allocated when rows grow */
+void reverseRowInPlace(uint8_t *row, int width, int channels)
+{
+    thread_local vector<uint8_t> scratch;
+    scratch.assign(row, row + static_cast<size_t>(width) * channels);
+    reversePixels(row, scratch.data(), width, channels);
+}
+
+/* Runs body(y) for every row y in the top half (plus the middle row) in bands of row pairs on the pool */
+void forEachRowPair(int height, size_t rowBytes, const function<void(int)> &body)
+{
+    int pairs = (height + 1) / 2;
+    int pairsPerTask = max(1, static_cast<int>(kFusedTileBytes / max<size_t>(1, rowBytes * 2)));
+    size_t tasks = (pairs + pairsPerTask - 1) / pairsPerTask;
+    threadPool().parallelFor(tasks, [&](size_t task) {
+        int first = static_cast<int>(task) * pairsPerTask;
+        int last = min(pairs, first + pairsPerTask);
+        for (int y = first; y < last; ++y)
+        {
+            body(y);
+        }
+    });
+}
+
+/*
+ * Geometric Transforms
+ *
+ * Every rotation, mirror and transpose is one of eight orientations of the pixel grid: an optional swap of the x and
+ * y axes, then optional reversals of x and y. Transforms that keep the axes move whole rows, reversing them with the
+ * SIMD pixel shuffle. Transforms that swap them copy 32x32-pixel blocks, so the source rows a block reads and the
+ * destination rows it writes all stay in cache.
+ */
+enum class Transform
+{
+    Rotate90,
+    Rotate180,
+    Rotate270,
+    MirrorHorizontal,
+    MirrorVertical,
+    Transpose,
+    Transverse
+};
+
+struct Orientation
+{
+    bool swapAxes;
+    bool reverseX;
+    bool reverseY;
+};
+
+const int kTransformBlock = 32;
+
+/*
+ * Transforms are meant as seen on screen (rotate90 turns clockwise, transpose swaps across the top-left to bottom-right
+ * diagonal and transverse across the other one). Rows are stored bottom-up unless descriptor bit 5 is set, and right to left when bit 4 is set; either
+ * one alone mirrors storage against the screen, which turns clockwise into counterclockwise and the diagonal into
+ * the anti-diagonal.
+ */
+Orientation storageOrientation(Transform transform, const TGAHeader &header)
+{
+    bool topOrigin = (header.imageDescriptor & 0x20) != 0;
+    bool rightOrigin = (header.imageDescriptor & 0x10) != 0;
+    bool mirrored = topOrigin == rightOrigin;
+
+    switch (transform)
+    {
+    case Transform::Rotate90:
+        return mirrored ? Orientation{true, true, false} : Orientation{true, false, true};
+    case Transform::Rotate180:
+        return {false, true, true};
+    case Transform::Rotate270:
+        return mirrored ? Orientation{true, false, true} : Orientation{true, true, false};
+    case Transform::MirrorHorizontal:
+        return {false, true, false};
+    case Transform::MirrorVertical:
+        return {false, false, true};
+    case Transform::Transpose:
+        return mirrored ? Orientation{true, true, true} : Orientation{true, false, false};
+    case Transform::Transverse:
+        return mirrored ? Orientation{true, false, false} : Orientation{true, true, true};
+    }
+    throw logic_error("Unknown transform");
+}
+
+/* Copies output rows [firstRow, lastRow) of an axis-swapping orientation block by block */
+template <int Channels>
+void orientBlocked(uint8_t *dst, const uint8_t *src, int width, int height, Orientation orientation, int firstRow,
+                   int lastRow)
+{
+    // The output is height pixels wide: output row y reads source column x, and output column x reads source row y
+    ptrdiff_t srcRowBytes = static_cast<ptrdiff_t>(width) * Channels;
+    size_t dstRowBytes = static_cast<size_t>(height) * Channels;
+    ptrdiff_t step = orientation.reverseY ? -srcRowBytes : srcRowBytes;
+
+    for (int x0 = 0; x0 < height; x0 += kTransformBlock)
+    {
+        int x1 = min(height, x0 + kTransformBlock);
+        int firstSourceRow = orientation.reverseY ? height - 1 - x0 : x0;
+        for (int y = firstRow; y < lastRow; ++y)
+        {
+            int sourceColumn = orientation.reverseX ? width - 1 - y : y;
+            const uint8_t *in = src + firstSourceRow * srcRowBytes + static_cast<ptrdiff_t>(sourceColumn) * Channels;
+            uint8_t *out = dst + y * dstRowBytes + static_cast<size_t>(x0) * Channels;
+            for (int x = x0; x < x1; ++x, in += step, out += Channels)
+            {
+                memcpy(out, in, Channels);
+            }
+        }
+    }
+}
+
+/* Writes src, width x height pixels, to dst in the given orientation; dst must not overlap src */
+void orientPixels(uint8_t *dst, const uint8_t *src, int width, int height, int channels, Orientation orientation)
+{
+    size_t rowBytes = static_cast<size_t>(width) * channels;
+    if (!orientation.swapAxes)
+    {
+        int rowsPerTask = max(1, static_cast<int>(kFusedTileBytes / max<size_t>(1, rowBytes)));
+        size_t tasks = (height + rowsPerTask - 1) / rowsPerTask;
+        threadPool().parallelFor(tasks, [&](size_t task) {
+            int first = static_cast<int>(task) * rowsPerTask;
+            int last = min(height, first + rowsPerTask);
+            for (int y = first; y < last; ++y)
+            {
+                const uint8_t *in = src + (orientation.reverseY ? height - 1 - y : y) * rowBytes;
+                if (orientation.reverseX)
+                {
+                    reversePixels(dst + y * rowBytes, in, width, channels);
+                }
+                else
+                {
+                    memcpy(dst + y * rowBytes, in, rowBytes);
+                }
+            }
+        });
+        return;
+    }
+
+    // Bands of whole blocks, one output block row per task
+    size_t tasks = (width + kTransformBlock - 1) / kTransformBlock;
+    threadPool().parallelFor(tasks, [&](size_t task) {
+        int first = static_cast<int>(task) * kTransformBlock;
+        int last = min(width, first + kTransformBlock);
+        switch (channels)
+        {
+        case 1:
+            orientBlocked<1>(dst, src, width, height, orientation, first, last);
+            break;
+        case 3:
+            orientBlocked<3>(dst, src, width, height, orientation, first, last);
+            break;
+        case 4:
+            orientBlocked<4>(dst, src, width, height, orientation, first, last);
+            break;
+        default:
+            throw runtime_error("Unsupported pixel size of " + to_string(channels) + " bytes");
+        }
+    });
+}
+
+TGAImage geometricTransform(const TGAImage &inputImage, Transform transform)
+{
+    Orientation orientation = storageOrientation(transform, inputImage.header);
+    int channels = inputImage.header.pixelDepth / 8;
+    int width = inputImage.header.width;
+    int height = inputImage.header.height;
+
+    TGAImage transformedImage;
+    transformedImage.header = inputImage.header;
+    if (orientation.swapAxes)
+    {
+        transformedImage.header.width = inputImage.header.height;
+        transformedImage.header.height = inputImage.header.width;
+    }
+    transformedImage.data.allocate(imageLayout(inputImage.header).bytes);
+    orientPixels(transformedImage.data.data(), inputImage.data.data(), width, height, channels, orientation);
+    return transformedImage;
+}
+
+/* Mirrors how a reader lays out the stored pixels, without touching them; only flips and mirrors can */
+void flipOrigin(TGAHeader &header, Transform transform)
+{
+    int bits = transform == Transform::Rotate180          ? 0x30
+               : transform == Transform::MirrorHorizontal ? 0x10
+               : transform == Transform::MirrorVertical   ? 0x20
+                                                          : 0;
+    if (bits == 0)
+    {
+        throw logic_error("Only flips and mirrors can be done through the origin bits");
+    }
+    header.imageDescriptor = static_cast<char>(header.imageDescriptor ^ bits);
+}
+
+/* Rotate 180 Degrees */
+TGAImage rotate180(const TGAImage &inputImage)
+{
+    return geometricTransform(inputImage, Transform::Rotate180);
+}
+
+/*
+ * In-Place Variants
+ *
+ * These mutate the running image instead of building a new one. A memory-mapped image is read in place and its
+ * result lands in a pooled buffer, which then replaces the mapping.
+ */
+template <typename Kernel>
+void transformInPlace(TGAImage &image, Kernel kernel)
+{
+    int channels = image.header.pixelDepth / 8;
+    size_t imageSize = imageLayout(image.header).bytes;
+    const uint8_t *source = as_const(image.data).data();
+
+    PixelBuffer result;
+    uint8_t *pixels;
+    if (image.data.isMapped())
+    {
+        result.allocate(imageSize);
+        pixels = result.data();
+    }
+    else
+    {
+        pixels = image.data.data();
+    }
+
+    forEachTile(imageSize, channels, [&](size_t begin, size_t end) {
+        kernel(pixels, source, begin, end, channels);
+    });
+
+    if (image.data.isMapped())
+    {
+        image.data = move(result);
+    }
+}
+
+void blendImagesMultiplyInPlace(TGAImage &topLayer, const TGAImage &bottomLayer)
+{
+    const uint8_t *bottom = bottomLayer.data.data();
+    transformInPlace(topLayer, [&](uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels) {
+        blendKernels().multiply(dst, src, bottom, begin, end, channels);
+    });
+}
+
+void blendImagesScreenInPlace(TGAImage &topLayer, const TGAImage &bottomLayer)
+{
+    const uint8_t *bottom = bottomLayer.data.data();
+    transformInPlace(topLayer, [&](uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels) {
+        blendKernels().screen(dst, src, bottom, begin, end, channels);
+    });
+}
+
+void blendImagesSubtractInPlace(TGAImage &topLayer, const TGAImage &bottomLayer)
+{
+    const uint8_t *bottom = bottomLayer.data.data();
+    transformInPlace(topLayer, [&](uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels) {
+        blendKernels().subtract(dst, src, bottom, begin, end, channels);
+    });
+}
+
+void blendImagesAdditionInPlace(TGAImage &topLayer, const TGAImage &bottomLayer)
+{
+    const uint8_t *bottom = bottomLayer.data.data();
+    transformInPlace(topLayer, [&](uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels) {
+        blendKernels().addition(dst, src, bottom, begin, end, channels);
+    });
+}
+
+void blendImagesOverlayInPlace(TGAImage &topLayer, const TGAImage &bottomLayer)
+{
+    const uint8_t *bottom = bottomLayer.data.data();
+    transformInPlace(topLayer, [&](uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels) {
+        blendKernels().overlay(dst, src, bottom, begin, end, channels);
+    });
+}
+
+void addToChannelInPlace(TGAImage &image, char channel, int n)
+{
+    transformInPlace(image, [&](uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels) {
+        addToChannelPixels(dst, src, begin, end, channels, channel, n);
+    });
+}
+
+void scaleChannelInPlace(TGAImage &image, char channel, float n)
+{
+    transformInPlace(image, [&](uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels) {
+        scaleChannelPixels(dst, src, begin, end, channels, channel, n);
+    });
+}
+
+void combineChannelsInPlace(TGAImage &redImage, const TGAImage &greenImage, const TGAImage &blueImage)
+{
+    const uint8_t *green = greenImage.data.data();
+    const uint8_t *blue = blueImage.data.data();
+    transformInPlace(redImage, [&](uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels) {
+        combineChannelsPixels(dst, src, green, blue, begin, end, channels);
+    });
+}
+
+void extractChannelInPlace(TGAImage &image, char channel)
+{
+    transformInPlace(image, [&](uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels) {
+        extractChannelPixels(dst, src, begin, end, channels, channel);
+    });
+}
+
+/*
+ * Transforms that keep the axes swap mirrored row pairs through a one-row scratch buffer, so no second image is
+ * needed. Axis swaps, and mapped images, go through a fresh buffer that then replaces the old one.
+ */
+void geometricTransformInPlace(TGAImage &image, Transform transform)
+{
+    Orientation orientation = storageOrientation(transform, image.header);
+    if (image.data.isMapped() || orientation.swapAxes)
+    {
+        image = geometricTransform(image, transform);
+        return;
+    }
+
+    int channels = image.header.pixelDepth / 8;
+    int width = image.header.width;
+    int height = image.header.height;
+    size_t rowBytes = static_cast<size_t>(width) * channels;
+    uint8_t *pixels = image.data.data();
+
+    forEachRowPair(height, rowBytes, [&](int y) {
+        int mirror = height - y - 1;
+        uint8_t *upper = pixels + y * rowBytes;
+        uint8_t *lower = pixels + mirror * rowBytes;
+        if (orientation.reverseY && y != mirror)
+        {
+            thread_local vector<uint8_t> scratch;
+            scratch.assign(upper, upper + rowBytes);
+            if (orientation.reverseX)
+            {
+                reversePixels(upper, lower, width, channels);
+                reversePixels(lower, scratch.data(), width, channels);
+            }
+            else
+            {
+                memcpy(upper, lower, rowBytes);
+                memcpy(lower, scratch.data(), rowBytes);
+            }
+        }
+        else if (orientation.reverseX)
+        {
+            reverseRowInPlace(upper, width, channels);
+            if (y != mirror)
+            {
+                reverseRowInPlace(lower, width, channels);
+            }
+        }
+    });
+}
+
+void rotate180InPlace(TGAImage &image)
+{
+    geometricTransformInPlace(image, Transform::Rotate180);
+}
+
+/*
+ * Filters
+ *
+ * Convolutions are separable: a horizontal pass over each row, then a vertical pass down the columns. Work is split
+ * into bands of output rows that run on the pool. Each band filters the source rows it needs horizontally into a
+ * 32-bit buffer. That is its own rows plus a halo of radius rows above and below. Bands are sized so that buffer
+ * stays in L2. The vertical pass then walks the band a row at a time. Neighbouring bytes of a row are independent,
+ * so it runs as SIMD integer arithmetic over whole rows. The box filter slides a running sum in both directions and
+ * costs the same at any radius. The Gaussian uses integer weights that sum to 1 << kGaussianBits. Edges repeat the
+ * nearest pixel.
+ */
+const size_t kFilterBandBytes = 256 * 1024;
+const int kMaxBlurRadius = 255;
+const float kMaxGaussianSigma = 50.0f;
+const int kGaussianBits = 12;
+
+/* Adds weight * row into acc */
+void accumulateRow(uint32_t *acc, const uint32_t *row, uint32_t weight, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        acc[i] += weight * row[i];
+    }
+}
+
+/* Moves a window of running sums down a row: adds the row entering and takes out the row leaving */
+void slideRow(uint32_t *sums, const uint32_t *enter, const uint32_t *leave, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        sums[i] += enter[i] - leave[i];
+    }
+}
+
+typedef void (*AccumulateKernel)(uint32_t *acc, const uint32_t *row, uint32_t weight, size_t count);
+typedef void (*SlideKernel)(uint32_t *sums, const uint32_t *enter, const uint32_t *leave, size_t count);
+
+struct FilterKernels
+{
+    AccumulateKernel accumulate;
+    SlideKernel slide;
+    const char *name;
+};
+
+#ifdef TGA_X86_SIMD
+/* SSE2 has no 32-bit low multiply, so the even and odd lanes multiply separately and are interleaved back */
+void accumulateRowSSE2(uint32_t *acc, const uint32_t *row, uint32_t weight, size_t count)
+{
+    __m128i w = _mm_set1_epi32(static_cast<int>(weight));
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+        __m128i even = _mm_mul_epu32(values, w);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(values, 32), w);
+        __m128i products = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+        __m128i sums = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(acc + i), _mm_add_epi32(sums, products));
+    }
+    accumulateRow(acc + i, row + i, weight, count - i);
+}
+
+void slideRowSSE2(uint32_t *sums, const uint32_t *enter, const uint32_t *leave, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>(enter + i));
+        __m128i out = _mm_loadu_si128(reinterpret_cast<const __m128i *>(leave + i));
+        __m128i window = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sums + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(sums + i), _mm_add_epi32(window, _mm_sub_epi32(in, out)));
+    }
+    slideRow(sums + i, enter + i, leave + i, count - i);
+}
+
+TGA_TARGET_AVX2 void accumulateRowAVX2(uint32_t *acc, const uint32_t *row, uint32_t weight, size_t count)
+{
+    __m256i w = _mm256_set1_epi32(static_cast<int>(weight));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i));
+        __m256i sums = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc + i),
+                            _mm256_add_epi32(sums, _mm256_mullo_epi32(values, w)));
+    }
+    accumulateRow(acc + i, row + i, weight, count - i);
+}
+
+TGA_TARGET_AVX2 void slideRowAVX2(uint32_t *sums, const uint32_t *enter, const uint32_t *leave, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(enter + i));
+        __m256i out = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(leave + i));
+        __m256i window = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sums + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(sums + i),
+                            _mm256_add_epi32(window, _mm256_sub_epi32(in, out)));
+    }
+    slideRow(sums + i, enter + i, leave + i, count - i);
+}
+#endif
+
+const FilterKernels kScalarFilterKernels = {accumulateRow, slideRow, "scalar"};
+
+/* Every tier of filter kernels the CPU supports, scalar first and widest last; detected once on first use */
+const vector<FilterKernels> &supportedFilterKernels()
+{
+    static const vector<FilterKernels> tiers = []() {
+        vector<FilterKernels> supported = {kScalarFilterKernels};
+#ifdef TGA_X86_SIMD
+        __builtin_cpu_init();
+        supported.push_back({accumulateRowSSE2, slideRowSSE2, "sse2"});
+        if (__builtin_cpu_supports("avx2"))
+        {
+            supported.push_back({accumulateRowAVX2, slideRowAVX2, "avx2"});
+        }
+#endif
+        return supported;
+    }();
+    return tiers;
+}
+
+/* The widest filter kernels the CPU supports */
+const FilterKernels &filterKernels()
+{
+    return supportedFilterKernels().back();
+}
+
+/*
+ * Divides with rounding by a fixed divisor d through the reciprocal ceil(2^56 / d). That overshoots x + d / 2 by less
+ * than (x + d / 2) / 2^56, which cannot reach the next multiple of d while (x + d / 2) * d < 2^56. The box blur's
+ * sums stay below 256 * d and its largest divisor is (2 * kMaxBlurRadius + 1)^2 = 261121, well inside that bound.
+ */
+struct RoundingDivider
+{
+    uint64_t multiplier;
+    uint32_t half;
+
+    explicit RoundingDivider(uint32_t divisor)
+        : multiplier(((uint64_t(1) << 56) + divisor - 1) / divisor), half(divisor / 2)
+    {
+    }
+
+    uint8_t operator()(uint32_t x) const { return static_cast<uint8_t>((uint64_t(x + half) * multiplier) >> 56); }
+};
+
+/* Integer weights for taps -radius..radius that sum to exactly 1 << kGaussianBits */
+vector<uint32_t> gaussianWeights(float sigma, int &radius)
+{
+    radius = max(1, static_cast<int>(ceil(3.0f * sigma)));
+    vector<double> curve(2 * radius + 1);
+    double total = 0;
+    for (int k = -radius; k <= radius; ++k)
+    {
+        curve[k + radius] = exp(-0.5 * k * k / (static_cast<double>(sigma) * sigma));
+        total += curve[k + radius];
+    }
+
+    vector<uint32_t> weights(2 * radius + 1);
+    uint32_t sum = 0;
+    for (int k = 0; k <= 2 * radius; ++k)
+    {
+        if (k != radius)
+        {
+            weights[k] = static_cast<uint32_t>(curve[k] / total * (1 << kGaussianBits) + 0.5);
+            sum += weights[k];
+        }
+    }
+    // The center takes up the rounding, so a flat image stays exactly flat
+    weights[radius] = (1u << kGaussianBits) - sum;
+    return weights;
+}
+
+/* Widens a row to 32 bits with radius copies of its edge pixels on either side */
+void padRow(uint32_t *padded, const uint8_t *row, size_t width, int channels, int radius)
+{
+    size_t rowBytes = width * channels;
+    for (int k = 0; k < radius; ++k)
+    {
+        for (int j = 0; j < channels; ++j)
+        {
+            padded[k * channels + j] = row[j];
+            padded[radius * channels + rowBytes + k * channels + j] = row[rowBytes - channels + j];
+        }
+    }
+    for (size_t i = 0; i < rowBytes; ++i)
+    {
+        padded[radius * channels + i] = row[i];
+    }
+}
+
+/* Source rows [top, bottom) a band of output rows [first, last) reads, and their horizontal pass */
+struct FilterBand
+{
+    size_t top;
+    size_t bottom;
+    size_t stride;
+    vector<uint32_t> sums;
+
+    /* The filtered source row y, with rows past either edge repeating the edge */
+    const uint32_t *row(ptrdiff_t y) const
+    {
+        ptrdiff_t clamped = min(max(y, static_cast<ptrdiff_t>(top)), static_cast<ptrdiff_t>(bottom) - 1);
+        return sums.data() + (clamped - top) * stride;
+    }
+};
+
+/*
+ * Runs filterRow(sums, padded) over every source row the band needs, where padded is the row widened to 32 bits with
+ * radius edge pixels on either side, and sums is that row's stride entries of the band
+ */
+template <typename RowPass>
+void horizontalPass(FilterBand &band, const uint8_t *src, size_t width, size_t height, int channels, int radius,
+                    size_t stride, size_t first, size_t last, RowPass filterRow)
+{
+    size_t rowBytes = width * channels;
+    band.top = first > static_cast<size_t>(radius) ? first - radius : 0;
+    band.bottom = min(height, last + radius);
+    band.stride = stride;
+    band.sums.assign((band.bottom - band.top) * stride, 0);
+    vector<uint32_t> padded(rowBytes + 2 * radius * channels);
+    for (size_t y = band.top; y < band.bottom; ++y)
+    {
+        padRow(padded.data(), src + y * rowBytes, width, channels, radius);
+        filterRow(band.sums.data() + (y - band.top) * stride, padded.data());
+    }
+}
+
+/* Runs body(first, last) over bands of output rows, small enough that a band's buffer and halo stay in L2 */
+void forEachFilterBand(size_t height, size_t rowBytes, int radius, const function<void(size_t, size_t)> &body)
+{
+    // An empty image has no rows to pad, and its filtered copy stays empty
+    if (height == 0 || rowBytes == 0)
+    {
+        return;
+    }
+    size_t rows = max<size_t>({8, 2 * static_cast<size_t>(radius), kFilterBandBytes / max<size_t>(1, 4 * rowBytes)});
+    // Every thread still gets a couple of bands on short images
+    rows = max<size_t>(1, min(rows, (height + 2 * threadPool().size() - 1) / (2 * threadPool().size())));
+    size_t bands = (height + rows - 1) / rows;
+    threadPool().parallelFor(bands, [&](size_t band) { body(band * rows, min(height, (band + 1) * rows)); });
+}
+
+/* A copy of image's header with fresh pixel storage, for filters that write a new image */
+TGAImage filteredCopy(const TGAImage &image)
+{
+    TGAImage filtered;
+    filtered.header = image.header;
+    filtered.data.allocate(image.data.size());
+    return filtered;
+}
+
+/* Box Blur Filter */
+TGAImage boxBlur(const TGAImage &image, int radius)
+{
+    int channels = image.header.pixelDepth / 8;
+    size_t width = image.header.width;
+    size_t height = image.header.height;
+    size_t rowBytes = width * channels;
+    size_t window = 2 * static_cast<size_t>(radius) + 1;
+    RoundingDivider divide(static_cast<uint32_t>(window * window));
+    TGAImage blurred = filteredCopy(image);
+    const uint8_t *src = image.data.data();
+    uint8_t *dst = blurred.data.data();
+
+    forEachFilterBand(height, rowBytes, radius, [&](size_t first, size_t last) {
+        FilterBand band;
+        horizontalPass(band, src, width, height, channels, radius, rowBytes, first, last,
+                       [&](uint32_t *sums, const uint32_t *padded) {
+                           // Each channel's running sum drops the byte leaving the window and adds the one entering it
+                           for (int j = 0; j < channels; ++j)
+                           {
+                               uint32_t sum = 0;
+                               for (size_t k = 0; k < window; ++k)
+                               {
+                                   sum += padded[k * channels + j];
+                               }
+                               sums[j] = sum;
+                           }
+                           for (size_t i = channels; i < rowBytes; ++i)
+                           {
+                               size_t entering = i + (window - 1) * channels;
+                               sums[i] = sums[i - channels] + padded[entering] - padded[i - channels];
+                           }
+                       });
+
+        vector<uint32_t> column(rowBytes, 0);
+        for (ptrdiff_t k = -radius; k <= radius; ++k)
+        {
+            filterKernels().accumulate(column.data(), band.row(static_cast<ptrdiff_t>(first) + k), 1, rowBytes);
+        }
+        for (size_t y = first; y < last; ++y)
+        {
+            uint8_t *out = dst + y * rowBytes;
+            for (size_t i = 0; i < rowBytes; ++i)
+            {
+                out[i] = divide(column[i]);
+            }
+            ptrdiff_t next = static_cast<ptrdiff_t>(y) + 1;
+            filterKernels().slide(column.data(), band.row(next + radius), band.row(next - radius - 1), rowBytes);
+        }
+    });
+    return blurred;
+}
+
+/* Gaussian Blur Filter */
+TGAImage gaussianBlur(const TGAImage &image, float sigma)
+{
+    int channels = image.header.pixelDepth / 8;
+    size_t width = image.header.width;
+    size_t height = image.header.height;
+    size_t rowBytes = width * channels;
+    int radius;
+    vector<uint32_t> weights = gaussianWeights(sigma, radius);
+    TGAImage blurred = filteredCopy(image);
+    const uint8_t *src = image.data.data();
+    uint8_t *dst = blurred.data.data();
+
+    forEachFilterBand(height, rowBytes, radius, [&](size_t first, size_t last) {
+        FilterBand band;
+        horizontalPass(band, src, width, height, channels, radius, rowBytes, first, last,
+                       [&](uint32_t *sums, const uint32_t *padded) {
+                           for (size_t k = 0; k < weights.size(); ++k)
+                           {
+                               filterKernels().accumulate(sums, padded + k * channels, weights[k], rowBytes);
+                           }
+                       });
+
+        // Both passes scale by 1 << kGaussianBits; the largest total, 255 << 24, still fits in 32 bits
+        const uint32_t half = 1u << (2 * kGaussianBits - 1);
+        vector<uint32_t> acc(rowBytes);
+        for (size_t y = first; y < last; ++y)
+        {
+            fill(acc.begin(), acc.end(), half);
+            for (ptrdiff_t k = -radius; k <= radius; ++k)
+            {
+                filterKernels().accumulate(acc.data(), band.row(static_cast<ptrdiff_t>(y) + k), weights[k + radius],
+                                           rowBytes);
+            }
+            uint8_t *out = dst + y * rowBytes;
+            for (size_t i = 0; i < rowBytes; ++i)
+            {
+                out[i] = static_cast<uint8_t>(acc[i] >> (2 * kGaussianBits));
+            }
+        }
+    });
+    return blurred;
+}
+
+/* Sharpen Filter: an unsharp mask that adds amount times the difference from a Gaussian blur of sigma 1 */
+TGAImage sharpen(const TGAImage &image, float amount)
+{
+    int channels = image.header.pixelDepth / 8;
+    int weight = static_cast<int>(amount * 256.0f + 0.5f);
+    TGAImage sharpened = gaussianBlur(image, 1.0f);
+    const uint8_t *src = image.data.data();
+    uint8_t *pixels = sharpened.data.data();
+    forEachTile(image.data.size(), channels, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i)
+        {
+            // Alpha stays as it is
+            if (channels == 4 && i % 4 == 3)
+            {
+                pixels[i] = src[i];
+                continue;
+            }
+            int detail = (src[i] - pixels[i]) * weight;
+            int value = src[i] + (detail >= 0 ? (detail + 128) >> 8 : -((128 - detail) >> 8));
+            pixels[i] = static_cast<uint8_t>(min(255, max(0, value)));
+        }
+    });
+    return sharpened;
+}
+
+/*
+ * Edge Detection Filter: Sobel gradients per channel, as the sum of their magnitudes over 4 so a full step reads 255.
+ * The horizontal pass keeps each row smoothed ([1 2 1]) and differenced ([-1 0 1]) side by side, the differences as
+ * two's complement.
+ */
+TGAImage detectEdges(const TGAImage &image)
+{
+    int channels = image.header.pixelDepth / 8;
+    size_t width = image.header.width;
+    size_t height = image.header.height;
+    size_t rowBytes = width * channels;
+    TGAImage edges = filteredCopy(image);
+    const uint8_t *src = image.data.data();
+    uint8_t *dst = edges.data.data();
+
+    forEachFilterBand(height, 2 * rowBytes, 1, [&](size_t first, size_t last) {
+        FilterBand band;
+        horizontalPass(band, src, width, height, channels, 1, 2 * rowBytes, first, last,
+                       [&](uint32_t *sums, const uint32_t *padded) {
+                           for (size_t i = 0; i < rowBytes; ++i)
+                           {
+                               sums[i] = padded[i] + 2 * padded[i + channels] + padded[i + 2 * channels];
+                               sums[rowBytes + i] = padded[i + 2 * channels] - padded[i];
+                           }
+                       });
+
+        for (size_t y = first; y < last; ++y)
+        {
+            const uint32_t *above = band.row(static_cast<ptrdiff_t>(y) - 1);
+            const uint32_t *here = band.row(static_cast<ptrdiff_t>(y));
+            const uint32_t *below = band.row(static_cast<ptrdiff_t>(y) + 1);
+            uint8_t *out = dst + y * rowBytes;
+            for (size_t i = 0; i < rowBytes; ++i)
+            {
+                int gx = static_cast<int32_t>(above[rowBytes + i] + 2 * here[rowBytes + i] + below[rowBytes + i]);
+                int gy = static_cast<int>(below[i]) - static_cast<int>(above[i]);
+                out[i] = static_cast<uint8_t>(min(255, (abs(gx) + abs(gy) + 2) >> 2));
+            }
+            // Alpha stays as it is
+            if (channels == 4)
+            {
+                for (size_t i = 3; i < rowBytes; i += 4)
+                {
+                    out[i] = src[y * rowBytes + i];
+                }
+            }
+        }
+    });
+    return edges;
+}
+
+/*
+ * Resampling
+ *
+ * downscale halves both sides by averaging each 2x2 block of pixels, rounding to nearest. An odd last row or column is
+ * dropped, and a side of one pixel stays one pixel, as in a texture's mip chain. A mip chain is built in bands of
+ * 2^kMipBandLevels source rows. Each band halves itself level after level while its rows are still in cache, so the
+ * first kMipBandLevels levels take a single pass over the source; deeper levels start again from the smallest one.
+ * Arbitrary sizes are resampled separably. Each output column and row gets a precomputed window of source taps with
+ * integer weights that sum to 1 << kResampleBits. The filter widens with the ratio when shrinking, so it averages
+ * rather than skipping pixels.
+ */
+enum class ResampleFilter
+{
+    Bilinear,
+    Lanczos
+};
+
+const char *const kResampleFilterNames[] = {"bilinear", "lanczos"};
+const int kMipBandLevels = 6;
+const int kResampleBits = 14;
+const int kResampleRowBits = 7;
+
+/* Halve Row Kernel: averages pixel pairs across the upper and lower rows into width pixels */
+void halveRow(uint8_t *dst, const uint8_t *upper, const uint8_t *lower, size_t width, int channels)
+{
+    for (size_t x = 0; x < width; ++x)
+    {
+        for (int j = 0; j < channels; ++j)
+        {
+            size_t left = 2 * x * channels + j;
+            size_t right = left + channels;
+            dst[x * channels + j] =
+                static_cast<uint8_t>((upper[left] + upper[right] + lower[left] + lower[right] + 2) >> 2);
+        }
+    }
+}
+
+typedef void (*HalveKernel)(uint8_t *dst, const uint8_t *upper, const uint8_t *lower, size_t width, int channels);
+
+#ifdef TGA_X86_SIMD
+/*
+ * Four source pixels widen into two vectors of 16-bit lanes, two pixels each. Adding a vector to itself shifted by one
+ * pixel puts each pair's sum in its low half, and the low halves of the two vectors make two output pixels.
+ */
+void halveRowSSE2(uint8_t *dst, const uint8_t *upper, const uint8_t *lower, size_t width, int channels)
+{
+    if (channels != 4)
+    {
+        halveRow(dst, upper, lower, width, channels);
+        return;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    auto halveFour = [&](size_t x) {
+        __m128i top = _mm_loadu_si128(reinterpret_cast<const __m128i *>(upper + 8 * x));
+        __m128i bottom = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lower + 8 * x));
+        __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+        __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+        low = _mm_add_epi16(low, _mm_srli_si128(low, 8));
+        high = _mm_add_epi16(high, _mm_srli_si128(high, 8));
+        return _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(low, high), two), 2);
+    };
+
+    size_t x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i pixels = _mm_packus_epi16(halveFour(x), halveFour(x + 2));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4 * x), pixels);
+    }
+    halveRow(dst + 4 * x, upper + 8 * x, lower + 8 * x, width - x, channels);
+}
+#endif
+
+const HalveKernel &halveKernel()
+{
+    static const HalveKernel kernel = []() {
+        HalveKernel selected = halveRow;
+#ifdef TGA_X86_SIMD
+        selected = halveRowSSE2;
+#endif
+        return selected;
+    }();
+    return kernel;
+}
+
+/* The image halved in both directions, with only its header filled in */
+TGAImage halvedHeader(const TGAImage &image)
+{
+    TGAImage halved;
+    halved.header = image.header;
+    halved.header.width = static_cast<uint16_t>(max(1, image.header.width / 2));
+    halved.header.height = static_cast<uint16_t>(max(1, image.header.height / 2));
+    return halved;
+}
+
+/* Writes rows [first, last) of next, which is level halved */
+void halveRows(TGAImage &next, const TGAImage &level, size_t first, size_t last)
+{
+    int channels = level.header.pixelDepth / 8;
+    size_t width = level.header.width;
+    size_t height = level.header.height;
+    size_t rowBytes = width * channels;
+    size_t nextWidth = next.header.width;
+    for (size_t y = first; y < last; ++y)
+    {
+        const uint8_t *upper = level.data.data() + 2 * y * rowBytes;
+        const uint8_t *lower = 2 * y + 1 < height ? upper + rowBytes : upper;
+        uint8_t *dst = next.data.data() + y * nextWidth * channels;
+        if (width == 1)
+        {
+            // A single column pairs with itself
+            uint8_t column[2][4] = {};
+            memcpy(column[0], upper, channels);
+            memcpy(column[0] + channels, upper, channels);
+            memcpy(column[1], lower, channels);
+            memcpy(column[1] + channels, lower, channels);
+            halveRow(dst, column[0], column[1], 1, channels);
+        }
+        else
+        {
+            halveKernel()(dst, upper, lower, nextWidth, channels);
+        }
+    }
+}
+
+/* Downscale Method */
+TGAImage downscale(const TGAImage &image)
+{
+    TGAImage halved = halvedHeader(image);
+    int channels = image.header.pixelDepth / 8;
+    size_t width = halved.header.width;
+    size_t height = halved.header.height;
+    halved.data.allocate(width * height * channels);
+    size_t rows = max<size_t>(1, kFusedTileBytes / max<size_t>(1, width * channels));
+    threadPool().parallelFor((height + rows - 1) / rows, [&](size_t band) {
+        halveRows(halved, image, band * rows, min(height, (band + 1) * rows));
+    });
+    return halved;
+}
+
+/* Every level of the mip chain below image, halving down to a single pixel */
+vector<TGAImage> mipLevels(const TGAImage &image)
+{
+    vector<TGAImage> levels;
+    const TGAImage *level = &image;
+    while (level->header.width != 1 || level->header.height != 1)
+    {
+        levels.push_back(halvedHeader(*level));
+        TGAImage &next = levels.back();
+        next.data.allocate(imageLayout(next.header).bytes);
+        level = &next;
+    }
+
+    // Row y of a level comes from rows 2y and 2y + 1 of the one above, so a band's rows halve within the band
+    const size_t bandRows = size_t(1) << kMipBandLevels;
+    for (size_t base = 0; base < levels.size(); base += kMipBandLevels)
+    {
+        const TGAImage &source = base == 0 ? image : levels[base - 1];
+        size_t depth = min<size_t>(kMipBandLevels, levels.size() - base);
+        size_t bands = (source.header.height + bandRows - 1) / bandRows;
+        threadPool().parallelFor(bands, [&](size_t band) {
+            for (size_t k = 1; k <= depth; ++k)
+            {
+                TGAImage &next = levels[base + k - 1];
+                size_t height = next.header.height;
+                size_t first = (band * bandRows) >> k;
+                size_t last = min(height, ((band + 1) * bandRows) >> k);
+                halveRows(next, k == 1 ? source : levels[base + k - 2], first, last);
+            }
+        });
+    }
+    return levels;
+}
+
+/* Source taps and their weights for every output coordinate along one axis */
+struct ResampleTable
+{
+    int taps;
+    vector<int> first;
+    vector<int32_t> weights;
+};
+
+double resampleKernel(ResampleFilter filter, double t)
+{
+    t = fabs(t);
+    if (filter == ResampleFilter::Bilinear)
+    {
+        return max(0.0, 1.0 - t);
+    }
+    if (t < 1e-9)
+    {
+        return 1.0;
+    }
+    if (t >= 3.0)
+    {
+        return 0.0;
+    }
+    const double pi = 3.14159265358979323846;
+    return 3.0 * sin(pi * t) * sin(pi * t / 3.0) / (pi * pi * t * t);
+}
+
+ResampleTable resampleTable(int source, int target, ResampleFilter filter)
+{
+    double scale = static_cast<double>(source) / target;
+    double stretch = max(1.0, scale);
+    double support = (filter == ResampleFilter::Lanczos ? 3.0 : 1.0) * stretch;
+
+    ResampleTable table;
+    table.taps = min(source, static_cast<int>(ceil(2.0 * support)) + 2);
+    table.first.resize(target);
+    table.weights.assign(static_cast<size_t>(target) * table.taps, 0);
+    vector<double> curve(table.taps);
+    for (int x = 0; x < target; ++x)
+    {
+        // Pixel centers sit at half coordinates on both axes; taps past either edge repeat the edge pixel
+        double center = (x + 0.5) * scale;
+        int low = static_cast<int>(floor(center - support));
+        int high = static_cast<int>(ceil(center + support));
+        int first = min(max(low, 0), source - table.taps);
+        fill(curve.begin(), curve.end(), 0.0);
+        double total = 0;
+        for (int j = low; j <= high; ++j)
+        {
+            double weight = resampleKernel(filter, (j + 0.5 - center) / stretch);
+            curve[min(max(j, 0), source - 1) - first] += weight;
+            total += weight;
+        }
+
+        int32_t *weights = &table.weights[static_cast<size_t>(x) * table.taps];
+        int32_t sum = 0;
+        int largest = 0;
+        for (int t = 0; t < table.taps; ++t)
+        {
+            weights[t] = static_cast<int32_t>(lround(curve[t] / total * (1 << kResampleBits)));
+            sum += weights[t];
+            largest = fabs(curve[t]) > fabs(curve[largest]) ? t : largest;
+        }
+        // The largest tap takes up the rounding, so a flat image stays exactly flat
+        weights[largest] += (1 << kResampleBits) - sum;
+        table.first[x] = first;
+    }
+    return table;
+}
+
+/*
+ * Resize Method. The horizontal pass keeps kResampleRowBits of fraction, and Lanczos's negative lobes make its values
+ * signed. The vertical pass accumulates them with the unsigned row kernel, whose wrapping arithmetic gives the same
+ * bits as signed arithmetic would.
+ */
+TGAImage resizeImage(const TGAImage &image, int width, int height, ResampleFilter filter)
+{
+    int channels = image.header.pixelDepth / 8;
+    int sourceWidth = image.header.width;
+    int sourceHeight = image.header.height;
+    if (sourceWidth == 0 || sourceHeight == 0)
+    {
+        throw runtime_error("Cannot resize an empty image to " + to_string(width) + "x" + to_string(height));
+    }
+    ResampleTable columns = resampleTable(sourceWidth, width, filter);
+    ResampleTable rows = resampleTable(sourceHeight, height, filter);
+    size_t sourceRowBytes = static_cast<size_t>(sourceWidth) * channels;
+    size_t rowBytes = static_cast<size_t>(width) * channels;
+
+    TGAImage resized;
+    resized.header = image.header;
+    resized.header.width = static_cast<uint16_t>(width);
+    resized.header.height = static_cast<uint16_t>(height);
+    resized.data.allocate(rowBytes * height);
+
+    vector<uint32_t> across(rowBytes * sourceHeight);
+    const size_t rowsPerTask = 16;
+    threadPool().parallelFor((sourceHeight + rowsPerTask - 1) / rowsPerTask, [&](size_t task) {
+        size_t last = min<size_t>(sourceHeight, (task + 1) * rowsPerTask);
+        for (size_t y = task * rowsPerTask; y < last; ++y)
+        {
+            const uint8_t *row = image.data.data() + y * sourceRowBytes;
+            uint32_t *out = across.data() + y * rowBytes;
+            for (int x = 0; x < width; ++x)
+            {
+                const int32_t *weights = &columns.weights[static_cast<size_t>(x) * columns.taps];
+                const uint8_t *pixels = row + static_cast<size_t>(columns.first[x]) * channels;
+                for (int j = 0; j < channels; ++j)
+                {
+                    int32_t sum = 0;
+                    for (int t = 0; t < columns.taps; ++t)
+                    {
+                        sum += weights[t] * pixels[t * channels + j];
+                    }
+                    out[x * channels + j] = static_cast<uint32_t>(
+                        (sum + (1 << (kResampleBits - kResampleRowBits - 1))) >> (kResampleBits - kResampleRowBits));
+                }
+            }
+        }
+    });
+
+    const int bits = kResampleBits + kResampleRowBits;
+    threadPool().parallelFor((height + rowsPerTask - 1) / rowsPerTask, [&](size_t task) {
+        vector<uint32_t> acc(rowBytes);
+        size_t last = min<size_t>(height, (task + 1) * rowsPerTask);
+        for (size_t y = task * rowsPerTask; y < last; ++y)
+        {
+            fill(acc.begin(), acc.end(), 1u << (bits - 1));
+            const int32_t *weights = &rows.weights[y * rows.taps];
+            for (int t = 0; t < rows.taps; ++t)
+            {
+                filterKernels().accumulate(acc.data(), across.data() + (rows.first[y] + t) * rowBytes,
+                                           static_cast<uint32_t>(weights[t]), rowBytes);
+            }
+            uint8_t *out = resized.data.data() + y * rowBytes;
+            for (size_t i = 0; i < rowBytes; ++i)
+            {
+                out[i] = static_cast<uint8_t>(min(255, max(0, static_cast<int32_t>(acc[i]) >> bits)));
+            }
+        }
+    });
+    return resized;
+}
+
+/* A rectangle of stored pixels */
+struct Region
+{
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+};
+
+/*
+ * The stored pixels of a crop given as seen on screen, from the top-left corner: rows are stored bottom-up and
+ * columns right to left when the origin bits say so. Throws if the crop does not lie inside the image.
+ */
+Region storageRegion(const TGAHeader &header, int left, int top, int width, int height)
+{
+    size_t imageWidth = header.width;
+    size_t imageHeight = header.height;
+    if (static_cast<size_t>(left) + width > imageWidth || static_cast<size_t>(top) + height > imageHeight)
+    {
+        throw runtime_error("Crop " + to_string(width) + "x" + to_string(height) + " at (" + to_string(left) + ", " +
+                            to_string(top) + ") lies outside the " + to_string(imageWidth) + "x" +
+                            to_string(imageHeight) + " image");
+    }
+
+    Region region{static_cast<size_t>(left), static_cast<size_t>(top), static_cast<size_t>(width),
+                  static_cast<size_t>(height)};
+    if ((header.imageDescriptor & 0x20) == 0)
+    {
+        region.y = imageHeight - top - height;
+    }
+    if ((header.imageDescriptor & 0x10) != 0)
+    {
+        region.x = imageWidth - left - width;
+    }
+    return region;
+}
+
+/* Crop Method */
+TGAImage cropImage(const TGAImage &image, const Region &region)
+{
+    int channels = image.header.pixelDepth / 8;
+    size_t imageRowBytes = static_cast<size_t>(image.header.width) * channels;
+    size_t rowBytes = region.width * channels;
+    TGAImage cropped;
+    cropped.header = image.header;
+    cropped.header.width = static_cast<uint16_t>(region.width);
+    cropped.header.height = static_cast<uint16_t>(region.height);
+    cropped.data.allocate(rowBytes * region.height);
+    for (size_t y = 0; y < region.height; ++y)
+    {
+        memcpy(cropped.data.data() + y * rowBytes,
+               image.data.data() + (region.y + y) * imageRowBytes + region.x * channels, rowBytes);
+    }
+    return cropped;
+}
+
+/*
+ * Statistics
+ *
+ * Histograms of each byte position of a pixel, counted in one contiguous part of the image per pool thread, each into
+ * its own sub-histogram; the parts are then summed channel by channel on the pool. Within a part, consecutive pixels
+ * count into separate copies of the table: flat areas repeat a value, and incrementing one counter back to back makes
+ * every increment wait for the store before it to land. Levels ops turn the counts into a channel lookup table.
+ */
+const int kHistogramCopies = 4;
+
+/* Bytes counted into the 32-bit copies before they are added up; a multiple of every pixel size */
+const size_t kHistogramChunkBytes = size_t(12) << 20;
+
+/* Percentage autolevels clips off either end of each channel unless told otherwise */
+const float kDefaultLevelsClip = 0.1f;
+
+/* Pixel counts of every value at each byte position of a pixel (B, G, R, A, or the one gray value) */
+struct Histogram
+{
+    int channels = 0;
+    uint64_t pixels = 0;
+    uint64_t counts[4][256] = {};
+};
+
+/* Histogram Kernel: pixel p of the 4-pixel groups counts into copy p, the leftover pixels into copy 0 */
+template <int Channels>
+void countPixels(uint32_t (*copies)[4][256], const uint8_t *src, size_t begin, size_t end)
+{
+    const size_t groupBytes = Channels * kHistogramCopies;
+    size_t i = begin;
+    for (; i + groupBytes <= end; i += groupBytes)
+    {
+        for (int copy = 0; copy < kHistogramCopies; ++copy)
+        {
+            for (int j = 0; j < Channels; ++j)
+            {
+                ++copies[copy][j][src[i + copy * Channels + j]];
+            }
+        }
+    }
+    for (; i < end; i += Channels)
+    {
+        for (int j = 0; j < Channels; ++j)
+        {
+            ++copies[0][j][src[i + j]];
+        }
+    }
+}
+
+/* Adds the 32-bit copies into a part's histogram and zeroes them for the next chunk */
+void flushCopies(Histogram &part, uint32_t (*copies)[4][256], int channels)
+{
+    for (int copy = 0; copy < kHistogramCopies; ++copy)
+    {
+        for (int j = 0; j < channels; ++j)
+        {
+            for (int v = 0; v < 256; ++v)
+            {
+                part.counts[j][v] += copies[copy][j][v];
+            }
+        }
+    }
+    memset(copies, 0, sizeof(uint32_t) * kHistogramCopies * 4 * 256);
+}
+
+/* Sums the parts into result, one channel position per task */
+void mergeHistograms(Histogram &result, const vector<Histogram> &partial)
+{
+    threadPool().parallelFor(static_cast<size_t>(result.channels), [&](size_t j) {
+        for (const Histogram &counted : partial)
+        {
+            for (int v = 0; v < 256; ++v)
+            {
+                result.counts[j][v] += counted.counts[j][v];
+            }
+        }
+    });
+}
+
+/* Histogram Method */
+Histogram histogram(const TGAImage &image)
+{
+    Histogram result;
+    int channels = image.header.pixelDepth / 8;
+    size_t imageSize = image.data.size();
+    result.channels = channels;
+    result.pixels = imageSize / channels;
+
+    size_t parts = min<size_t>(threadPool().size(), max<size_t>(1, imageSize / kFusedTileBytes));
+    size_t partPixels = (result.pixels + parts - 1) / parts;
+    vector<Histogram> partial(parts);
+    threadPool().parallelFor(parts, [&](size_t part) {
+        size_t begin = min(imageSize, part * partPixels * channels);
+        size_t end = min(imageSize, begin + partPixels * channels);
+        uint32_t copies[kHistogramCopies][4][256] = {};
+        for (size_t chunk = begin; chunk < end; chunk += kHistogramChunkBytes)
+        {
+            size_t chunkEnd = min(end, chunk + kHistogramChunkBytes);
+            dispatchPixelFormat(channels, 0, [&](auto format, auto) {
+                countPixels<decltype(format)::value>(copies, image.data.data(), chunk, chunkEnd);
+            });
+            flushCopies(partial[part], copies, channels);
+        }
+    });
+    mergeHistograms(result, partial);
+    return result;
+}
+
+/* The smallest value with at least fraction of the pixels at or below it; 0 and 1 give the minimum and maximum */
+int histogramPercentile(const Histogram &counts, int position, double fraction)
+{
+    uint64_t target = max<uint64_t>(1, static_cast<uint64_t>(ceil(fraction * static_cast<double>(counts.pixels))));
+    uint64_t seen = 0;
+    for (int v = 0; v < 256; ++v)
+    {
+        seen += counts.counts[position][v];
+        if (seen >= target)
+        {
+            return v;
+        }
+    }
+    return 0;
+}
+
+double histogramMean(const Histogram &counts, int position)
+{
+    uint64_t sum = 0;
+    for (int v = 0; v < 256; ++v)
+    {
+        sum += counts.counts[position][v] * v;
+    }
+    return counts.pixels == 0 ? 0.0 : static_cast<double>(sum) / static_cast<double>(counts.pixels);
+}
+
+/* One line per channel, red first, as the stats op prints them */
+string describeHistogram(const Histogram &counts)
+{
+    static const char *names[] = {"blue", "green", "red", "alpha"};
+    static const int order[] = {2, 1, 0, 3};
+    ostringstream text;
+    text << fixed << setprecision(2);
+    for (int k = 0; k < counts.channels; ++k)
+    {
+        int j = counts.channels == 1 ? 0 : order[k];
+        text << "  " << (counts.channels == 1 ? "gray" : names[j]) << ": min " << histogramPercentile(counts, j, 0.0)
+             << ", max " << histogramPercentile(counts, j, 1.0) << ", mean " << histogramMean(counts, j) << ", median "
+             << histogramPercentile(counts, j, 0.5) << ", 1% " << histogramPercentile(counts, j, 0.01) << ", 99% "
+             << histogramPercentile(counts, j, 0.99) << "\n";
+    }
+    return text.str();
+}
+
+/* Maps [low, high] linearly onto the full range, saturating outside it; a range of one value is left alone */
+void stretchTable(uint8_t *table, int low, int high)
+{
+    for (int v = 0; v < 256; ++v)
+    {
+        int stretched = ((v - low) * 255 + (high - low) / 2) / max(1, high - low);
+        table[v] = static_cast<uint8_t>(high <= low ? v : min(255, max(0, v < low ? 0 : stretched)));
+    }
+}
+
+/*
+ * The table a levels op maps the counted image through. Autolevels stretches each color channel on its own between
+ * the values that clip factor percent of the pixels off either end, which also takes out a color cast; normalize
+ * stretches every color channel by the same amount, from the darkest value of any of them to the brightest, which
+ * keeps the color balance. Alpha is never stretched.
+ */
+ChannelLut levelsLut(const Histogram &counts, bool perChannel, float clip)
+{
+    ChannelLut lut = identityLut();
+    int colors = counts.channels == 4 ? 3 : counts.channels;
+    int low[3];
+    int high[3];
+    for (int j = 0; j < colors; ++j)
+    {
+        low[j] = histogramPercentile(counts, j, clip / 100.0);
+        high[j] = histogramPercentile(counts, j, 1.0 - clip / 100.0);
+    }
+    for (int j = 0; j < colors; ++j)
+    {
+        int tableLow = perChannel ? low[j] : *min_element(low, low + colors);
+        int tableHigh = perChannel ? high[j] : *max_element(high, high + colors);
+        stretchTable(lut.table[j], tableLow, tableHigh);
+    }
+    memcpy(lut.gray, lut.table[0], sizeof(lut.gray));
+    return lut;
+}
+
+/* The header written for an image: raw or RLE true-color/grayscale, with no ID or color map */
+TGAHeader outputHeader(const TGAHeader &imageHeader, bool rle)
+{
+    TGAHeader header = imageHeader;
+    bool grayscale = header.pixelDepth == 8;
+    if (rle)
+    {
+        header.dataTypeCode = static_cast<char>(grayscale ? kRleGrayscale : kRleTrueColor);
+    }
+    else
+    {
+        header.dataTypeCode = static_cast<char>(grayscale ? kGrayscale : kTrueColor);
+    }
+    header.idLength = 0;
+    header.colorMapType = 0;
+    header.colorMapOrigin = 0;
+    header.colorMapLength = 0;
+    header.colorMapDepth = 0;
+    return header;
+}
+
+/*
+ * Pre-sizes the output and writes it through a shared mapping, optionally RLE-compressed. The blocks are reserved up
+ * front, since a mapping can only report a full disk by SIGBUS. The file is written under a temporary name next to
+ * the output and renamed over it once complete, so a failed save leaves the old output in place. Renaming also keeps
+ * the old file intact for anyone still reading it: an input of this chain that is mapped, or a cache entry linked to
+ * it.
+ */
+void saveTGA(const string &filename, const TGAImage &image, bool rle = false)
+{
+    ProfileScope scope("io", "saveTGA " + filename);
+    int channels = image.header.pixelDepth / 8;
+    size_t width = image.header.width;
+    size_t height = image.header.height;
+    size_t rowBytes = width * channels;
+    size_t imageSize = rowBytes * height;
+    const uint8_t *source = image.data.data();
+
+    TGAHeader header = outputHeader(image.header, rle);
+
+    // RLE rows are encoded in parallel bands, then laid out back to back
+    vector<vector<uint8_t>> bands;
+    size_t rowsPerBand = max<size_t>(1, kFusedTileBytes / max<size_t>(1, rowBytes));
+    size_t payloadSize = imageSize;
+    if (rle)
+    {
+        bands.resize((height + rowsPerBand - 1) / rowsPerBand);
+        threadPool().parallelFor(bands.size(), [&](size_t band) {
+            size_t last = min(height, (band + 1) * rowsPerBand);
+            for (size_t y = band * rowsPerBand; y < last; ++y)
+            {
+                encodeRleRow(source + y * rowBytes, width, channels, bands[band]);
+            }
+        });
+        payloadSize = 0;
+        for (const vector<uint8_t> &band : bands)
+        {
+            payloadSize += band.size();
+        }
+    }
+
+    static atomic<unsigned> sequence{0};
+    string partial = filename + ".partial-" + to_string(getpid()) + "-" + to_string(sequence++);
+    int fd = open(partial.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+
+    if (fd < 0)
+    {
+        throw runtime_error("Error: Could not open file: " + filename);
+    }
+
+    size_t fileSize = sizeof(TGAHeader) + payloadSize;
+    if (ftruncate(fd, static_cast<off_t>(fileSize)) != 0 || posix_fallocate(fd, 0, static_cast<off_t>(fileSize)) != 0)
+    {
+        close(fd);
+        unlink(partial.c_str());
+        throw runtime_error("Error: Could not reserve " + to_string(fileSize) + " bytes for file: " + filename);
+    }
+
+    void *address = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+    {
+        unlink(partial.c_str());
+        throw runtime_error("Error: Could not map file: " + filename);
+    }
+
+    uint8_t *bytes = static_cast<uint8_t *>(address);
+    memcpy(bytes, &header, sizeof(TGAHeader));
+    uint8_t *pixels = bytes + sizeof(TGAHeader);
+    if (rle)
+    {
+        for (const vector<uint8_t> &band : bands)
+        {
+            memcpy(pixels, band.data(), band.size());
+            pixels += band.size();
+        }
+    }
+    else
+    {
+        forEachTile(imageSize, 1, [&](size_t begin, size_t end) {
+            memcpy(pixels + begin, source + begin, end - begin);
+        });
+    }
+
+    munmap(address, fileSize);
+    if (rename(partial.c_str(), filename.c_str()) != 0)
+    {
+        unlink(partial.c_str());
+        throw runtime_error("Error: Could not replace file: " + filename);
+    }
+    scope.setBytes(imageSize, fileSize);
+}
+
+/* Operation Graph */
+enum class OpKind
+{
+    Multiply,
+    Screen,
+    Subtract,
+    Addition,
+    Overlay,
+    Combine,
+    Geometric,
+    ExtractChannel,
+    AddToChannel,
+    ScaleChannel,
+    ApplyLut,
+    Fill,
+    Composite,
+    Premultiply,
+    Unpremultiply,
+    BoxBlur,
+    GaussianBlur,
+    Sharpen,
+    DetectEdges,
+    Downscale,
+    Resize,
+    Mipmaps,
+    Crop,
+    Stats,
+    AutoLevels,
+    Normalize
+};
+
+struct Operation
+{
+    OpKind kind;
+    char channel = 0;
+    int amount = 0;
+    float factor = 0.0f;
+    vector<string> files;
+    vector<shared_ptr<const TGAImage>> layers;
+    shared_ptr<const ChannelLut> lut;
+    array<uint8_t, 4> fill{};
+    Transform transform = Transform::Rotate180;
+    CompositeMode composite = CompositeMode::Over;
+    float opacity = 1.0f;
+    int left = 0;
+    int top = 0;
+    int width = 0;
+    int height = 0;
+    ResampleFilter resample = ResampleFilter::Lanczos;
+    string prefix;
+    bool viaOrigin = false;
+    string method;
+    string message;
+};
+
+bool isGeometric(const Operation &op)
+{
+    return op.kind == OpKind::Geometric;
+}
+
+/* Filters read a neighbourhood of each pixel, so they need the whole running image */
+bool isFilter(const Operation &op)
+{
+    return op.kind == OpKind::BoxBlur || op.kind == OpKind::GaussianBlur || op.kind == OpKind::Sharpen ||
+           op.kind == OpKind::DetectEdges;
+}
+
+/* Resampling ops change the image size, or in the case of mipmaps write smaller copies of it; so does a crop */
+bool isResample(const Operation &op)
+{
+    return op.kind == OpKind::Downscale || op.kind == OpKind::Resize || op.kind == OpKind::Mipmaps ||
+           op.kind == OpKind::Crop;
+}
+
+/* Measuring ops need the histogram of the whole running image: stats prints it, the levels ops build a table from it */
+bool isMeasured(const Operation &op)
+{
+    return op.kind == OpKind::Stats || op.kind == OpKind::AutoLevels || op.kind == OpKind::Normalize;
+}
+
+/*
+ * Per-pixel ops can be fused into one pass; geometric ops, filters and resampling act as barriers. So do measuring
+ * ops until the image before them has been counted; a levels op then joins the next pass as its table lookup.
+ */
+bool isPixelwise(const Operation &op)
+{
+    return !isGeometric(op) && !isFilter(op) && !isResample(op) && (!isMeasured(op) || op.lut != nullptr);
+}
+
+/* Method names of the geometric ops and how their progress lines describe them */
+const struct
+{
+    const char *method;
+    Transform transform;
+    const char *verb;
+    const char *how;
+} kGeometricMethods[] = {{"flip", Transform::Rotate180, "flipping", ""},
+                         {"rotate90", Transform::Rotate90, "rotating", " 90 degrees clockwise"},
+                         {"rotate270", Transform::Rotate270, "rotating", " 90 degrees counterclockwise"},
+                         {"mirrorh", Transform::MirrorHorizontal, "mirroring", " horizontally"},
+                         {"mirrorv", Transform::MirrorVertical, "mirroring", " vertically"},
+                         {"transpose", Transform::Transpose, "transposing", ""},
+                         {"transverse", Transform::Transverse, "transversing", ""}};
+
+/* Layer modes of a stack and the ops they become; the Porter-Duff ones composite in premultiplied alpha */
+const struct
+{
+    const char *mode;
+    OpKind kind;
+    CompositeMode composite;
+} kStackModes[] = {{"multiply", OpKind::Multiply, CompositeMode::Over},
+                   {"screen", OpKind::Screen, CompositeMode::Over},
+                   {"subtract", OpKind::Subtract, CompositeMode::Over},
+                   {"addition", OpKind::Addition, CompositeMode::Over},
+                   {"overlay", OpKind::Overlay, CompositeMode::Over},
+                   {"over", OpKind::Composite, CompositeMode::Over},
+                   {"in", OpKind::Composite, CompositeMode::In},
+                   {"out", OpKind::Composite, CompositeMode::Out},
+                   {"atop", OpKind::Composite, CompositeMode::Atop}};
+
+Operation geometricOperation(Transform transform)
+{
+    Operation op;
+    op.kind = OpKind::Geometric;
+    op.transform = transform;
+    for (const auto &geometric : kGeometricMethods)
+    {
+        if (geometric.transform == transform)
+        {
+            op.method = geometric.method;
+        }
+    }
+    return op;
+}
+
+/* Parses the argv chain into a list of operations, printing an error and returning false on bad input */
+bool parseOperations(int argc, char *argv[], int first, const string &firstImageFilename, vector<Operation> &operations,
+                     ostream &log = cout)
+{
+    static const char *channelNames[] = {"red", "green", "blue"};
+    static const char channelCodes[] = {'R', 'G', 'B'};
+
+    bool firstOperation = true;
+    for (int i = first; i < argc; i++) {
+        string method = argv[i];
+        Operation op;
+
+        if (method == "multiply" && i + 1 < argc) {
+            i++;
+            op.kind = OpKind::Multiply;
+            op.files.push_back(argv[i]);
+
+            if (firstOperation) {
+                firstOperation = false;
+                op.message = "Multiplying " + firstImageFilename + " and " + argv[i] + " ...\n";
+            } else {
+                op.message = "... and multiplying " + string(argv[i]) + " with result of previous step  ...\n";
+            }
+        } else if (method == "subtract" && i + 1 < argc) {
+            i++;
+            op.kind = OpKind::Subtract;
+            op.files.push_back(argv[i]);
+
+            if (firstOperation) {
+                firstOperation = false;
+                op.message = "Subtracting " + firstImageFilename + " and " + argv[i] + " ...\n";
+            } else {
+                op.message = " ... and subtracting " + string(argv[i]) + " from previous step ...\n";
+            }
+        } else if (method == "overlay" && i + 1 < argc) {
+            i++;
+            op.kind = OpKind::Overlay;
+            op.files.push_back(argv[i]);
+
+            if (firstOperation) {
+                firstOperation = false;
+                op.message = "Overlaying " + firstImageFilename + " and " + argv[i] + " ...\n";
+            } else {
+                op.message = " ... and overlaying " + string(argv[i]) + " with result of previous step ...\n";
+            }
+        } else if (method == "screen" && i + 1 < argc) {
+            i++;
+            op.kind = OpKind::Screen;
+            op.files.push_back(argv[i]);
+            op.message = "Screen blending " + firstImageFilename + " and " + argv[i] + " ...\n";
+        } else if ((method == "over" || method == "in" || method == "out" || method == "atop" ||
+                    method == "composite") && i + 1 < argc) {
+            string mode = method == "composite" ? argv[++i] : method;
+            auto named = find(begin(kCompositeModeNames), end(kCompositeModeNames), mode);
+            if (named == end(kCompositeModeNames) || i + 1 >= argc) {
+                log << "Error: composite needs a mode (over, in, out, atop, multiply, screen, subtract, addition or "
+                       "overlay) and a layer.\n";
+                return false;
+            }
+            i++;
+            op.kind = OpKind::Composite;
+            op.composite = static_cast<CompositeMode>(named - begin(kCompositeModeNames));
+            op.files.push_back(argv[i]);
+
+            // The blend modes composite source-over; the Porter-Duff operators name how on their own
+            bool porterDuff = op.composite <= CompositeMode::Atop;
+            method = porterDuff ? mode : "composite " + mode;
+            string how = (porterDuff ? mode : "over") + " " + argv[i] + (porterDuff ? "" : " in " + mode + " mode");
+            if (firstOperation) {
+                firstOperation = false;
+                op.message = "Compositing " + firstImageFilename + " " + how + " ...\n";
+            } else {
+                op.message = " ... and compositing previous step " + how + " ...\n";
+            }
+        } else if (method == "stack") {
+            // stack N MODE[:OPACITY] FILE ... becomes N ops in a row, which run as one fused pass
+            char *parsed = nullptr;
+            long count = i + 1 < argc ? strtol(argv[i + 1], &parsed, 10) : 0;
+            if (count < 1 || *parsed != '\0' || count > (argc - i - 2) / 2) {
+                log << "Error: stack needs a layer count and that many [mode][:opacity] [file] pairs.\n";
+                return false;
+            }
+            i++;
+
+            string message;
+            string layers = to_string(count) + (count == 1 ? " layer" : " layers");
+            if (firstOperation) {
+                firstOperation = false;
+                message = "Stacking " + layers + " on " + firstImageFilename + " ...\n";
+            } else {
+                message = " ... and stacking " + layers + " on previous step ...\n";
+            }
+            for (long layer = 0; layer < count; ++layer) {
+                string spec = argv[++i];
+                string mode = spec.substr(0, spec.find(':'));
+                auto named = find_if(begin(kStackModes), end(kStackModes),
+                                     [&](const auto &stackMode) { return mode == stackMode.mode; });
+                float opacity = 1.0f;
+                if (mode.size() < spec.size()) {
+                    const char *text = spec.c_str() + mode.size() + 1;
+                    opacity = strtof(text, &parsed);
+                    if (parsed == text || *parsed != '\0' || !(opacity >= 0.0f && opacity <= 1.0f)) {
+                        named = end(kStackModes);
+                    }
+                }
+                if (named == end(kStackModes)) {
+                    log << "Error: stack layer mode must be multiply, screen, subtract, addition, overlay, over, in, "
+                           "out or atop, with an optional :opacity from 0 to 1: "
+                        << spec << "\n";
+                    return false;
+                }
+
+                Operation layerOp;
+                layerOp.kind = named->kind;
+                layerOp.composite = named->composite;
+                layerOp.opacity = opacity;
+                layerOp.files.push_back(argv[++i]);
+                layerOp.method = mode;
+                layerOp.message = layer == 0 ? message : "";
+                operations.push_back(layerOp);
+            }
+            continue;
+        } else if (method == "blur" || method == "gaussian" || method == "sharpen" || method == "edges") {
+            float value = 0.0f;
+            string how;
+            if (method != "edges") {
+                char *parsed = nullptr;
+                value = i + 1 < argc ? strtof(argv[i + 1], &parsed) : -1.0f;
+                bool valid = method == "blur"       ? value >= 1 && value <= kMaxBlurRadius && value == floor(value)
+                             : method == "gaussian" ? value > 0 && value <= kMaxGaussianSigma
+                                                    : value >= 0 && value <= 16;
+                if (parsed == nullptr || parsed == argv[i + 1] || *parsed != '\0' || !valid) {
+                    log << (method == "blur"       ? "Error: blur needs a radius from 1 to 255.\n"
+                            : method == "gaussian" ? "Error: gaussian needs a sigma above 0 and up to 50.\n"
+                                                   : "Error: sharpen needs an amount from 0 to 16.\n");
+                    return false;
+                }
+                i++;
+            }
+
+            string verb;
+            if (method == "blur") {
+                op.kind = OpKind::BoxBlur;
+                op.amount = static_cast<int>(value);
+                verb = "blurring";
+                how = " with a box of radius " + string(argv[i]);
+            } else if (method == "gaussian") {
+                op.kind = OpKind::GaussianBlur;
+                op.factor = value;
+                verb = "blurring";
+                how = " with a Gaussian of sigma " + string(argv[i]);
+            } else if (method == "sharpen") {
+                op.kind = OpKind::Sharpen;
+                op.factor = value;
+                verb = "sharpening";
+                how = " by " + string(argv[i]);
+            } else {
+                op.kind = OpKind::DetectEdges;
+                verb = "detecting edges in";
+            }
+            if (firstOperation) {
+                firstOperation = false;
+                verb[0] = static_cast<char>(toupper(verb[0]));
+                op.message = verb + " " + firstImageFilename + how + " ...\n";
+            } else {
+                op.message = " ... and " + verb + " previous step" + how + " ...\n";
+            }
+        } else if (method == "downscale") {
+            op.kind = OpKind::Downscale;
+            if (firstOperation) {
+                firstOperation = false;
+                op.message = "Downscaling " + firstImageFilename + " by half ...\n";
+            } else {
+                op.message = " ... and downscaling previous step by half ...\n";
+            }
+        } else if (method == "resize") {
+            char *widthEnd = nullptr;
+            char *heightEnd = nullptr;
+            long width = i + 2 < argc ? strtol(argv[i + 1], &widthEnd, 10) : 0;
+            long height = i + 2 < argc ? strtol(argv[i + 2], &heightEnd, 10) : 0;
+            if (width < 1 || width > 65535 || height < 1 || height > 65535 || *widthEnd != '\0' ||
+                *heightEnd != '\0') {
+                log << "Error: resize needs a width and height from 1 to 65535, then optionally bilinear or "
+                       "lanczos.\n";
+                return false;
+            }
+            i += 2;
+            op.kind = OpKind::Resize;
+            op.width = static_cast<int>(width);
+            op.height = static_cast<int>(height);
+            if (i + 1 < argc && (string(argv[i + 1]) == "bilinear" || string(argv[i + 1]) == "lanczos")) {
+                op.resample = string(argv[++i]) == "bilinear" ? ResampleFilter::Bilinear : ResampleFilter::Lanczos;
+            }
+
+            string how = " to " + to_string(width) + "x" + to_string(height) + " with " +
+                         kResampleFilterNames[static_cast<int>(op.resample)];
+            if (firstOperation) {
+                firstOperation = false;
+                op.message = "Resizing " + firstImageFilename + how + " ...\n";
+            } else {
+                op.message = " ... and resizing previous step" + how + " ...\n";
+            }
+        } else if (method == "crop") {
+            long values[4] = {-1, -1, 0, 0};
+            bool valid = i + 4 < argc;
+            for (int k = 0; valid && k < 4; ++k) {
+                char *parsed = nullptr;
+                values[k] = strtol(argv[i + 1 + k], &parsed, 10);
+                valid = *parsed == '\0' && values[k] >= (k < 2 ? 0 : 1) && values[k] <= (k < 2 ? 65534 : 65535);
+            }
+            if (!valid) {
+                log << "Error: crop needs x and y from the top-left corner, then a width and height of at least 1.\n";
+                return false;
+            }
+            op.kind = OpKind::Crop;
+            op.left = static_cast<int>(values[0]);
+            op.top = static_cast<int>(values[1]);
+            op.width = static_cast<int>(values[2]);
+            op.height = static_cast<int>(values[3]);
+            i += 4;
+
+            string how = " to " + to_string(op.width) + "x" + to_string(op.height) + " at (" + to_string(op.left) +
+                         ", " + to_string(op.top) + ")";
+            if (firstOperation) {
+                firstOperation = false;
+                op.message = "Cropping " + firstImageFilename + how + " ...\n";
+            } else {
+                op.message = " ... and cropping previous step" + how + " ...\n";
+            }
+        } else if (method == "mipmaps") {
+            if (i + 1 >= argc) {
+                log << "Error: mipmaps needs a prefix to name the levels by.\n";
+                return false;
+            }
+            op.kind = OpKind::Mipmaps;
+            op.prefix = argv[++i];
+            string how = " as " + op.prefix + "_<level>.tga";
+            if (firstOperation) {
+                firstOperation = false;
+                op.message = "Writing the mip levels of " + firstImageFilename + how + " ...\n";
+            } else {
+                op.message = " ... and writing the mip levels of previous step" + how + " ...\n";
+            }
+        } else if (method == "stats" || method == "autolevels" || method == "normalize") {
+            string verb;
+            string how;
+            if (method == "stats") {
+                op.kind = OpKind::Stats;
+                verb = "measuring";
+            } else if (method == "autolevels") {
+                op.kind = OpKind::AutoLevels;
+                op.factor = kDefaultLevelsClip;
+                char *parsed = nullptr;
+                float clip = i + 1 < argc ? strtof(argv[i + 1], &parsed) : 0.0f;
+                if (parsed != nullptr && parsed != argv[i + 1] && *parsed == '\0') {
+                    if (!(clip >= 0.0f && clip < 50.0f)) {
+                        log << "Error: autolevels clips a percentage from 0 up to 50 off either end.\n";
+                        return false;
+                    }
+                    op.factor = clip;
+                    i++;
+                }
+                ostringstream percent;
+                percent << op.factor;
+                verb = "auto-leveling";
+                how = ", clipping " + percent.str() + "% off either end";
+            } else {
+                op.kind = OpKind::Normalize;
+                verb = "normalizing";
+            }
+            if (firstOperation) {
+                firstOperation = false;
+                verb[0] = static_cast<char>(toupper(verb[0]));
+                op.message = verb + " " + firstImageFilename + how + " ...\n";
+            } else {
+                op.message = " ... and " + verb + " previous step" + how + " ...\n";
+            }
+        } else if (method == "combine") {
+            if (i + 2 > argc - 1) {
+                log << "Error: Not enough input files for combine operation.\n";
+                return false;
+            }
+
+            string greenImageFilename = argv[i + 1];
+            string blueImageFilename = argv[i + 2];
+            op.kind = OpKind::Combine;
+            op.files.push_back(greenImageFilename);
+            op.files.push_back(blueImageFilename);
+            i += 2;
+
+            if (firstOperation) {
+                firstOperation = false;
+                op.message = "Combining channels from running image, " + greenImageFilename + ", and " +
+                             blueImageFilename + " ...\n";
+            } else {
+                op.message = " ... and combining channels from running image  , " + greenImageFilename + ", and " +
+                             blueImageFilename + " to previous step ...\n";
+            }
+        } else if (any_of(begin(kGeometricMethods), end(kGeometricMethods),
+                          [&](const auto &geometric) { return method == geometric.method; })) {
+            for (const auto &transform : kGeometricMethods) {
+                if (method != transform.method) {
+                    continue;
+                }
+                op.kind = OpKind::Geometric;
+                op.transform = transform.transform;
+                string verb = transform.verb;
+                if (firstOperation) {
+                    firstOperation = false;
+                    verb[0] = static_cast<char>(toupper(verb[0]));
+                    op.message = verb + " " + firstImageFilename + transform.how + " ...\n";
+                } else {
+                    op.message = " ... and " + verb + " output of previous step" + transform.how + " ...\n";
+                }
+            }
+        } else {
+            int c = 0;
+            string prefix;
+            while (c < 3) {
+                string name = channelNames[c];
+                if (method.size() > name.size() && method.compare(method.size() - name.size(), name.size(), name) == 0) {
+                    prefix = method.substr(0, method.size() - name.size());
+                    break;
+                }
+                c++;
+            }
+            if (c == 3 || (prefix != "only" && prefix != "add" && prefix != "scale")) {
+                log << "Invalid method or missing arguments: " << method << endl;
+                return false;
+            }
+
+            string name = channelNames[c];
+            string capitalized = string(1, static_cast<char>(toupper(name[0]))) + name.substr(1);
+            op.channel = channelCodes[c];
+
+            if (prefix == "only") {
+                op.kind = OpKind::ExtractChannel;
+
+                if (firstOperation) {
+                    firstOperation = false;
+                    op.message = "Only " + capitalized + " " + firstImageFilename + " ...\n";
+                } else {
+                    op.message = " ... and getting only " + name + " output of previous step ...\n";
+                }
+            } else if (prefix == "add") {
+                if (i + 1 >= argc) {
+                    log << "Error: Missing amount to add to the " << name << " channel.\n";
+                    return false;
+                }
+                char *parsed = nullptr;
+                long amount = strtol(argv[i + 1], &parsed, 10);
+                if (parsed == argv[i + 1] || *parsed != '\0' || amount < INT_MIN || amount > INT_MAX) {
+                    log << "Error: The amount to add to the " << name << " channel must be a whole number.\n";
+                    return false;
+                }
+                op.kind = OpKind::AddToChannel;
+                op.amount = static_cast<int>(amount);
+                i++;
+
+                if (firstOperation) {
+                    firstOperation = false;
+                    op.message = "Adding " + to_string(op.amount) + " to the " + name + " channel of " +
+                                 firstImageFilename + " ...\n";
+                } else {
+                    op.message = " ... and adding " + to_string(op.amount) + " to the " + name +
+                                 " channel of previous step ...\n";
+                }
+            } else {
+                if (i + 1 >= argc) {
+                    log << "Error: Missing amount to scale to the " << name << " channel.\n";
+                    return false;
+                }
+                char *parsed = nullptr;
+                op.factor = strtof(argv[i + 1], &parsed);
+                if (parsed == argv[i + 1] || *parsed != '\0') {
+                    log << "Error: The amount to scale the " << name << " channel by must be a number.\n";
+                    return false;
+                }
+                op.kind = OpKind::ScaleChannel;
+                i++;
+
+                ostringstream amount;
+                amount << op.factor;
+                if (firstOperation) {
+                    firstOperation = false;
+                    op.message = "Scaling " + amount.str() + " to the " + name + " channel of " +
+                                 firstImageFilename + " ...\n";
+                } else {
+                    op.message = " ... and scaling " + amount.str() + " to the " + name +
+                                 " channel of previous step ...\n";
+                }
+            }
+        }
+
+        op.method = method;
+        operations.push_back(op);
+    }
+
+    return true;
+}
+
+bool isPointOp(const Operation &op)
+{
+    return op.kind == OpKind::AddToChannel || op.kind == OpKind::ScaleChannel || op.kind == OpKind::ExtractChannel ||
+           op.kind == OpKind::ApplyLut;
+}
+
+/* Composes a point op onto the end of a table by running its own kernel over every entry */
+void composePointOp(ChannelLut &lut, const Operation &op)
+{
+    for (int v = 0; v < 256; ++v)
+    {
+        uint8_t pixel[4] = {lut.table[0][v], lut.table[1][v], lut.table[2][v], lut.table[3][v]};
+        switch (op.kind)
+        {
+        case OpKind::AddToChannel:
+            addToChannelPixels(pixel, pixel, 0, 4, 4, op.channel, op.amount);
+            break;
+        case OpKind::ScaleChannel:
+            scaleChannelPixels(pixel, pixel, 0, 4, 4, op.channel, op.factor);
+            break;
+        case OpKind::ExtractChannel:
+            extractChannelPixels(pixel, pixel, 0, 4, 4, op.channel);
+            break;
+        case OpKind::ApplyLut:
+            for (int j = 0; j < 4; ++j)
+            {
+                pixel[j] = op.lut->table[j][pixel[j]];
+            }
+            break;
+        default:
+            throw logic_error("Operation is not a point op");
+        }
+        for (int j = 0; j < 4; ++j)
+        {
+            lut.table[j][v] = pixel[j];
+        }
+    }
+
+    for (int v = 0; v < 256; ++v)
+    {
+        uint8_t &value = lut.gray[v];
+        switch (op.kind)
+        {
+        case OpKind::AddToChannel:
+            addToChannelPixels(&value, &value, 0, 1, 1, op.channel, op.amount);
+            break;
+        case OpKind::ScaleChannel:
+            scaleChannelPixels(&value, &value, 0, 1, 1, op.channel, op.factor);
+            break;
+        case OpKind::ExtractChannel:
+            extractChannelPixels(&value, &value, 0, 1, 1, op.channel);
+            break;
+        default:
+            value = op.lut->gray[value];
+            break;
+        }
+    }
+}
+
+/* The op as it would be written in a chain, for plans and profiles */
+string describeOperation(const Operation &op)
+{
+    ostringstream text;
+    text << op.method;
+    if (op.opacity < 1.0f)
+    {
+        text << ":" << op.opacity;
+    }
+    for (const string &filename : op.files)
+    {
+        text << " " << filename;
+    }
+    if (op.kind == OpKind::AddToChannel || op.kind == OpKind::BoxBlur)
+    {
+        text << " " << op.amount;
+    }
+    else if (op.kind == OpKind::ScaleChannel || op.kind == OpKind::GaussianBlur || op.kind == OpKind::Sharpen ||
+             op.kind == OpKind::AutoLevels)
+    {
+        text << " " << op.factor;
+    }
+    else if (op.kind == OpKind::Resize)
+    {
+        text << " " << op.width << " " << op.height << " " << kResampleFilterNames[static_cast<int>(op.resample)];
+    }
+    else if (op.kind == OpKind::Mipmaps)
+    {
+        text << " " << op.prefix;
+    }
+    else if (op.kind == OpKind::Crop)
+    {
+        text << " " << op.left << " " << op.top << " " << op.width << " " << op.height;
+    }
+    else if (op.kind == OpKind::Fill)
+    {
+        text << " (" << static_cast<int>(op.fill[0]) << ", " << static_cast<int>(op.fill[1]) << ", "
+             << static_cast<int>(op.fill[2]) << ", " << static_cast<int>(op.fill[3]) << ")";
+    }
+    return text.str();
+}
+
+/* Replaces every run of consecutive point ops with a single table lookup op */
+void compilePointOps(vector<Operation> &operations)
+{
+    vector<Operation> compiled;
+    for (size_t i = 0; i < operations.size();)
+    {
+        if (!isPointOp(operations[i]))
+        {
+            compiled.push_back(move(operations[i++]));
+            continue;
+        }
+
+        auto lut = make_shared<ChannelLut>(identityLut());
+        Operation merged;
+        merged.kind = OpKind::ApplyLut;
+        for (; i < operations.size() && isPointOp(operations[i]); ++i)
+        {
+            composePointOp(*lut, operations[i]);
+            merged.method += (merged.method.empty() ? "lut(" : ", ") + describeOperation(operations[i]);
+            merged.message += operations[i].message;
+        }
+        merged.method += ")";
+        merged.lut = lut;
+        compiled.push_back(move(merged));
+    }
+    operations = move(compiled);
+}
+
+/*
+ * Chain Optimizer
+ *
+ * Rewrites a parsed chain into a cheaper one with the same output. Channel-local ops (add, scale, extract, fill)
+ * change each pixel where it stands, so they commute with geometric ops and are moved ahead of them, and with crops,
+ * which are moved ahead of them instead. Measuring ops only count pixels, so they move ahead of geometric ops too.
+ * Adjacent geometric ops then compose into at most one. Among channel-local ops, extractions and no-ops are folded
+ * away, ops whose channel a later extraction zeroes are dropped, same-direction adds merge, and anything before a
+ * constant fill is dead. Grayscale images have one value that every channel op acts on, so the rules need the
+ * pixel size. Progress lines describe the chain as written and are handed out to whatever ops remain.
+ */
+bool isChannelLocal(const Operation &op)
+{
+    return isPointOp(op) || op.kind == OpKind::Fill;
+}
+
+/* Composes first then second into one transform, found by running both on a small labelled grid */
+bool composeTransforms(Transform first, Transform second, Transform &composed)
+{
+    // A top-left origin makes storage match the screen
+    TGAHeader header;
+    memset(&header, 0, sizeof(TGAHeader));
+    header.imageDescriptor = 0x20;
+
+    const uint8_t grid[6] = {0, 1, 2, 3, 4, 5};
+    uint8_t once[6];
+    uint8_t twice[6];
+    Orientation a = storageOrientation(first, header);
+    Orientation b = storageOrientation(second, header);
+    orientPixels(once, grid, 3, 2, 1, a);
+    orientPixels(twice, once, a.swapAxes ? 2 : 3, a.swapAxes ? 3 : 2, 1, b);
+    bool swapped = a.swapAxes != b.swapAxes;
+    if (!swapped && memcmp(twice, grid, sizeof(grid)) == 0)
+    {
+        return false;
+    }
+
+    for (const auto &geometric : kGeometricMethods)
+    {
+        uint8_t candidate[6];
+        Orientation c = storageOrientation(geometric.transform, header);
+        orientPixels(candidate, grid, 3, 2, 1, c);
+        if (c.swapAxes == swapped && memcmp(candidate, twice, sizeof(twice)) == 0)
+        {
+            composed = geometric.transform;
+            return true;
+        }
+    }
+    throw logic_error("Transforms do not compose");
+}
+
+/* Applies a channel-local op to a fill value */
+void foldIntoFill(Operation &fill, const Operation &op, int channels)
+{
+    uint8_t *value = fill.fill.data();
+    switch (op.kind)
+    {
+    case OpKind::AddToChannel:
+        addToChannelPixels(value, value, 0, channels, channels, op.channel, op.amount);
+        break;
+    case OpKind::ScaleChannel:
+        scaleChannelPixels(value, value, 0, channels, channels, op.channel, op.factor);
+        break;
+    case OpKind::ExtractChannel:
+        extractChannelPixels(value, value, 0, channels, channels, op.channel);
+        break;
+    default:
+        for (int j = 0; j < channels; ++j)
+        {
+            value[j] = op.lut->tablesFor(channels)[j][value[j]];
+        }
+        break;
+    }
+}
+
+/* One rewrite of ops k and k + 1; returns false when no rule applies */
+bool rewritePair(vector<Operation> &operations, size_t k, int channels)
+{
+    Operation &a = operations[k];
+    Operation &b = operations[k + 1];
+    auto erase = [&](size_t index) { operations.erase(operations.begin() + index); };
+
+    // A crop moves ahead of channel-local ops, so they run on fewer pixels and a leading crop can read less
+    if (isChannelLocal(a) && b.kind == OpKind::Crop)
+    {
+        swap(a, b);
+        return true;
+    }
+
+    // Point ops move ahead of geometric ones, and so do measuring ops, since moving pixels leaves the histogram as it
+    // is; geometric runs compose
+    if (isGeometric(a) && (isChannelLocal(b) || isMeasured(b)))
+    {
+        swap(a, b);
+        return true;
+    }
+    if (isGeometric(a) && isGeometric(b))
+    {
+        Transform composed;
+        if (composeTransforms(a.transform, b.transform, composed))
+        {
+            a = geometricOperation(composed);
+            erase(k + 1);
+        }
+        else
+        {
+            operations.erase(operations.begin() + k, operations.begin() + k + 2);
+        }
+        return true;
+    }
+
+    // Nothing survives a fill, and later point ops only change its value
+    if (b.kind == OpKind::Fill && isPixelwise(a))
+    {
+        erase(k);
+        return true;
+    }
+    if (a.kind == OpKind::Fill && isPointOp(b))
+    {
+        foldIntoFill(a, b, channels);
+        erase(k + 1);
+        return true;
+    }
+
+    bool sameChannel = channelOffset(a.channel, channels) == channelOffset(b.channel, channels);
+    if (a.kind == OpKind::ExtractChannel && b.kind == OpKind::ExtractChannel)
+    {
+        if (sameChannel)
+        {
+            erase(k + 1);
+        }
+        else
+        {
+            Operation fill;
+            fill.kind = OpKind::Fill;
+            fill.method = "fill";
+            a = fill;
+            erase(k + 1);
+        }
+        return true;
+    }
+    if ((a.kind == OpKind::AddToChannel || a.kind == OpKind::ScaleChannel) && b.kind == OpKind::ExtractChannel)
+    {
+        // An extraction keeps its own channel as it is, so it can go first and meet any earlier ops it makes dead
+        if (sameChannel)
+        {
+            swap(a, b);
+        }
+        else
+        {
+            erase(k);
+        }
+        return true;
+    }
+    if (a.kind == OpKind::AddToChannel && b.kind == OpKind::AddToChannel && sameChannel &&
+        (a.amount >= 0) == (b.amount >= 0))
+    {
+        // Clamping at the same end either way, so the two adds equal one; past 255 either way every value clamps
+        a.amount = static_cast<int>(clamp<int64_t>(int64_t(a.amount) + b.amount, -255, 255));
+        erase(k + 1);
+        return true;
+    }
+
+    // Adds and scales on different channels commute; sorting by channel brings same-channel ones together
+    bool adjustable = (a.kind == OpKind::AddToChannel || a.kind == OpKind::ScaleChannel) &&
+                      (b.kind == OpKind::AddToChannel || b.kind == OpKind::ScaleChannel);
+    if (adjustable && channelOffset(b.channel, channels) < channelOffset(a.channel, channels))
+    {
+        swap(a, b);
+        return true;
+    }
+    return false;
+}
+
+/* Optimizes the chain for images with the given pixel size; returns the progress lines no op is left to print */
+string optimizeOperations(vector<Operation> &operations, int channels)
+{
+    vector<string> messages;
+    for (Operation &op : operations)
+    {
+        messages.push_back(move(op.message));
+        op.message.clear();
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+        for (size_t k = 0; k < operations.size(); ++k)
+        {
+            const Operation &op = operations[k];
+            bool noOp = (op.kind == OpKind::AddToChannel && op.amount == 0) ||
+                        (op.kind == OpKind::ScaleChannel && op.factor == 1.0f) ||
+                        (op.kind == OpKind::ExtractChannel && channels == 1);
+            if (noOp)
+            {
+                operations.erase(operations.begin() + k);
+                changed = true;
+                break;
+            }
+            if (k + 1 < operations.size() && rewritePair(operations, k, channels))
+            {
+                changed = true;
+                break;
+            }
+        }
+    }
+
+    // Every remaining op prints one line in order, and the last one prints whatever is left
+    string leftover;
+    for (size_t i = 0; i < messages.size(); ++i)
+    {
+        if (i < operations.size())
+        {
+            operations[i].message = messages[i];
+        }
+        else if (!operations.empty())
+        {
+            operations.back().message += messages[i];
+        }
+        else
+        {
+            leftover += messages[i];
+        }
+    }
+    return leftover;
+}
+
+/* Prints the optimized chain as the passes it will run in */
+void explainOperations(const vector<Operation> &operations, size_t parsedCount, ostream &log)
+{
+    // The alpha conversions bracketing compositing runs are planned, not written, so they are not counted
+    size_t conversions = count_if(operations.begin(), operations.end(), [](const Operation &op) {
+        return op.kind == OpKind::Premultiply || op.kind == OpKind::Unpremultiply;
+    });
+    log << "Plan: " << parsedCount << " ops as written, " << operations.size() - conversions << " after optimizing\n";
+    int pass = 0;
+    for (size_t i = 0; i < operations.size();)
+    {
+        if (isGeometric(operations[i]) && operations[i].viaOrigin)
+        {
+            log << "  origin bits: " << describeOperation(operations[i]) << "\n";
+            ++i;
+            continue;
+        }
+        if (isMeasured(operations[i]))
+        {
+            log << "  pass " << ++pass << ": histogram for " << describeOperation(operations[i]) << "\n";
+            if (operations[i].kind == OpKind::Stats)
+            {
+                ++i;
+                continue;
+            }
+        }
+        log << "  pass " << ++pass << ": " << describeOperation(operations[i]);
+        if (isPixelwise(operations[i]) || isMeasured(operations[i]))
+        {
+            for (++i; i < operations.size() && isPixelwise(operations[i]); ++i)
+            {
+                log << " + " << describeOperation(operations[i]);
+            }
+        }
+        else
+        {
+            ++i;
+        }
+        log << "\n";
+    }
+    if (pass == 0)
+    {
+        log << "  (no passes; the input is saved as it is)\n";
+    }
+}
+
+/*
+ * Lets trailing flips and mirrors change the TGA origin bits instead of moving pixels, for readers that honor them.
+ * Only ops after the last one that reads another image qualify, since a layer still has to line up pixel for pixel
+ * with the running image, and after the last resampling op, which drops odd edges and so does not commute with a
+ * mirror. Later rotations read the new bits, so they still turn the image as shown.
+ */
+void useOriginBits(vector<Operation> &operations)
+{
+    for (size_t k = operations.size(); k-- > 0 && operations[k].files.empty() && !isResample(operations[k]);)
+    {
+        Transform transform = operations[k].transform;
+        operations[k].viaOrigin = isGeometric(operations[k]) &&
+                                  (transform == Transform::Rotate180 || transform == Transform::MirrorHorizontal ||
+                                   transform == Transform::MirrorVertical);
+    }
+}
+
+/*
+ * Brackets every run of compositing ops with the conversions to and from premultiplied alpha. Geometric ops do not
+ * care which form the pixels are in, so a run only ends at an op that needs straight colors, or at the end.
+ */
+void insertAlphaConversions(vector<Operation> &operations)
+{
+    auto conversion = [](OpKind kind) {
+        Operation op;
+        op.kind = kind;
+        op.method = kind == OpKind::Premultiply ? "premultiply" : "unpremultiply";
+        return op;
+    };
+    size_t k = 0;
+    while (k < operations.size())
+    {
+        if (operations[k].kind != OpKind::Composite)
+        {
+            ++k;
+            continue;
+        }
+        size_t last = k;
+        for (size_t j = k + 1;
+             j < operations.size() && (isGeometric(operations[j]) || operations[j].kind == OpKind::Composite); ++j)
+        {
+            last = operations[j].kind == OpKind::Composite ? j : last;
+        }
+        operations.insert(operations.begin() + static_cast<ptrdiff_t>(last + 1), conversion(OpKind::Unpremultiply));
+        operations.insert(operations.begin() + static_cast<ptrdiff_t>(k), conversion(OpKind::Premultiply));
+        k = last + 3;
+    }
+}
+
+/* Turns a parsed chain into the one that runs; returns the progress lines left over from dropped ops */
+string planOperations(vector<Operation> &operations, int channels, bool optimize, bool originBits)
+{
+    string leftover = optimize ? optimizeOperations(operations, channels) : "";
+    compilePointOps(operations);
+    insertAlphaConversions(operations);
+    if (originBits)
+    {
+        useOriginBits(operations);
+    }
+    return leftover;
+}
+
+/* Runs the kernel of a single per-pixel op at full strength */
+void applyKernel(const Operation &op, uint8_t *pixels, const uint8_t *source, const uint8_t *const *layers,
+                 size_t begin, size_t end, int channels)
+{
+    switch (op.kind)
+    {
+    case OpKind::Multiply:
+        blendKernels().multiply(pixels, source, layers[0], begin, end, channels);
+        break;
+    case OpKind::Screen:
+        blendKernels().screen(pixels, source, layers[0], begin, end, channels);
+        break;
+    case OpKind::Subtract:
+        blendKernels().subtract(pixels, source, layers[0], begin, end, channels);
+        break;
+    case OpKind::Addition:
+        blendKernels().addition(pixels, source, layers[0], begin, end, channels);
+        break;
+    case OpKind::Overlay:
+        blendKernels().overlay(pixels, source, layers[0], begin, end, channels);
+        break;
+    case OpKind::Combine:
+        combineChannelsPixels(pixels, source, layers[0], layers[1], begin, end, channels);
+        break;
+    case OpKind::ExtractChannel:
+        extractChannelPixels(pixels, source, begin, end, channels, op.channel);
+        break;
+    case OpKind::AddToChannel:
+        addToChannelPixels(pixels, source, begin, end, channels, op.channel, op.amount);
+        break;
+    case OpKind::ScaleChannel:
+        scaleChannelPixels(pixels, source, begin, end, channels, op.channel, op.factor);
+        break;
+    case OpKind::ApplyLut:
+    case OpKind::AutoLevels:
+    case OpKind::Normalize:
+        lutKernel()(pixels, source, begin, end, channels, *op.lut);
+        break;
+    case OpKind::Fill:
+        fillPixels(pixels, begin, end, channels, op.fill);
+        break;
+    case OpKind::Composite:
+        compositeKernels().modes[static_cast<int>(op.composite)](pixels, source, layers[0], begin, end);
+        break;
+    case OpKind::Premultiply:
+        compositeKernels().premultiply(pixels, source, begin, end);
+        break;
+    case OpKind::Unpremultiply:
+        compositeKernels().unpremultiply(pixels, source, begin, end);
+        break;
+    default:
+        throw logic_error("Operation is not per-pixel");
+    }
+}
+
+/* Mixes blended bytes into source by weight / 256, rounding to nearest */
+void mixPixels(uint8_t *pixels, const uint8_t *source, const uint8_t *blended, size_t count, int weight)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        pixels[i] = static_cast<uint8_t>((source[i] * (256 - weight) + blended[i] * weight + 128) >> 8);
+    }
+}
+
+/*
+ * Applies a single per-pixel op to the byte range [begin, end), reading the running image from source and the op's
+ * input images from layers. All pointers share the same indexing, so they can address whole images or single rows.
+ * A stack layer with partial opacity blends the range into a per-thread scratch tile first and mixes that back in.
+ */
+void applyPixelwise(const Operation &op, uint8_t *pixels, const uint8_t *source, const uint8_t *const *layers,
+                    size_t begin, size_t end, int channels)
+{
+    int weight = static_cast<int>(op.opacity * 256.0f + 0.5f);
+    if (weight >= 256)
+    {
+        applyKernel(op, pixels, source, layers, begin, end, channels);
+        return;
+    }
+
+    thread_local vector<uint8_t> blended;
+    blended.resize(end - begin);
+    const uint8_t *shifted[2] = {nullptr, nullptr};
+    for (size_t j = 0; j < op.files.size(); ++j)
+    {
+        shifted[j] = layers[j] + begin;
+    }
+    applyKernel(op, blended.data(), source + begin, shifted, 0, end - begin, channels);
+    mixPixels(pixels + begin, source + begin, blended.data(), end - begin, weight);
+}
+
+/* Runs ops [first, last) as one tiled pass over the running image */
+void executeFusedRun(TGAImage &image, const vector<Operation> &operations, size_t first, size_t last)
+{
+    vector<array<const uint8_t *, 2>> layers(last - first, {nullptr, nullptr});
+    for (size_t k = first; k < last; ++k)
+    {
+        for (size_t j = 0; j < operations[k].layers.size(); ++j)
+        {
+            layers[k - first][j] = operations[k].layers[j]->data.data();
+        }
+    }
+
+    transformInPlace(image, [&](uint8_t *dst, const uint8_t *src, size_t begin, size_t end, int channels) {
+        const uint8_t *input = src;
+        for (size_t k = first; k < last; ++k)
+        {
+            applyPixelwise(operations[k], dst, input, layers[k - first].data(), begin, end, channels);
+            input = dst;
+        }
+    });
+}
+
+/* Runs a filter op over the whole running image */
+void applyFilter(TGAImage &image, const Operation &op)
+{
+    switch (op.kind)
+    {
+    case OpKind::BoxBlur:
+        image = boxBlur(image, op.amount);
+        break;
+    case OpKind::GaussianBlur:
+        image = gaussianBlur(image, op.factor);
+        break;
+    case OpKind::Sharpen:
+        image = sharpen(image, op.factor);
+        break;
+    case OpKind::DetectEdges:
+        image = detectEdges(image);
+        break;
+    default:
+        throw logic_error("Operation is not a filter");
+    }
+}
+
+/* Runs a resampling op over the whole running image */
+void applyResample(TGAImage &image, const Operation &op)
+{
+    switch (op.kind)
+    {
+    case OpKind::Downscale:
+        image = downscale(image);
+        break;
+    case OpKind::Resize:
+        image = resizeImage(image, op.width, op.height, op.resample);
+        break;
+    case OpKind::Mipmaps: {
+        vector<TGAImage> levels = mipLevels(image);
+        for (size_t k = 0; k < levels.size(); ++k)
+        {
+            saveTGA(op.prefix + "_" + to_string(k + 1) + ".tga", levels[k]);
+        }
+        break;
+    }
+    case OpKind::Crop:
+        image = cropImage(image, storageRegion(image.header, op.left, op.top, op.width, op.height));
+        break;
+    default:
+        throw logic_error("Operation is not a resampling op");
+    }
+}
+
+/* Throws if op cannot run on pixels of this size */
+void checkPixelFormat(const Operation &op, int channels)
+{
+    if (op.kind == OpKind::Combine && channels < 3)
+    {
+        throw runtime_error("combine needs 24 or 32-bit color images");
+    }
+    if (op.kind == OpKind::Composite && channels != 4)
+    {
+        throw runtime_error(op.method + " needs 32-bit images with alpha");
+    }
+}
+
+void checkLayer(const TGAImage &layer, const string &filename, const TGAImage &reference)
+{
+    if (layer.header.width != reference.header.width || layer.header.height != reference.header.height ||
+        layer.header.pixelDepth != reference.header.pixelDepth)
+    {
+        throw runtime_error("Image dimensions do not match the running image: " + filename);
+    }
+}
+
+/*
+ * Attaches the layers that ops [first, last) do not have yet. A stack can name dozens of files, so they are opened
+ * (and RLE ones decoded) all at once on the pool; a file named twice loads once. Uncompressed layers stay mapped
+ * and are not faulted in here: the fused pass reads each one tile by tile, and sequential readahead on the mapping
+ * brings its pages in just ahead of the tiles, so no layer has to be resident as a whole.
+ */
+void loadLayers(vector<Operation> &operations, size_t first, size_t last)
+{
+    vector<string> filenames;
+    for (size_t k = first; k < last; ++k)
+    {
+        for (size_t j = operations[k].layers.size(); j < operations[k].files.size(); ++j)
+        {
+            if (find(filenames.begin(), filenames.end(), operations[k].files[j]) == filenames.end())
+            {
+                filenames.push_back(operations[k].files[j]);
+            }
+        }
+    }
+
+    vector<shared_ptr<const TGAImage>> loaded(filenames.size());
+    threadPool().parallelFor(filenames.size(), [&](size_t n) {
+        loaded[n] = make_shared<const TGAImage>(loadTGA(filenames[n]));
+    });
+
+    for (size_t k = first; k < last; ++k)
+    {
+        Operation &op = operations[k];
+        for (size_t j = op.layers.size(); j < op.files.size(); ++j)
+        {
+            op.layers.push_back(loaded[find(filenames.begin(), filenames.end(), op.files[j]) - filenames.begin()]);
+        }
+    }
+}
+
+/*
+ * Executes the operation graph, fusing each run of per-pixel ops into a single pass. Layers that are already attached
+ * to an op (batch mode loads them ahead of time) are used as they are; the rest are loaded here.
+ */
+void executeOperations(TGAImage &image, vector<Operation> &operations, ostream &log = cout)
+{
+    size_t i = 0;
+    while (i < operations.size())
+    {
+        if (isMeasured(operations[i]) && operations[i].lut == nullptr)
+        {
+            Operation &op = operations[i];
+            Histogram counts;
+            {
+                ProfileScope scope("stats", describeOperation(op), image.data.size());
+                counts = histogram(image);
+            }
+            if (op.kind == OpKind::Stats)
+            {
+                log << op.message << describeHistogram(counts);
+                ++i;
+                continue;
+            }
+            // The table leads the next fused run, so the levels cost one pass together with the per-pixel ops after it
+            op.lut = make_shared<const ChannelLut>(levelsLut(counts, op.kind == OpKind::AutoLevels, op.factor));
+        }
+        if (isFilter(operations[i]))
+        {
+            ProfileScope scope("filter", describeOperation(operations[i]), image.data.size(), image.data.size());
+            applyFilter(image, operations[i]);
+            log << operations[i].message;
+            ++i;
+            continue;
+        }
+        if (isResample(operations[i]))
+        {
+            ProfileScope scope("resample", describeOperation(operations[i]), image.data.size());
+            applyResample(image, operations[i]);
+            log << operations[i].message;
+            ++i;
+            continue;
+        }
+        if (!isPixelwise(operations[i]))
+        {
+            size_t imageBytes = image.data.size();
+            size_t bytesMoved = operations[i].viaOrigin ? 0 : imageBytes;
+            ProfileScope scope("geometric", operations[i].method, bytesMoved, bytesMoved);
+            if (operations[i].viaOrigin)
+            {
+                flipOrigin(image.header, operations[i].transform);
+            }
+            else
+            {
+                geometricTransformInPlace(image, operations[i].transform);
+            }
+            log << operations[i].message;
+            ++i;
+            continue;
+        }
+
+        size_t last = i;
+        while (last < operations.size() && isPixelwise(operations[last]))
+        {
+            checkPixelFormat(operations[last], image.header.pixelDepth / 8);
+            ++last;
+        }
+        loadLayers(operations, i, last);
+        for (size_t k = i; k < last; ++k)
+        {
+            for (size_t j = 0; j < operations[k].files.size(); ++j)
+            {
+                checkLayer(*operations[k].layers[j], operations[k].files[j], image);
+            }
+        }
+
+        {
+            string name;
+            size_t bytesRead = image.data.size();
+            for (size_t k = i; k < last; ++k)
+            {
+                name += (k == i ? "" : " + ") + operations[k].method;
+                bytesRead += operations[k].layers.size() * image.data.size();
+            }
+            ProfileScope scope("pixelwise", name, bytesRead, image.data.size());
+            executeFusedRun(image, operations, i, last);
+        }
+
+        for (size_t k = i; k < last; ++k)
+        {
+            log << operations[k].message;
+            operations[k].layers.clear();
+            if (isMeasured(operations[k]))
+            {
+                operations[k].lut.reset();
+            }
+        }
+        i = last;
+    }
+}
+
+/*
+ * Streaming Mode
+ *
+ * Pushes the chain through a bounded window of scanlines, so an image never has to be fully resident. Every input
+ * is read with pread one window at a time. Inputs that sit behind an odd number of flips or vertical mirrors are
+ * read bottom-up, and flips and horizontal mirrors reverse each row where they occur, so neither needs a full-image
+ * buffer. Rotating by 90 degrees and transposing do, and are not supported here.
+ */
+const size_t kStreamWindowBytes = 8 * 1024 * 1024;
+
+class ScanlineReader
+{
+public:
+    explicit ScanlineReader(const string &filename) : filename(filename)
+    {
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw runtime_error("Failed to open the TGA file: " + filename);
+        }
+        if (pread(fd, &fileHeader, sizeof(TGAHeader), 0) != static_cast<ssize_t>(sizeof(TGAHeader)))
+        {
+            close(fd);
+            throw runtime_error("Failed to read the TGA header: " + filename);
+        }
+
+        int type = static_cast<uint8_t>(fileHeader.dataTypeCode);
+        int depth = static_cast<uint8_t>(fileHeader.pixelDepth);
+        if (!((type == kTrueColor && (depth == 24 || depth == 32)) || (type == kGrayscale && depth == 8)))
+        {
+            close(fd);
+            throw runtime_error("Streaming mode needs uncompressed 8/24/32-bit images: " + filename);
+        }
+        offset = pixelDataOffset(fileHeader);
+        rowBytes = static_cast<size_t>(fileHeader.width) * (depth / 8);
+    }
+
+    ~ScanlineReader() { close(fd); }
+
+    ScanlineReader(const ScanlineReader &) = delete;
+    ScanlineReader &operator=(const ScanlineReader &) = delete;
+
+    const TGAHeader &header() const { return fileHeader; }
+
+    /* Reads rows [first, first + count) back to back; the pointer stays valid until the next call */
+    const uint8_t *rows(size_t first, size_t count)
+    {
+        size_t bytes = count * rowBytes;
+        window.resize(bytes);
+        off_t position = static_cast<off_t>(offset + first * rowBytes);
+        size_t done = 0;
+        while (done < bytes)
+        {
+            ssize_t n = pread(fd, window.data() + done, bytes - done, position + static_cast<off_t>(done));
+            if (n <= 0)
+            {
+                throw runtime_error("Truncated TGA file: " + filename);
+            }
+            done += static_cast<size_t>(n);
+        }
+        return window.data();
+    }
+
+private:
+    string filename;
+    int fd = -1;
+    TGAHeader fileHeader;
+    size_t offset = 0;
+    size_t rowBytes = 0;
+    vector<uint8_t> window;
+};
+
+void writeAll(int fd, const uint8_t *bytes, size_t size, const string &filename)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(fd, bytes, size);
+        if (n <= 0)
+        {
+            throw runtime_error("Error: Could not write file: " + filename);
+        }
+        bytes += n;
+        size -= static_cast<size_t>(n);
+    }
+}
+
+/* Runs the whole chain row window by row window, from the input files straight to the output file */
+void streamOperations(const string &outputFilename, const string &firstImageFilename,
+                      const vector<Operation> &operations, bool rle)
+{
+    ProfileScope scope("stream", "stream " + outputFilename);
+    ScanlineReader first(firstImageFilename);
+    const TGAHeader &inputHeader = first.header();
+    int channels = static_cast<uint8_t>(inputHeader.pixelDepth) / 8;
+    size_t width = inputHeader.width;
+    size_t height = inputHeader.height;
+    size_t rowBytes = width * channels;
+
+    // An op's inputs are read bottom-up when an odd number of vertical flips follows it
+    vector<bool> reversed(operations.size());
+    int flipsAfter = 0;
+    for (size_t k = operations.size(); k-- > 0;)
+    {
+        const Operation &op = operations[k];
+        reversed[k] = flipsAfter % 2 == 1;
+        if (isFilter(op))
+        {
+            throw runtime_error("Streaming mode cannot filter; run without --stream");
+        }
+        if (isResample(op))
+        {
+            throw runtime_error("Streaming mode cannot resize or crop; run without --stream");
+        }
+        if (isMeasured(op))
+        {
+            throw runtime_error("Streaming mode cannot measure the image for stats or levels; run without --stream");
+        }
+        if (isGeometric(op) && !op.viaOrigin && storageOrientation(op.transform, inputHeader).swapAxes)
+        {
+            throw runtime_error("Streaming mode cannot rotate by 90 degrees or transpose; run without --stream");
+        }
+        if (isGeometric(op) && !op.viaOrigin && storageOrientation(op.transform, inputHeader).reverseY)
+        {
+            flipsAfter++;
+        }
+    }
+    bool firstReversed = flipsAfter % 2 == 1;
+
+    vector<vector<unique_ptr<ScanlineReader>>> readers(operations.size());
+    for (size_t k = 0; k < operations.size(); ++k)
+    {
+        checkPixelFormat(operations[k], channels);
+        for (const string &filename : operations[k].files)
+        {
+            readers[k].push_back(unique_ptr<ScanlineReader>(new ScanlineReader(filename)));
+            const TGAHeader &layerHeader = readers[k].back()->header();
+            if (layerHeader.width != inputHeader.width || layerHeader.height != inputHeader.height ||
+                layerHeader.pixelDepth != inputHeader.pixelDepth)
+            {
+                throw runtime_error("Image dimensions do not match the running image: " + filename);
+            }
+        }
+    }
+
+    unlink(outputFilename.c_str());
+    int fd = open(outputFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        throw runtime_error("Error: Could not open file: " + outputFilename);
+    }
+
+    try
+    {
+        TGAHeader header = outputHeader(inputHeader, rle);
+        for (const Operation &op : operations)
+        {
+            if (op.viaOrigin)
+            {
+                flipOrigin(header, op.transform);
+            }
+        }
+        writeAll(fd, reinterpret_cast<const uint8_t *>(&header), sizeof(TGAHeader), outputFilename);
+
+        size_t windowRows = max<size_t>(1, kStreamWindowBytes / max<size_t>(1, rowBytes));
+        vector<uint8_t> block(min(windowRows, height) * rowBytes);
+        vector<vector<uint8_t>> encoded(rle ? min(windowRows, height) : 0);
+        vector<array<const uint8_t *, 2>> layerRows(operations.size(), {nullptr, nullptr});
+
+        for (size_t y0 = 0; y0 < height; y0 += windowRows)
+        {
+            size_t count = min(windowRows, height - y0);
+            // Output rows [y0, y0 + count) come from the mirrored range of any input that is read bottom-up
+            auto firstSourceRow = [&](bool bottomUp) { return bottomUp ? height - y0 - count : y0; };
+            auto rowOf = [&](const uint8_t *rows, bool bottomUp, size_t r) {
+                return rows + (bottomUp ? count - 1 - r : r) * rowBytes;
+            };
+
+            const uint8_t *firstRows = first.rows(firstSourceRow(firstReversed), count);
+            for (size_t k = 0; k < operations.size(); ++k)
+            {
+                for (size_t j = 0; j < readers[k].size(); ++j)
+                {
+                    layerRows[k][j] = readers[k][j]->rows(firstSourceRow(reversed[k]), count);
+                }
+            }
+
+            threadPool().parallelFor(count, [&](size_t r) {
+                uint8_t *row = block.data() + r * rowBytes;
+                memcpy(row, rowOf(firstRows, firstReversed, r), rowBytes);
+
+                for (size_t k = 0; k < operations.size(); ++k)
+                {
+                    const Operation &op = operations[k];
+                    if (isGeometric(op))
+                    {
+                        if (!op.viaOrigin && storageOrientation(op.transform, inputHeader).reverseX)
+                        {
+                            reverseRowInPlace(row, static_cast<int>(width), channels);
+                        }
+                        continue;
+                    }
+
+                    const uint8_t *layers[2] = {nullptr, nullptr};
+                    for (size_t j = 0; j < readers[k].size(); ++j)
+                    {
+                        layers[j] = rowOf(layerRows[k][j], reversed[k], r);
+                    }
+                    applyPixelwise(operations[k], row, row, layers, 0, rowBytes, channels);
+                }
+
+                if (rle)
+                {
+                    encoded[r].clear();
+                    encodeRleRow(row, width, channels, encoded[r]);
+                }
+            });
+
+            if (rle)
+            {
+                for (size_t r = 0; r < count; ++r)
+                {
+                    writeAll(fd, encoded[r].data(), encoded[r].size(), outputFilename);
+                }
+            }
+            else
+            {
+                writeAll(fd, block.data(), count * rowBytes, outputFilename);
+            }
+        }
+
+        size_t inputs = 1;
+        for (const auto &layerReaders : readers)
+        {
+            inputs += layerReaders.size();
+        }
+        scope.setBytes(inputs * height * rowBytes, static_cast<size_t>(lseek(fd, 0, SEEK_CUR)));
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    for (const Operation &op : operations)
+    {
+        cout << op.message;
+    }
+}
+
+/*
+ * Region Reads
+ *
+ * A chain that starts with a crop reads only the cropped part of its first image. Uncompressed rows sit at offsets
+ * the header gives, so each cropped row is one pread of just its cropped columns. RLE rows have no fixed offsets, so
+ * a row index records where each row starts. An entry is the file offset of the packet that holds the row's first
+ * pixel, plus how many of that packet's pixels belong to earlier rows; packets from other writers may cross rows.
+ * Building the index walks the packet headers up to the last cropped row. With --row-index the whole index is kept
+ * next to the file as FILE.rowidx. It is tagged with the file's size and mtime, so later crops seek straight to their
+ * rows and a rewritten file is indexed again. Other formats load whole and are cropped in memory.
+ */
+struct RleRowIndex
+{
+    vector<uint64_t> offsets;
+    vector<uint8_t> skips;
+};
+
+struct RowIndexHeader
+{
+    char magic[8];
+    uint64_t fileSize;
+    int64_t modifiedSeconds;
+    int64_t modifiedNanoseconds;
+    uint64_t rows;
+};
+
+const char kRowIndexMagic[8] = {'T', 'G', 'A', 'R', 'O', 'W', 'S', '1'};
+
+/* Reads size bytes at offset, throwing on a short read */
+void preadAll(int fd, uint8_t *bytes, size_t size, uint64_t offset, const string &filename)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pread(fd, bytes + done, size - done, static_cast<off_t>(offset + done));
+        if (n <= 0)
+        {
+            throw runtime_error("Truncated TGA file: " + filename);
+        }
+        done += static_cast<size_t>(n);
+    }
+}
+
+/* Indexes the first rows rows of the RLE pixel data at payload, which starts dataOffset bytes into the file */
+RleRowIndex indexRleRows(const uint8_t *payload, size_t size, uint64_t dataOffset, size_t width, size_t rows, int bpp,
+                         const string &filename)
+{
+    RleRowIndex index;
+    size_t in = 0;
+    size_t pixel = 0;
+    size_t row = 0;
+    while (row < rows)
+    {
+        if (in >= size)
+        {
+            throw runtime_error("Truncated RLE data: " + filename);
+        }
+        uint8_t packet = payload[in];
+        size_t count = (packet & 0x7F) + 1;
+        for (; row < rows && row * width < pixel + count; ++row)
+        {
+            index.offsets.push_back(dataOffset + in);
+            index.skips.push_back(static_cast<uint8_t>(row * width - pixel));
+        }
+        in += 1 + ((packet & 0x80) ? bpp : count * bpp);
+        pixel += count;
+    }
+    return index;
+}
+
+/* Loads a kept row index if it was built from this very file */
+bool readRowIndex(const string &path, const struct stat &info, size_t rows, RleRowIndex &index)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    RowIndexHeader header;
+    bool valid = pread(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) &&
+                 memcmp(header.magic, kRowIndexMagic, sizeof(kRowIndexMagic)) == 0 &&
+                 header.fileSize == static_cast<uint64_t>(info.st_size) &&
+                 header.modifiedSeconds == static_cast<int64_t>(info.st_mtim.tv_sec) &&
+                 header.modifiedNanoseconds == static_cast<int64_t>(info.st_mtim.tv_nsec) && header.rows == rows;
+    if (valid)
+    {
+        index.offsets.resize(rows);
+        index.skips.resize(rows);
+        size_t offsetBytes = rows * sizeof(uint64_t);
+        valid = pread(fd, index.offsets.data(), offsetBytes, sizeof(header)) == static_cast<ssize_t>(offsetBytes) &&
+                pread(fd, index.skips.data(), rows, static_cast<off_t>(sizeof(header) + offsetBytes)) ==
+                    static_cast<ssize_t>(rows);
+    }
+    close(fd);
+    return valid;
+}
+
+/* Keeps a whole-file row index next to the file; like the result cache, a failed write just means no index */
+void writeRowIndex(const string &path, const struct stat &info, const RleRowIndex &index)
+{
+    RowIndexHeader header;
+    memcpy(header.magic, kRowIndexMagic, sizeof(kRowIndexMagic));
+    header.fileSize = static_cast<uint64_t>(info.st_size);
+    header.modifiedSeconds = info.st_mtim.tv_sec;
+    header.modifiedNanoseconds = info.st_mtim.tv_nsec;
+    header.rows = index.offsets.size();
+
+    // Written aside and renamed into place, so a reader never sees half an index
+    string temporary = path + "." + to_string(getpid()) + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+    try
+    {
+        writeAll(fd, reinterpret_cast<const uint8_t *>(&header), sizeof(header), temporary);
+        writeAll(fd, reinterpret_cast<const uint8_t *>(index.offsets.data()), index.offsets.size() * sizeof(uint64_t),
+                 temporary);
+        writeAll(fd, index.skips.data(), index.skips.size(), temporary);
+        close(fd);
+        if (rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            unlink(temporary.c_str());
+        }
+    }
+    catch (const runtime_error &)
+    {
+        close(fd);
+        unlink(temporary.c_str());
+    }
+}
+
+/* Decodes count pixels starting skip pixels into the packet at src; packets may run past either end */
+void decodeRleSpan(const uint8_t *src, size_t srcSize, size_t skip, uint8_t *dst, size_t count, int bpp)
+{
+    size_t in = 0;
+    size_t decoded = 0;
+    while (decoded < count)
+    {
+        if (in >= srcSize)
+        {
+            throw runtime_error("Truncated RLE data");
+        }
+        uint8_t packet = src[in++];
+        size_t length = (packet & 0x7F) + 1;
+        size_t take = min(length - skip, count - decoded);
+        size_t stored = (packet & 0x80) ? bpp : length * bpp;
+        if (srcSize - in < stored)
+        {
+            throw runtime_error("Truncated RLE data");
+        }
+        if (packet & 0x80)
+        {
+            for (size_t k = 0; k < take; ++k)
+            {
+                memcpy(dst + (decoded + k) * bpp, src + in, bpp);
+            }
+        }
+        else
+        {
+            memcpy(dst + decoded * bpp, src + in + skip * bpp, take * bpp);
+        }
+        in += stored;
+        decoded += take;
+        skip = 0;
+    }
+}
+
+/* Channels of the image loadTGA would return, from the header alone */
+int loadedChannels(const string &filename)
+{
+    TGAHeader header;
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw runtime_error("Failed to open the TGA file: " + filename);
+    }
+    ssize_t n = pread(fd, &header, sizeof(TGAHeader), 0);
+    close(fd);
+    if (n != static_cast<ssize_t>(sizeof(TGAHeader)))
+    {
+        throw runtime_error("Failed to read the TGA header: " + filename);
+    }
+    // Color maps expand to 24 or 32 bits, and 15/16-bit pixels to 24
+    int type = static_cast<uint8_t>(header.dataTypeCode);
+    if (type == kColorMapped || type == kRleColorMapped)
+    {
+        return static_cast<uint8_t>(header.colorMapDepth) == 32 ? 4 : 3;
+    }
+    int depth = static_cast<uint8_t>(header.pixelDepth);
+    return depth == 15 || depth == 16 ? 3 : depth / 8;
+}
+
+/* The crop of an image read straight from its file, touching only the cropped rows where the format allows */
+TGAImage loadTGARegion(const string &filename, int left, int top, int width, int height, bool keepRowIndex)
+{
+    ProfileScope scope("io", "loadTGARegion " + filename);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw runtime_error("Failed to open the TGA file: " + filename);
+    }
+    TGAHeader header;
+    struct stat info;
+    if (pread(fd, &header, sizeof(TGAHeader), 0) != static_cast<ssize_t>(sizeof(TGAHeader)) || fstat(fd, &info) != 0)
+    {
+        close(fd);
+        throw runtime_error("Failed to read the TGA header: " + filename);
+    }
+
+    int type = static_cast<uint8_t>(header.dataTypeCode);
+    int depth = static_cast<uint8_t>(header.pixelDepth);
+    bool rle = type == kRleTrueColor || type == kRleGrayscale;
+    int baseType = rle ? type - 8 : type;
+    if (!((baseType == kTrueColor && (depth == 24 || depth == 32)) || (baseType == kGrayscale && depth == 8)))
+    {
+        close(fd);
+        TGAImage whole = loadTGA(filename);
+        return cropImage(whole, storageRegion(whole.header, left, top, width, height));
+    }
+
+    TGAImage image;
+    size_t bytesRead = 0;
+    try
+    {
+        Region region = storageRegion(header, left, top, width, height);
+        int bpp = depth / 8;
+        size_t imageWidth = header.width;
+        size_t imageHeight = header.height;
+        size_t rowBytes = region.width * bpp;
+        uint64_t dataOffset = pixelDataOffset(header);
+
+        image.header = header;
+        image.header.idLength = 0;
+        image.header.colorMapType = 0;
+        image.header.colorMapOrigin = 0;
+        image.header.colorMapLength = 0;
+        image.header.colorMapDepth = 0;
+        image.header.dataTypeCode = static_cast<char>(baseType);
+        image.header.width = static_cast<uint16_t>(region.width);
+        image.header.height = static_cast<uint16_t>(region.height);
+        image.data.allocate(rowBytes * region.height);
+        uint8_t *pixels = image.data.data();
+
+        if (!rle)
+        {
+            threadPool().parallelFor(region.height, [&](size_t y) {
+                uint64_t offset = dataOffset + ((region.y + y) * imageWidth + region.x) * bpp;
+                preadAll(fd, pixels + y * rowBytes, rowBytes, offset, filename);
+            });
+            bytesRead = rowBytes * region.height;
+        }
+        else
+        {
+            RleRowIndex index;
+            size_t last = region.y + region.height;
+            string indexPath = filename + ".rowidx";
+            if (!readRowIndex(indexPath, info, imageHeight, index))
+            {
+                MappedFile file(filename);
+                if (dataOffset > file.size())
+                {
+                    throw runtime_error("Truncated TGA file: " + filename);
+                }
+                index = indexRleRows(file.data() + dataOffset, file.size() - dataOffset, dataOffset, imageWidth,
+                                     keepRowIndex ? imageHeight : min(imageHeight, last + 1), bpp, filename);
+                if (keepRowIndex)
+                {
+                    writeRowIndex(indexPath, info, index);
+                }
+            }
+
+            // From the first cropped row's packet to the end of the packet the last cropped row ends in
+            uint64_t fileSize = static_cast<uint64_t>(info.st_size);
+            uint64_t begin = index.offsets[region.y];
+            uint64_t end = last < index.offsets.size() ? index.offsets[last] + 1 + 128 * bpp : fileSize;
+            vector<uint8_t> span(min(end, fileSize) - begin);
+            preadAll(fd, span.data(), span.size(), begin, filename);
+            bytesRead = span.size();
+
+            threadPool().parallelFor(region.height, [&](size_t y) {
+                size_t start = index.offsets[region.y + y] - begin;
+                vector<uint8_t> row((region.x + region.width) * bpp);
+                try
+                {
+                    decodeRleSpan(span.data() + start, span.size() - start, index.skips[region.y + y], row.data(),
+                                  region.x + region.width, bpp);
+                }
+                catch (const runtime_error &error)
+                {
+                    throw runtime_error(string(error.what()) + ": " + filename);
+                }
+                memcpy(pixels + y * rowBytes, row.data() + region.x * bpp, rowBytes);
+            });
+        }
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    scope.setBytes(bytesRead, image.data.size());
+    return image;
+}
+
+/*
+ * Tiled Mode
+ *
+ * A stitched panorama can reach 65535 pixels a side, tens of gigabytes in one block, while most of it is constant
+ * padding. --tiled runs the chain over a grid of 64x64-pixel tiles instead. A tile is uniform, stored as one pixel
+ * value; a view into the rows of the input it was loaded from; or a block of its own, allocated only once an op
+ * writes to it. A per-pixel run works a uniform tile out from a single pixel when its layer tiles are uniform too,
+ * and a histogram counts it in one step. Written tiles are marked dirty, and only they are checked afterwards for
+ * having become uniform, which hands their block back. Geometric ops and crops gather each output tile from the tiles
+ * under it. Filters and resampling read across tiles, and running them would mean assembling the whole image this
+ * mode exists to avoid, so a chain with them is rejected; it has to run without --tiled.
+ */
+const size_t kTileSize = 64;
+
+struct Tile
+{
+    const uint8_t *pixels = nullptr;
+    size_t stride = 0;
+    unique_ptr<uint8_t[]> block;
+    array<uint8_t, 4> value{};
+    bool dirty = false;
+
+    bool uniform() const { return pixels == nullptr; }
+};
+
+struct TiledImage
+{
+    TGAHeader header;
+    int channels = 0;
+    size_t columns = 0;
+    size_t rows = 0;
+    vector<Tile> tiles;
+    // What untouched tiles view: the input's mapping, or its decoded pixels
+    shared_ptr<const TGAImage> source;
+
+    size_t tileWidth(size_t column) const { return min(kTileSize, header.width - column * kTileSize); }
+    size_t tileHeight(size_t row) const { return min(kTileSize, header.height - row * kTileSize); }
+};
+
+/* A grid of uniform black tiles covering the image header describes */
+TiledImage blankTiledImage(const TGAHeader &header)
+{
+    ImageLayout layout = imageLayout(header);
+    TiledImage image;
+    image.header = header;
+    image.channels = layout.channels;
+    image.columns = (layout.width + kTileSize - 1) / kTileSize;
+    image.rows = (layout.height + kTileSize - 1) / kTileSize;
+    image.tiles.resize(image.columns * image.rows);
+    return image;
+}
+
+/* Runs body(t) for every tile index t, in runs of neighbouring tiles on the pool */
+void forEachGridTile(const TiledImage &image, const function<void(size_t)> &body)
+{
+    size_t count = image.tiles.size();
+    size_t perTask = max<size_t>(1, count / (threadPool().size() * 8));
+    threadPool().parallelFor((count + perTask - 1) / perTask, [&](size_t task) {
+        size_t last = min(count, (task + 1) * perTask);
+        for (size_t t = task * perTask; t < last; ++t)
+        {
+            body(t);
+        }
+    });
+}
+
+/* Whether width x height pixels, rows stride bytes apart, all equal the first one, whose value lands in value */
+bool uniformPixels(const uint8_t *pixels, size_t stride, size_t width, size_t height, int channels,
+                   array<uint8_t, 4> &value)
+{
+    size_t rowBytes = width * channels;
+    // A row holds one value throughout exactly when it equals itself shifted by a pixel
+    if (memcmp(pixels, pixels + channels, rowBytes - channels) != 0)
+    {
+        return false;
+    }
+    for (size_t y = 1; y < height; ++y)
+    {
+        if (memcmp(pixels + y * stride, pixels, rowBytes) != 0)
+        {
+            return false;
+        }
+    }
+    value = {};
+    memcpy(value.data(), pixels, channels);
+    return true;
+}
+
+/* Turns a tile back into a uniform one if its pixels allow, releasing its block, and clears its dirty flag */
+void summarizeTile(Tile &tile, size_t width, size_t height, int channels)
+{
+    if (!tile.uniform() && uniformPixels(tile.pixels, tile.stride, width, height, channels, tile.value))
+    {
+        tile.pixels = nullptr;
+        tile.stride = 0;
+        tile.block.reset();
+    }
+    tile.dirty = false;
+}
+
+/* The tile's own pixels for writing, holding what it showed before; marks it dirty */
+uint8_t *writableTile(Tile &tile, size_t width, size_t height, int channels)
+{
+    if (!tile.block)
+    {
+        size_t stride = kTileSize * channels;
+        unique_ptr<uint8_t[]> block(new uint8_t[stride * kTileSize]);
+        for (size_t y = 0; y < height; ++y)
+        {
+            if (tile.uniform())
+            {
+                fillPixels(block.get() + y * stride, 0, width * channels, channels, tile.value);
+            }
+            else
+            {
+                memcpy(block.get() + y * stride, tile.pixels + y * tile.stride, width * channels);
+            }
+        }
+        tile.block = move(block);
+        tile.pixels = tile.block.get();
+        tile.stride = stride;
+    }
+    tile.dirty = true;
+    return tile.block.get();
+}
+
+/* Checks the tiles written since the last settle for having become uniform */
+void settleTiles(TiledImage &image)
+{
+    forEachGridTile(image, [&](size_t t) {
+        Tile &tile = image.tiles[t];
+        if (tile.dirty)
+        {
+            summarizeTile(tile, image.tileWidth(t % image.columns), image.tileHeight(t / image.columns),
+                          image.channels);
+        }
+    });
+}
+
+/* Tiles an image in memory or mapped from its file; its tiles view its pixels until they are written */
+TiledImage tileImage(shared_ptr<const TGAImage> source)
+{
+    TiledImage image = blankTiledImage(source->header);
+    size_t rowBytes = imageLayout(source->header).rowBytes;
+    const uint8_t *pixels = source->data.data();
+    forEachGridTile(image, [&](size_t t) {
+        size_t column = t % image.columns;
+        size_t row = t / image.columns;
+        Tile &tile = image.tiles[t];
+        tile.pixels = pixels + row * kTileSize * rowBytes + column * kTileSize * image.channels;
+        tile.stride = rowBytes;
+        summarizeTile(tile, image.tileWidth(column), image.tileHeight(row), image.channels);
+    });
+    image.source = move(source);
+    return image;
+}
+
+/*
+ * Loads an image as tiles. Uncompressed true-color and grayscale files stay mapped, so untouched tiles cost no memory.
+ * RLE ones are indexed by row and decoded a band of tile rows at a time, keeping blocks only for tiles that are not
+ * uniform. Other formats are decoded whole first.
+ */
+TiledImage loadTiledTGA(const string &filename)
+{
+    ProfileScope scope("io", "loadTiledTGA " + filename);
+    auto file = make_shared<const MappedFile>(filename);
+    if (file->size() < sizeof(TGAHeader))
+    {
+        throw runtime_error("Failed to read the TGA header: " + filename);
+    }
+    TGAHeader header;
+    memcpy(&header, file->data(), sizeof(TGAHeader));
+
+    int type = static_cast<uint8_t>(header.dataTypeCode);
+    int depth = static_cast<uint8_t>(header.pixelDepth);
+    int baseType = type == kRleTrueColor || type == kRleGrayscale ? type - 8 : type;
+    bool rle = baseType != type;
+    if (!rle || !((baseType == kTrueColor && (depth == 24 || depth == 32)) || (baseType == kGrayscale && depth == 8)))
+    {
+        return tileImage(make_shared<const TGAImage>(loadTGA(filename)));
+    }
+
+    size_t dataOffset = pixelDataOffset(header);
+    if (dataOffset > file->size())
+    {
+        throw runtime_error("Truncated TGA file: " + filename);
+    }
+    header.idLength = 0;
+    header.colorMapType = 0;
+    header.colorMapOrigin = 0;
+    header.colorMapLength = 0;
+    header.colorMapDepth = 0;
+    header.dataTypeCode = static_cast<char>(baseType);
+
+    TiledImage image = blankTiledImage(header);
+    int bpp = image.channels;
+    size_t width = header.width;
+    size_t rowBytes = width * bpp;
+    const uint8_t *payload = file->data() + dataOffset;
+    size_t payloadSize = file->size() - dataOffset;
+    RleRowIndex index = indexRleRows(payload, payloadSize, 0, width, header.height, bpp, filename);
+
+    threadPool().parallelFor(image.rows, [&](size_t row) {
+        size_t height = image.tileHeight(row);
+        vector<uint8_t> band(height * rowBytes);
+        for (size_t y = 0; y < height; ++y)
+        {
+            size_t start = index.offsets[row * kTileSize + y];
+            try
+            {
+                decodeRleSpan(payload + start, payloadSize - start, index.skips[row * kTileSize + y],
+                              band.data() + y * rowBytes, width, bpp);
+            }
+            catch (const runtime_error &error)
+            {
+                throw runtime_error(string(error.what()) + ": " + filename);
+            }
+        }
+        for (size_t column = 0; column < image.columns; ++column)
+        {
+            Tile &tile = image.tiles[row * image.columns + column];
+            tile.pixels = band.data() + column * kTileSize * bpp;
+            tile.stride = rowBytes;
+            summarizeTile(tile, image.tileWidth(column), height, bpp);
+            if (!tile.uniform())
+            {
+                writableTile(tile, image.tileWidth(column), height, bpp);
+                tile.dirty = false;
+            }
+        }
+    });
+    scope.setBytes(file->size(), 0);
+    return image;
+}
+
+/* Copies the pixels of one row of tiles into band, whose rows are rowBytes apart */
+void copyTileRow(uint8_t *band, size_t rowBytes, const TiledImage &image, size_t row)
+{
+    for (size_t column = 0; column < image.columns; ++column)
+    {
+        const Tile &tile = image.tiles[row * image.columns + column];
+        size_t bytes = image.tileWidth(column) * image.channels;
+        uint8_t *out = band + column * kTileSize * image.channels;
+        for (size_t y = 0; y < image.tileHeight(row); ++y)
+        {
+            if (tile.uniform())
+            {
+                fillPixels(out + y * rowBytes, 0, bytes, image.channels, tile.value);
+            }
+            else
+            {
+                memcpy(out + y * rowBytes, tile.pixels + y * tile.stride, bytes);
+            }
+        }
+    }
+}
+
+/* The tiles copied out into one contiguous image */
+TGAImage untileImage(const TiledImage &image)
+{
+    ImageLayout layout = imageLayout(image.header);
+    TGAImage whole;
+    whole.header = image.header;
+    whole.data.allocate(layout.bytes);
+    uint8_t *pixels = whole.data.data();
+    threadPool().parallelFor(image.rows, [&](size_t row) {
+        copyTileRow(pixels + row * kTileSize * layout.rowBytes, layout.rowBytes, image, row);
+    });
+    return whole;
+}
+
+/* Writes the tiles out a band of tile rows per thread at a time, so no more than those bands is ever contiguous */
+void saveTiledTGA(const string &filename, const TiledImage &image, bool rle)
+{
+    ProfileScope scope("io", "saveTiledTGA " + filename);
+    ImageLayout layout = imageLayout(image.header);
+    TGAHeader header = outputHeader(image.header, rle);
+
+    unlink(filename.c_str());
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        throw runtime_error("Error: Could not open file: " + filename);
+    }
+    try
+    {
+        writeAll(fd, reinterpret_cast<const uint8_t *>(&header), sizeof(TGAHeader), filename);
+        size_t bandsAtOnce = threadPool().size();
+        vector<vector<uint8_t>> bands(min(bandsAtOnce, image.rows));
+        for (size_t first = 0; first < image.rows; first += bandsAtOnce)
+        {
+            size_t count = min(bandsAtOnce, image.rows - first);
+            threadPool().parallelFor(count, [&](size_t k) {
+                size_t row = first + k;
+                vector<uint8_t> &band = bands[k];
+                band.resize(image.tileHeight(row) * layout.rowBytes);
+                copyTileRow(band.data(), layout.rowBytes, image, row);
+                if (rle)
+                {
+                    vector<uint8_t> encoded;
+                    for (size_t y = 0; y < image.tileHeight(row); ++y)
+                    {
+                        encodeRleRow(band.data() + y * layout.rowBytes, layout.width, image.channels, encoded);
+                    }
+                    band.swap(encoded);
+                }
+            });
+            for (size_t k = 0; k < count; ++k)
+            {
+                writeAll(fd, bands[k].data(), bands[k].size(), filename);
+            }
+        }
+        scope.setBytes(layout.bytes, static_cast<size_t>(lseek(fd, 0, SEEK_CUR)));
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+/* histogram() over tiles; a uniform tile counts its value once for every pixel it stands for */
+Histogram tiledHistogram(const TiledImage &image)
+{
+    Histogram result;
+    result.channels = image.channels;
+    result.pixels = static_cast<uint64_t>(image.header.width) * image.header.height;
+
+    size_t count = image.tiles.size();
+    size_t parts = min<size_t>(threadPool().size(), max<size_t>(1, count / 16));
+    vector<Histogram> partial(parts);
+    threadPool().parallelFor(parts, [&](size_t part) {
+        uint32_t copies[kHistogramCopies][4][256] = {};
+        dispatchPixelFormat(image.channels, 0, [&](auto format, auto) {
+            const int channels = decltype(format)::value;
+            size_t counted = 0;
+            for (size_t t = part * count / parts; t < (part + 1) * count / parts; ++t)
+            {
+                const Tile &tile = image.tiles[t];
+                size_t width = image.tileWidth(t % image.columns);
+                size_t height = image.tileHeight(t / image.columns);
+                if (tile.uniform())
+                {
+                    for (int j = 0; j < channels; ++j)
+                    {
+                        partial[part].counts[j][tile.value[j]] += width * height;
+                    }
+                    continue;
+                }
+                if (counted + kTileSize * kTileSize * channels > kHistogramChunkBytes)
+                {
+                    flushCopies(partial[part], copies, channels);
+                    counted = 0;
+                }
+                for (size_t y = 0; y < height; ++y)
+                {
+                    countPixels<channels>(copies, tile.pixels + y * tile.stride, 0, width * channels);
+                }
+                counted += width * height * channels;
+            }
+        });
+        flushCopies(partial[part], copies, image.channels);
+    });
+    mergeHistograms(result, partial);
+    return result;
+}
+
+/* orientPixels for one small block, on the calling thread */
+void orientBlock(uint8_t *dst, const uint8_t *src, int width, int height, int channels, Orientation orientation)
+{
+    if (orientation.swapAxes)
+    {
+        dispatchPixelFormat(channels, 0, [&](auto format, auto) {
+            orientBlocked<decltype(format)::value>(dst, src, width, height, orientation, 0, width);
+        });
+        return;
+    }
+    size_t rowBytes = static_cast<size_t>(width) * channels;
+    for (int y = 0; y < height; ++y)
+    {
+        const uint8_t *in = src + (orientation.reverseY ? height - 1 - y : y) * rowBytes;
+        if (orientation.reverseX)
+        {
+            reversePixels(dst + y * rowBytes, in, width, channels);
+        }
+        else
+        {
+            memcpy(dst + y * rowBytes, in, rowBytes);
+        }
+    }
+}
+
+/*
+ * The stored pixels of region turned to orientation, as new tiles. Each output tile gathers the source block under it
+ * and orients it on its own; where that block lies in uniform tiles of a single value, nothing is copied at all.
+ */
+TiledImage rearrangeTiles(const TiledImage &image, const Region &region, Orientation orientation)
+{
+    TGAHeader header = image.header;
+    header.width = static_cast<uint16_t>(orientation.swapAxes ? region.height : region.width);
+    header.height = static_cast<uint16_t>(orientation.swapAxes ? region.width : region.height);
+    TiledImage result = blankTiledImage(header);
+    int channels = image.channels;
+
+    forEachGridTile(result, [&](size_t t) {
+        size_t column = t % result.columns;
+        size_t row = t / result.columns;
+        size_t width = result.tileWidth(column);
+        size_t height = result.tileHeight(row);
+
+        // Output rows come from source columns when the axes swap, and output columns from source rows
+        size_t sourceWidth = orientation.swapAxes ? height : width;
+        size_t sourceHeight = orientation.swapAxes ? width : height;
+        size_t along = (orientation.swapAxes ? row : column) * kTileSize;
+        size_t across = (orientation.swapAxes ? column : row) * kTileSize;
+        size_t sx = region.x + (orientation.reverseX ? region.width - along - sourceWidth : along);
+        size_t sy = region.y + (orientation.reverseY ? region.height - across - sourceHeight : across);
+
+        size_t firstColumn = sx / kTileSize;
+        size_t lastColumn = (sx + sourceWidth - 1) / kTileSize;
+        size_t firstRow = sy / kTileSize;
+        size_t lastRow = (sy + sourceHeight - 1) / kTileSize;
+        const Tile &corner = image.tiles[firstRow * image.columns + firstColumn];
+        bool uniform = true;
+        for (size_t r = firstRow; r <= lastRow; ++r)
+        {
+            for (size_t c = firstColumn; c <= lastColumn; ++c)
+            {
+                const Tile &source = image.tiles[r * image.columns + c];
+                uniform = uniform && source.uniform() && source.value == corner.value;
+            }
+        }
+        Tile &tile = result.tiles[t];
+        if (uniform)
+        {
+            tile.value = corner.value;
+            return;
+        }
+
+        thread_local vector<uint8_t> gathered;
+        thread_local vector<uint8_t> oriented;
+        gathered.resize(sourceWidth * sourceHeight * channels);
+        oriented.resize(gathered.size());
+        for (size_t r = firstRow; r <= lastRow; ++r)
+        {
+            for (size_t c = firstColumn; c <= lastColumn; ++c)
+            {
+                const Tile &source = image.tiles[r * image.columns + c];
+                size_t x0 = max(sx, c * kTileSize);
+                size_t x1 = min(sx + sourceWidth, c * kTileSize + image.tileWidth(c));
+                size_t y1 = min(sy + sourceHeight, r * kTileSize + image.tileHeight(r));
+                for (size_t y = max(sy, r * kTileSize); y < y1; ++y)
+                {
+                    uint8_t *out = gathered.data() + ((y - sy) * sourceWidth + (x0 - sx)) * channels;
+                    if (source.uniform())
+                    {
+                        fillPixels(out, 0, (x1 - x0) * channels, channels, source.value);
+                    }
+                    else
+                    {
+                        const uint8_t *in = source.pixels + (y - r * kTileSize) * source.stride;
+                        memcpy(out, in + (x0 - c * kTileSize) * channels, (x1 - x0) * channels);
+                    }
+                }
+            }
+        }
+        orientBlock(oriented.data(), gathered.data(), static_cast<int>(sourceWidth), static_cast<int>(sourceHeight),
+                    channels, orientation);
+        uint8_t *pixels = writableTile(tile, width, height, channels);
+        for (size_t y = 0; y < height; ++y)
+        {
+            memcpy(pixels + y * tile.stride, oriented.data() + y * width * channels, width * channels);
+        }
+    });
+
+    // An output tile can be uniform even where the tiles it came from were not
+    settleTiles(result);
+    return result;
+}
+
+/* Runs ops [first, last) as one pass over the tiles; layers[k - first] holds op k's inputs as tiles */
+void executeTiledRun(TiledImage &image, const vector<Operation> &operations, size_t first, size_t last,
+                     const vector<vector<shared_ptr<const TiledImage>>> &layers)
+{
+    int channels = image.channels;
+    forEachGridTile(image, [&](size_t t) {
+        Tile &tile = image.tiles[t];
+        bool uniform = tile.uniform();
+        for (const auto &opLayers : layers)
+        {
+            for (const auto &layer : opLayers)
+            {
+                uniform = uniform && layer->tiles[t].uniform();
+            }
+        }
+        if (uniform)
+        {
+            // Every pixel of the tile goes through the same ops with the same inputs, so one stands for them all
+            for (size_t k = first; k < last; ++k)
+            {
+                const uint8_t *values[2] = {nullptr, nullptr};
+                for (size_t j = 0; j < layers[k - first].size(); ++j)
+                {
+                    values[j] = layers[k - first][j]->tiles[t].value.data();
+                }
+                applyPixelwise(operations[k], tile.value.data(), tile.value.data(), values, 0, channels, channels);
+            }
+            return;
+        }
+
+        size_t width = image.tileWidth(t % image.columns);
+        size_t height = image.tileHeight(t / image.columns);
+        size_t rowBytes = width * channels;
+        uint8_t *pixels = writableTile(tile, width, height, channels);
+
+        // Uniform layer tiles are read through a row of their value
+        thread_local vector<uint8_t> filled;
+        filled.resize(2 * (last - first) * rowBytes);
+        for (size_t k = first; k < last; ++k)
+        {
+            for (size_t j = 0; j < layers[k - first].size(); ++j)
+            {
+                const Tile &layerTile = layers[k - first][j]->tiles[t];
+                if (layerTile.uniform())
+                {
+                    fillPixels(filled.data() + (2 * (k - first) + j) * rowBytes, 0, rowBytes, channels,
+                               layerTile.value);
+                }
+            }
+        }
+
+        for (size_t y = 0; y < height; ++y)
+        {
+            uint8_t *row = pixels + y * tile.stride;
+            for (size_t k = first; k < last; ++k)
+            {
+                const uint8_t *rows[2] = {nullptr, nullptr};
+                for (size_t j = 0; j < layers[k - first].size(); ++j)
+                {
+                    const Tile &layerTile = layers[k - first][j]->tiles[t];
+                    rows[j] = layerTile.uniform() ? filled.data() + (2 * (k - first) + j) * rowBytes
+                                                  : layerTile.pixels + y * layerTile.stride;
+                }
+                applyPixelwise(operations[k], row, row, rows, 0, rowBytes, channels);
+            }
+        }
+    });
+    settleTiles(image);
+}
+
+/* executeOperations over tiles; throws for the ops that read across tiles */
+void executeTiledOperations(TiledImage &image, vector<Operation> &operations, ostream &log = cout)
+{
+    size_t i = 0;
+    while (i < operations.size())
+    {
+        Operation &op = operations[i];
+        size_t imageBytes = imageLayout(image.header).bytes;
+        if (isFilter(op) || (isResample(op) && op.kind != OpKind::Crop))
+        {
+            throw runtime_error("Tiled mode cannot filter, resize or write mipmaps; run without --tiled");
+        }
+        if (isMeasured(op) && op.lut == nullptr)
+        {
+            Histogram counts;
+            {
+                ProfileScope scope("stats", describeOperation(op), imageBytes);
+                counts = tiledHistogram(image);
+            }
+            if (op.kind == OpKind::Stats)
+            {
+                log << op.message << describeHistogram(counts);
+                ++i;
+                continue;
+            }
+            op.lut = make_shared<const ChannelLut>(levelsLut(counts, op.kind == OpKind::AutoLevels, op.factor));
+        }
+        if (op.kind == OpKind::Crop || isGeometric(op))
+        {
+            ProfileScope scope(isGeometric(op) ? "geometric" : "resample", describeOperation(op), imageBytes);
+            if (op.kind == OpKind::Crop)
+            {
+                image = rearrangeTiles(image, storageRegion(image.header, op.left, op.top, op.width, op.height),
+                                       Orientation{false, false, false});
+            }
+            else if (op.viaOrigin)
+            {
+                flipOrigin(image.header, op.transform);
+            }
+            else
+            {
+                image = rearrangeTiles(image, Region{0, 0, image.header.width, image.header.height},
+                                       storageOrientation(op.transform, image.header));
+            }
+            log << op.message;
+            ++i;
+            continue;
+        }
+
+        size_t last = i;
+        vector<string> filenames;
+        while (last < operations.size() && isPixelwise(operations[last]))
+        {
+            checkPixelFormat(operations[last], image.channels);
+            for (const string &filename : operations[last].files)
+            {
+                if (find(filenames.begin(), filenames.end(), filename) == filenames.end())
+                {
+                    filenames.push_back(filename);
+                }
+            }
+            ++last;
+        }
+
+        // Layers load as tiles too, all at once on the pool, so their padding costs nothing either
+        vector<shared_ptr<const TiledImage>> loaded(filenames.size());
+        threadPool().parallelFor(filenames.size(), [&](size_t n) {
+            loaded[n] = make_shared<const TiledImage>(loadTiledTGA(filenames[n]));
+            const TGAHeader &layerHeader = loaded[n]->header;
+            if (layerHeader.width != image.header.width || layerHeader.height != image.header.height ||
+                layerHeader.pixelDepth != image.header.pixelDepth)
+            {
+                throw runtime_error("Image dimensions do not match the running image: " + filenames[n]);
+            }
+        });
+        vector<vector<shared_ptr<const TiledImage>>> layers(last - i);
+        string name;
+        for (size_t k = i; k < last; ++k)
+        {
+            for (const string &filename : operations[k].files)
+            {
+                layers[k - i].push_back(loaded[find(filenames.begin(), filenames.end(), filename) - filenames.begin()]);
+            }
+            name += (k == i ? "" : " + ") + operations[k].method;
+        }
+
+        {
+            ProfileScope scope("pixelwise", name, (1 + filenames.size()) * imageBytes, imageBytes);
+            executeTiledRun(image, operations, i, last, layers);
+        }
+        for (size_t k = i; k < last; ++k)
+        {
+            log << operations[k].message;
+            if (isMeasured(operations[k]))
+            {
+                operations[k].lut.reset();
+            }
+        }
+        i = last;
+    }
+}
+
+/*
+ * Result Cache
+ *
+ * --cache DIR keeps finished outputs in DIR, named by a hash of everything that decides their bytes: the output
+ * format, the identity of every input file (device, inode, size and modification time, so inputs are never read
+ * just to be hashed) and each op's parameters. Every prefix of a chain has a key of its own, so a rerun is served
+ * straight from DIR and a chain that extends an earlier one starts from the earlier result. Entries are linked
+ * rather than copied where the filesystem allows it; a served output then keeps the entry's identity, and chains
+ * that read it hit as well. Least recently used entries go first once DIR outgrows its size limit.
+ */
+const uint64_t kCacheFormatVersion = 1;
+const uint64_t kDefaultCacheBytes = 1024ull << 20;
+
+uint64_t checksum(const uint8_t *bytes, size_t size, uint64_t hash = 1469598103934665603ull)
+{
+    // FNV-1a
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+uint64_t checksum(const TGAImage &image)
+{
+    return checksum(image.data.data(), image.data.size());
+}
+
+template <typename T>
+uint64_t hashValue(uint64_t hash, const T &value)
+{
+    static_assert(is_trivially_copyable<T>::value, "hashValue reads the object representation");
+    return checksum(reinterpret_cast<const uint8_t *>(&value), sizeof(T), hash);
+}
+
+uint64_t hashString(uint64_t hash, const string &text)
+{
+    return checksum(reinterpret_cast<const uint8_t *>(text.data()), text.size(), hashValue(hash, text.size()));
+}
+
+/* Folds a file's identity into key: which file it is and when it last changed, without reading it */
+bool hashFileIdentity(uint64_t &key, const string &filename)
+{
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0)
+    {
+        return false;
+    }
+    key = hashValue(key, info.st_dev);
+    key = hashValue(key, info.st_ino);
+    key = hashValue(key, info.st_size);
+    key = hashValue(key, info.st_mtim.tv_sec);
+    key = hashValue(key, info.st_mtim.tv_nsec);
+    return true;
+}
+
+/* Copies source to a new file destination: a hard link, else a reflink clone, else a plain copy */
+bool cloneFile(const string &source, const string &destination)
+{
+    if (link(source.c_str(), destination.c_str()) == 0)
+    {
+        return true;
+    }
+    int in = open(source.c_str(), O_RDONLY);
+    if (in < 0)
+    {
+        return false;
+    }
+    int out = open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out < 0)
+    {
+        close(in);
+        return false;
+    }
+    bool copied = false;
+#ifdef FICLONE
+    copied = ioctl(out, FICLONE, in) == 0;
+#endif
+    struct stat info;
+    if (!copied && fstat(in, &info) == 0)
+    {
+        off_t remaining = info.st_size;
+        while (remaining > 0)
+        {
+            ssize_t sent = sendfile(out, in, nullptr, static_cast<size_t>(remaining));
+            if (sent <= 0)
+            {
+                break;
+            }
+            remaining -= sent;
+        }
+        copied = remaining == 0;
+    }
+    close(in);
+    close(out);
+    if (!copied)
+    {
+        unlink(destination.c_str());
+    }
+    return copied;
+}
+
+class ResultCache
+{
+public:
+    ResultCache(const string &directory, uint64_t limitBytes, bool rle, bool originBits)
+        : directory(directory), limitBytes(limitBytes), originBits(originBits)
+    {
+        if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            throw runtime_error("Error: Could not create the cache directory " + directory);
+        }
+        formatKey = hashValue(hashValue(hashValue(checksum(nullptr, 0), kCacheFormatVersion), rle), originBits);
+    }
+
+    /*
+     * Fills keys[k] with the key of the chain's first k ops; returns false if an input cannot be stat'ed or the chain
+     * writes mip levels or prints stats, in which case the chain is simply not cached
+     */
+    bool keys(const string &firstImageFilename, const vector<Operation> &operations, vector<uint64_t> &keys) const
+    {
+        keys.clear();
+        uint64_t key = formatKey;
+        if (!hashFileIdentity(key, firstImageFilename))
+        {
+            return false;
+        }
+        keys.push_back(key);
+        for (const Operation &op : operations)
+        {
+            // An uncached chain must not leave prefix keys behind, or its output would be stored under one of them
+            if (op.kind == OpKind::Mipmaps || op.kind == OpKind::Stats)
+            {
+                keys.clear();
+                return false;
+            }
+            key = hashString(key, op.method);
+            key = hashValue(key, op.channel);
+            key = hashValue(key, op.amount);
+            key = hashValue(key, op.factor);
+            key = hashValue(key, op.transform);
+            key = hashValue(key, op.composite);
+            key = hashValue(key, op.opacity);
+            key = hashValue(key, op.left);
+            key = hashValue(key, op.top);
+            key = hashValue(key, op.width);
+            key = hashValue(key, op.height);
+            key = hashValue(key, op.resample);
+            for (const string &filename : op.files)
+            {
+                if (!hashFileIdentity(key, filename))
+                {
+                    keys.clear();
+                    return false;
+                }
+            }
+            keys.push_back(key);
+        }
+        return true;
+    }
+
+    /*
+     * Finds the longest cached prefix of the chain with these keys and marks its entry as just used; covered is the
+     * number of ops it stands for. A bare input is never looked up unless the chain has no ops at all. With origin
+     * bits, a prefix may keep its flips in the header alone, and layers read after it would pair up with unflipped
+     * pixels, so only prefixes past the last op with layers are reused.
+     */
+    bool lookup(const vector<uint64_t> &keys, const vector<Operation> &operations, size_t &covered,
+                string &path) const
+    {
+        ProfileScope scope("cache", "cache lookup");
+        size_t lowest = keys.size() > 1 ? 1 : 0;
+        for (size_t k = 0; originBits && k < operations.size(); ++k)
+        {
+            if (!operations[k].files.empty())
+            {
+                lowest = max(lowest, k + 1);
+            }
+        }
+        for (size_t k = keys.size(); k-- > lowest;)
+        {
+            string candidate = entryPath(keys[k]);
+            // Only the access time records use; the modification time is part of a linked output's identity
+            struct timespec times[2] = {{0, UTIME_NOW}, {0, UTIME_OMIT}};
+            if (utimensat(AT_FDCWD, candidate.c_str(), times, 0) == 0)
+            {
+                covered = k;
+                path = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Puts a cached entry in place as the output */
+    bool serve(const string &path, const string &outputFilename) const
+    {
+        ProfileScope scope("cache", "cache serve " + outputFilename);
+        struct stat entry;
+        struct stat output;
+        if (stat(path.c_str(), &entry) == 0 && stat(outputFilename.c_str(), &output) == 0 &&
+            entry.st_dev == output.st_dev && entry.st_ino == output.st_ino)
+        {
+            return true;
+        }
+        unlink(outputFilename.c_str());
+        return cloneFile(path, outputFilename);
+    }
+
+    /* Adds a freshly written output under key, then trims the directory to its limit */
+    void store(uint64_t key, const string &outputFilename)
+    {
+        ProfileScope scope("cache", "cache store " + outputFilename);
+        // Entries appear whole: they are cloned under a private name, then renamed into place
+        static atomic<unsigned> sequence{0};
+        string temporary = directory + "/.tmp-" + to_string(getpid()) + "-" + to_string(sequence++);
+        if (!cloneFile(outputFilename, temporary))
+        {
+            return;
+        }
+        if (rename(temporary.c_str(), entryPath(key).c_str()) != 0)
+        {
+            unlink(temporary.c_str());
+            return;
+        }
+        evict();
+    }
+
+private:
+    string entryPath(uint64_t key) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.tga", static_cast<unsigned long long>(key));
+        return directory + name;
+    }
+
+    void evict()
+    {
+        DIR *listing = opendir(directory.c_str());
+        if (listing == nullptr)
+        {
+            return;
+        }
+        struct Entry
+        {
+            struct timespec used;
+            off_t size;
+            string path;
+        };
+        vector<Entry> entries;
+        uint64_t total = 0;
+        while (dirent *item = readdir(listing))
+        {
+            string name = item->d_name;
+            struct stat info;
+            if (name.size() != 20 || name.compare(16, 4, ".tga") != 0 ||
+                stat((directory + "/" + name).c_str(), &info) != 0)
+            {
+                continue;
+            }
+            entries.push_back({info.st_atim, info.st_size, directory + "/" + name});
+            total += static_cast<uint64_t>(info.st_size);
+        }
+        closedir(listing);
+        if (total <= limitBytes)
+        {
+            return;
+        }
+
+        sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+            return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+        });
+        for (const Entry &entry : entries)
+        {
+            if (total <= limitBytes)
+            {
+                break;
+            }
+            if (unlink(entry.path.c_str()) == 0)
+            {
+                total -= static_cast<uint64_t>(entry.size);
+            }
+        }
+    }
+
+    string directory;
+    uint64_t limitBytes;
+    bool originBits;
+    uint64_t formatKey = 0;
+};
+
+/*
+ * Batch Mode
+ *
+ * Runs one op chain per manifest line ("output firstImage method ...") in a single process. Three stages overlap:
+ * a loader thread reads and decodes the inputs of upcoming lines, the main thread computes the current line, and a
+ * writer thread saves finished outputs. Inputs are shared through a small cache, so a layer that many lines use is
+ * loaded once while it stays in use. A line that reads the output of an earlier line waits for that output to be
+ * saved, and the copy of that file in the cache is dropped, since it has been overwritten.
+ */
+const size_t kBatchQueueDepth = 2;
+const size_t kBatchCachedImages = 32;
+
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(T item)
+    {
+        unique_lock<mutex> guard(lock);
+        notFull.wait(guard, [this]() { return items.size() < capacity; });
+        items.push_back(move(item));
+        notEmpty.notify_one();
+    }
+
+    /* Returns false once the queue is closed and drained */
+    bool pop(T &item)
+    {
+        unique_lock<mutex> guard(lock);
+        notEmpty.wait(guard, [this]() { return !items.empty() || closed; });
+        if (items.empty())
+        {
+            return false;
+        }
+        item = move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    deque<T> items;
+    bool closed = false;
+    mutex lock;
+    condition_variable notEmpty;
+    condition_variable notFull;
+};
+
+/* Loaded inputs by filename; only the loader thread touches it */
+class ImageCache
+{
+public:
+    shared_ptr<const TGAImage> get(const string &filename)
+    {
+        auto found = images.find(filename);
+        shared_ptr<const TGAImage> image = found != images.end() ? found->second.lock() : nullptr;
+        if (!image)
+        {
+            image = make_shared<const TGAImage>(loadTGA(filename));
+            image->data.prefetch();
+            images[filename] = image;
+        }
+
+        // The newest few stay alive even between lines that do not use them
+        recent.push_back(image);
+        if (recent.size() > kBatchCachedImages)
+        {
+            recent.pop_front();
+        }
+        if (images.size() > 4 * kBatchCachedImages)
+        {
+            for (auto entry = images.begin(); entry != images.end();)
+            {
+                entry = entry->second.expired() ? images.erase(entry) : next(entry);
+            }
+        }
+        return image;
+    }
+
+    /* Drops a file that is about to be overwritten, so the next get() loads it again */
+    void forget(const string &filename)
+    {
+        auto found = images.find(filename);
+        if (found == images.end())
+        {
+            return;
+        }
+        shared_ptr<const TGAImage> image = found->second.lock();
+        recent.erase(remove(recent.begin(), recent.end(), image), recent.end());
+        images.erase(found);
+    }
+
+private:
+    map<string, weak_ptr<const TGAImage>> images;
+    deque<shared_ptr<const TGAImage>> recent;
+};
+
+/* Outputs queued for saving, which later lines must not read before they are written */
+class PendingOutputs
+{
+public:
+    void add(const string &filename)
+    {
+        lock_guard<mutex> guard(lock);
+        ++pending[filename];
+    }
+
+    /* Called once a queued output is saved or its line has failed */
+    void finish(const string &filename)
+    {
+        lock_guard<mutex> guard(lock);
+        if (--pending[filename] == 0)
+        {
+            pending.erase(filename);
+        }
+        changed.notify_all();
+    }
+
+    void waitFor(const vector<string> &filenames)
+    {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [&]() {
+            return none_of(filenames.begin(), filenames.end(),
+                           [&](const string &filename) { return pending.count(filename) != 0; });
+        });
+    }
+
+private:
+    map<string, int> pending;
+    mutex lock;
+    condition_variable changed;
+};
+
+struct BatchJob
+{
+    size_t line = 0;
+    string outputFilename;
+    string firstImageFilename;
+    vector<Operation> operations;
+    shared_ptr<const TGAImage> first;
+    TGAImage result;
+    string leftover;
+    string error;
+    vector<uint64_t> cacheKeys;
+    string cachedResult;
+    string reused;
+};
+
+bool parseBatchLine(const string &text, BatchJob &job)
+{
+    istringstream words(text);
+    vector<string> tokens;
+    string token;
+    while (words >> token)
+    {
+        tokens.push_back(token);
+    }
+    if (tokens.empty() || tokens[0][0] == '#')
+    {
+        return false;
+    }
+    if (tokens.size() < 2)
+    {
+        job.error = "Missing output or input filename.";
+        return true;
+    }
+
+    job.outputFilename = tokens[0];
+    job.firstImageFilename = tokens[1];
+    vector<char *> args;
+    for (string &word : tokens)
+    {
+        args.push_back(&word[0]);
+    }
+    // parseOperations reports its own errors; keep them with the line instead of printing them out of order
+    ostringstream messages;
+    if (!parseOperations(static_cast<int>(args.size()), args.data(), 2, job.firstImageFilename, job.operations,
+                         messages))
+    {
+        job.error = messages.str();
+        while (!job.error.empty() && job.error.back() == '\n')
+        {
+            job.error.pop_back();
+        }
+    }
+    return true;
+}
+
+/*
+ * Loads a job's inputs through load and plans its chain. A chain the result cache holds whole only needs linking
+ * into place; one it holds a prefix of starts from the cached result.
+ */
+void prepareJob(BatchJob &job, const function<shared_ptr<const TGAImage>(const string &)> &load,
+                ResultCache *resultCache, bool optimize, bool originBits)
+{
+    size_t covered = 0;
+    string cachedPath;
+    if (resultCache != nullptr && resultCache->keys(job.firstImageFilename, job.operations, job.cacheKeys) &&
+        resultCache->lookup(job.cacheKeys, job.operations, covered, cachedPath))
+    {
+        for (size_t k = 0; k < covered; ++k)
+        {
+            job.reused += job.operations[k].message;
+        }
+        job.operations.erase(job.operations.begin(), job.operations.begin() + static_cast<ptrdiff_t>(covered));
+        if (job.operations.empty())
+        {
+            job.cachedResult = cachedPath;
+            return;
+        }
+        job.firstImageFilename = cachedPath;
+    }
+
+    job.first = load(job.firstImageFilename);
+    job.leftover = planOperations(job.operations, job.first->header.pixelDepth / 8, optimize, originBits);
+    for (Operation &op : job.operations)
+    {
+        for (const string &filename : op.files)
+        {
+            op.layers.push_back(load(filename));
+        }
+    }
+}
+
+/* Runs a prepared job's chain and returns its progress lines */
+string computeJob(BatchJob &job)
+{
+    if (!job.cachedResult.empty())
+    {
+        return job.reused;
+    }
+    ostringstream messages;
+    job.result = *job.first;
+    job.first.reset();
+    executeOperations(job.result, job.operations, messages);
+    job.operations.clear();
+    return job.reused + messages.str() + job.leftover;
+}
+
+/* Writes a computed job's output, or links its cached result into place, and caches fresh results */
+void saveJob(BatchJob &job, ResultCache *resultCache, bool rle)
+{
+    if (!job.cachedResult.empty())
+    {
+        if (!resultCache->serve(job.cachedResult, job.outputFilename))
+        {
+            throw runtime_error("Error: Could not link the cached result to " + job.outputFilename);
+        }
+        return;
+    }
+    saveTGA(job.outputFilename, job.result, rle);
+    if (resultCache != nullptr && !job.cacheKeys.empty())
+    {
+        resultCache->store(job.cacheKeys.back(), job.outputFilename);
+    }
+}
+
+int runBatch(istream &manifest, bool rle, bool optimize, bool originBits, ResultCache *resultCache)
+{
+    BoundedQueue<unique_ptr<BatchJob>> loaded(kBatchQueueDepth);
+    BoundedQueue<unique_ptr<BatchJob>> computed(kBatchQueueDepth);
+    size_t failures = 0;
+    atomic<size_t> completed{0};
+    mutex reportLock;
+
+    auto report = [&](const BatchJob &job) {
+        // Most messages are written to stand alone and already start with "Error: "
+        string message = job.error.compare(0, 7, "Error: ") == 0 ? job.error.substr(7) : job.error;
+        lock_guard<mutex> guard(reportLock);
+        cout << "Error on line " << job.line << ": " << message << "\n";
+        ++failures;
+    };
+
+    PendingOutputs pending;
+    thread loader([&]() {
+        ImageCache cache;
+        set<string> written;
+        string text;
+        size_t line = 0;
+        while (getline(manifest, text))
+        {
+            auto job = make_unique<BatchJob>();
+            job->line = ++line;
+            if (!parseBatchLine(text, *job))
+            {
+                continue;
+            }
+            if (job->error.empty())
+            {
+                vector<string> inputs = {job->firstImageFilename};
+                for (const Operation &op : job->operations)
+                {
+                    inputs.insert(inputs.end(), op.files.begin(), op.files.end());
+                }
+                pending.waitFor(inputs);
+                for (const string &filename : inputs)
+                {
+                    if (written.count(filename) != 0)
+                    {
+                        cache.forget(filename);
+                        written.erase(filename);
+                    }
+                }
+                try
+                {
+                    prepareJob(*job, [&cache](const string &filename) { return cache.get(filename); }, resultCache,
+                               optimize, originBits);
+                }
+                catch (const exception &error)
+                {
+                    job->error = error.what();
+                }
+            }
+            if (job->error.empty())
+            {
+                pending.add(job->outputFilename);
+                written.insert(job->outputFilename);
+            }
+            loaded.push(move(job));
+        }
+        loaded.close();
+    });
+
+    thread writer([&]() {
+        unique_ptr<BatchJob> job;
+        while (computed.pop(job))
+        {
+            try
+            {
+                saveJob(*job, resultCache, rle);
+                ++completed;
+            }
+            catch (const exception &error)
+            {
+                job->error = error.what();
+                report(*job);
+            }
+            pending.finish(job->outputFilename);
+            job.reset();
+        }
+    });
+
+    unique_ptr<BatchJob> job;
+    while (loaded.pop(job))
+    {
+        if (job->error.empty())
+        {
+            try
+            {
+                string messages = computeJob(*job);
+                lock_guard<mutex> guard(reportLock);
+                cout << messages << "... and saving output to " << job->outputFilename << "!\n";
+            }
+            catch (const exception &error)
+            {
+                job->error = error.what();
+                pending.finish(job->outputFilename);
+            }
+        }
+        if (!job->error.empty())
+        {
+            report(*job);
+            continue;
+        }
+        computed.push(move(job));
+    }
+    computed.close();
+
+    loader.join();
+    writer.join();
+    cout << "Batch finished: " << completed << " outputs saved, " << failures << " failed.\n";
+    return failures == 0 ? 0 : 1;
+}
+
+/*
+ * Daemon Mode
+ *
+ * --serve SOCKET listens on a Unix domain socket and runs one op chain per connection, so process startup and the
+ * decoding of shared layers are paid once instead of per chain. A request is two lines: the client's working
+ * directory, which relative paths are resolved against, and a chain written like a batch manifest line. Requests
+ * run concurrently, each on its own thread, and share the thread pool. Decoded inputs stay resident in an LRU
+ * bounded by --serve-memory and are reloaded once their file changes. The reply is a "MSG line" per progress line,
+ * then "OK output" or "ERROR message"; an output of "-" is answered with "DATA size" and the encoded image instead.
+ * --connect SOCKET is the matching client.
+ */
+const uint64_t kDefaultResidentBytes = 1024ull << 20;
+
+/* Decoded inputs shared by every request, least recently used first out */
+class ResidentImages
+{
+public:
+    explicit ResidentImages(uint64_t limitBytes) : limitBytes(limitBytes) {}
+
+    shared_ptr<const TGAImage> get(const string &filename)
+    {
+        uint64_t identity = 0;
+        if (!hashFileIdentity(identity, filename))
+        {
+            return make_shared<const TGAImage>(loadTGA(filename));
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            auto found = entries.find(filename);
+            if (found != entries.end() && found->second.identity == identity)
+            {
+                order.splice(order.begin(), order, found->second.position);
+                return found->second.image;
+            }
+        }
+
+        // Decoded without the lock held; two requests racing for the same file both load it, and the last one stays
+        auto image = make_shared<const TGAImage>(loadTGA(filename));
+        image->data.prefetch();
+        lock_guard<mutex> guard(lock);
+        auto found = entries.find(filename);
+        if (found != entries.end())
+        {
+            drop(found);
+        }
+        order.push_front(filename);
+        entries[filename] = Entry{image, identity, order.begin()};
+        bytes += image->data.size();
+        while (bytes > limitBytes && order.size() > 1)
+        {
+            drop(entries.find(order.back()));
+        }
+        return image;
+    }
+
+private:
+    struct Entry
+    {
+        shared_ptr<const TGAImage> image;
+        uint64_t identity;
+        list<string>::iterator position;
+    };
+
+    void drop(map<string, Entry>::iterator entry)
+    {
+        bytes -= entry->second.image->data.size();
+        order.erase(entry->second.position);
+        entries.erase(entry);
+    }
+
+    uint64_t limitBytes;
+    uint64_t bytes = 0;
+    map<string, Entry> entries;
+    list<string> order;
+    mutex lock;
+};
+
+struct ServerOptions
+{
+    bool rle = false;
+    bool optimize = true;
+    bool originBits = false;
+    ResultCache *resultCache = nullptr;
+};
+
+/* Reads from fd until buffer holds a whole line, then moves that line out of it; false once the peer is gone */
+bool readLine(int fd, string &buffer, string &line)
+{
+    size_t end;
+    while ((end = buffer.find('\n')) == string::npos)
+    {
+        char chunk[4096];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0)
+        {
+            return false;
+        }
+        buffer.append(chunk, static_cast<size_t>(n));
+    }
+    line = buffer.substr(0, end);
+    buffer.erase(0, end + 1);
+    return true;
+}
+
+void sendText(int connection, const string &text)
+{
+    writeAll(connection, reinterpret_cast<const uint8_t *>(text.data()), text.size(), "the client");
+}
+
+void serveRequest(int connection, ResidentImages &images, const ServerOptions &options)
+{
+    string buffer;
+    string directory;
+    string text;
+    if (!readLine(connection, buffer, directory) || !readLine(connection, buffer, text))
+    {
+        return;
+    }
+
+    BatchJob job;
+    if (!parseBatchLine(text, job))
+    {
+        job.error = "Missing output or input filename.";
+    }
+    auto resolve = [&directory](string &path) {
+        if (!path.empty() && path[0] != '/')
+        {
+            path = directory + "/" + path;
+        }
+    };
+    string writtenOutput = job.outputFilename;
+    bool streamBack = writtenOutput == "-";
+    if (streamBack)
+    {
+        // Written to a private file first, so a result cache can keep it like any other output
+        static atomic<unsigned> sequence{0};
+        const char *temporary = getenv("TMPDIR");
+        job.outputFilename = string(temporary != nullptr ? temporary : "/tmp") + "/tga-serve-" + to_string(getpid()) +
+                             "-" + to_string(sequence++) + ".tga";
+    }
+    resolve(job.outputFilename);
+    resolve(job.firstImageFilename);
+    for (Operation &op : job.operations)
+    {
+        for (string &filename : op.files)
+        {
+            resolve(filename);
+        }
+        // Mip levels are written next to the prefix, which is relative to the client too
+        resolve(op.prefix);
+    }
+
+    string messages;
+    if (job.error.empty())
+    {
+        try
+        {
+            prepareJob(job, [&images](const string &filename) { return images.get(filename); },
+                       options.resultCache, options.optimize, options.originBits);
+            messages = computeJob(job);
+            saveJob(job, options.resultCache, options.rle);
+        }
+        catch (const exception &error)
+        {
+            job.error = error.what();
+        }
+    }
+
+    string reply;
+    istringstream lines(messages);
+    string line;
+    while (getline(lines, line))
+    {
+        reply += "MSG " + line + "\n";
+    }
+    if (!job.error.empty())
+    {
+        replace(job.error.begin(), job.error.end(), '\n', ' ');
+        sendText(connection, reply + "ERROR " + job.error + "\n");
+        return;
+    }
+    if (!streamBack)
+    {
+        sendText(connection, reply + "MSG ... and saving output to " + writtenOutput + "!\n" + "OK " +
+                                 job.outputFilename + "\n");
+        return;
+    }
+
+    int fd = open(job.outputFilename.c_str(), O_RDONLY);
+    unlink(job.outputFilename.c_str());
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        sendText(connection, reply + "ERROR Could not read back the output\n");
+        return;
+    }
+    sendText(connection, reply + "DATA " + to_string(info.st_size) + "\n");
+    off_t remaining = info.st_size;
+    while (remaining > 0)
+    {
+        ssize_t sent = sendfile(connection, fd, nullptr, static_cast<size_t>(remaining));
+        if (sent <= 0)
+        {
+            break;
+        }
+        remaining -= sent;
+    }
+    close(fd);
+}
+
+int runServer(const string &socketPath, uint64_t residentBytes, const ServerOptions &options)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        cout << "Error: The socket path " << socketPath << " is too long.\n";
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+
+    // A socket left behind by an earlier server is replaced; any other file is not
+    struct stat existing;
+    if (lstat(socketPath.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode))
+    {
+        unlink(socketPath.c_str());
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0)
+    {
+        cout << "Error: Could not listen on " << socketPath << ".\n";
+        return 1;
+    }
+
+    // A client that hangs up early must not take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+    auto images = make_shared<ResidentImages>(residentBytes);
+    cout << "Serving on " << socketPath << endl;
+    while (true)
+    {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            break;
+        }
+        thread([connection, images, options]() {
+            try
+            {
+                serveRequest(connection, *images, options);
+            }
+            catch (const exception &)
+            {
+                // The client went away mid-reply
+            }
+            close(connection);
+        }).detach();
+    }
+    close(listener);
+    cout << "Error: Stopped accepting connections on " << socketPath << ".\n";
+    return 1;
+}
+
+/* Sends args (output, firstImage, methods) to a server and relays its reply */
+int runClient(const string &socketPath, const vector<char *> &args)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketPath.size() >= sizeof(address.sun_path) || fd < 0)
+    {
+        cout << "Error: Could not connect to " << socketPath << ".\n";
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        cout << "Error: Could not connect to " << socketPath << ".\n";
+        return 1;
+    }
+
+    vector<char> directory(4096);
+    string request = getcwd(directory.data(), directory.size()) != nullptr ? directory.data() : ".";
+    request += "\n";
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+        request += (i == 1 ? "" : " ") + string(args[i]);
+    }
+    request += "\n";
+    writeAll(fd, reinterpret_cast<const uint8_t *>(request.data()), request.size(), socketPath);
+
+    // With the image itself on stdout, progress goes to stderr
+    bool toStdout = strcmp(args[1], "-") == 0;
+    ostream &log = toStdout ? cerr : cout;
+    string buffer;
+    string line;
+    int status = 1;
+    while (readLine(fd, buffer, line))
+    {
+        if (line.compare(0, 4, "MSG ") == 0)
+        {
+            log << line.substr(4) << "\n";
+        }
+        else if (line.compare(0, 3, "OK ") == 0)
+        {
+            status = 0;
+            break;
+        }
+        else if (line.compare(0, 6, "ERROR ") == 0)
+        {
+            log << "Error from the server: " << line.substr(6) << "\n";
+            break;
+        }
+        else if (line.compare(0, 5, "DATA ") == 0)
+        {
+            size_t remaining = stoull(line.substr(5));
+            log.flush();
+            size_t buffered = min(remaining, buffer.size());
+            writeAll(STDOUT_FILENO, reinterpret_cast<const uint8_t *>(buffer.data()), buffered, "stdout");
+            remaining -= buffered;
+            vector<uint8_t> chunk(1 << 16);
+            ssize_t n = 0;
+            while (remaining > 0 && (n = read(fd, chunk.data(), min(chunk.size(), remaining))) > 0)
+            {
+                writeAll(STDOUT_FILENO, chunk.data(), static_cast<size_t>(n), "stdout");
+                remaining -= static_cast<size_t>(n);
+            }
+            status = remaining == 0 ? 0 : 1;
+            break;
+        }
+    }
+    close(fd);
+    if (status != 0 && line.compare(0, 6, "ERROR ") != 0)
+    {
+        log << "Error: The server closed the connection before finishing.\n";
+    }
+    return status;
+}
+
+/*
+ * Benchmarks and Golden Checks
+ *
+ * --bench times every op on synthetic images and reports throughput. --golden runs every optimized path (SIMD
+ * blends, lookup tables, fused chains, in-place rotation, the RLE codec) against the plain scalar kernels and prints
+ * a checksum per case; given a file, it also compares against, or records, checksums from an earlier build.
+ */
+/* Deterministic xorshift noise, with some flat runs so RLE and the overlay branches see realistic data */
+TGAImage makeSyntheticImage(int width, int height, int channels, uint32_t seed)
+{
+    TGAImage image;
+    memset(&image.header, 0, sizeof(TGAHeader));
+    image.header.dataTypeCode = kTrueColor;
+    image.header.width = static_cast<uint16_t>(width);
+    image.header.height = static_cast<uint16_t>(height);
+    image.header.pixelDepth = static_cast<char>(channels * 8);
+    image.header.imageDescriptor = static_cast<char>(channels == 4 ? 8 : 0);
+
+    size_t imageSize = static_cast<size_t>(width) * height * channels;
+    image.data.allocate(imageSize);
+    uint8_t *pixels = image.data.data();
+    uint32_t state = seed * 2654435761u + 1;
+    for (size_t i = 0; i < imageSize; ++i)
+    {
+        if ((i / 4096) % 4 == 3)
+        {
+            pixels[i] = pixels[i - 4096];
+            continue;
+        }
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        pixels[i] = static_cast<uint8_t>(state >> 24);
+    }
+    return image;
+}
+
+string temporaryPath(const string &name)
+{
+    const char *directory = getenv("TMPDIR");
+    return string(directory != nullptr ? directory : "/tmp") + "/tga-" + to_string(getpid()) + "-" + name + ".tga";
+}
+
+/* Best wall time of body over at least three runs and about a fifth of a second */
+template <typename Body>
+double bestSeconds(Body body)
+{
+    double best = 1e30;
+    double total = 0;
+    for (int run = 0; run < 3 || total < 0.2; ++run)
+    {
+        auto start = chrono::steady_clock::now();
+        body();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        best = min(best, seconds);
+        total += seconds;
+    }
+    return best;
+}
+
+int runBenchmarks(int maxSize)
+{
+    cout << "Blend kernels: " << blendKernels().name << ", compositing kernels: " << compositeKernels().name
+         << ", filter kernels: " << filterKernels().name
+         << ", threads: " << threadPool().size() << "\n";
+    printf("%-10s %12s %3s %10s %10s %8s\n", "op", "size", "ch", "ms", "MPix/s", "GB/s");
+
+    for (int size = 256; size <= maxSize; size *= 4)
+    {
+        for (int channels = 3; channels <= 4; ++channels)
+        {
+            TGAImage top = makeSyntheticImage(size, size, channels, 1);
+            TGAImage bottom = makeSyntheticImage(size, size, channels, 2);
+            TGAImage third = makeSyntheticImage(size, size, channels, 3);
+            double pixels = static_cast<double>(size) * size;
+            double imageBytes = pixels * channels;
 
-    file.close();
+            // bytesMoved counts every byte read plus every byte written
+            auto report = [&](const char *name, double imagesMoved, double seconds) {
+                printf("%-10s %5dx%-6d %3d %10.3f %10.1f %8.2f\n", name, size, size, channels, seconds * 1e3,
+                       pixels / seconds / 1e6, imagesMoved * imageBytes / seconds / 1e9);
+                fflush(stdout);
+            };
+
+            report("multiply", 3, bestSeconds([&]() { blendImagesMultiply(top, bottom); }));
+            report("screen", 3, bestSeconds([&]() { blendImagesScreen(top, bottom); }));
+            report("subtract", 3, bestSeconds([&]() { blendImagesSubtract(top, bottom); }));
+            report("addition", 3, bestSeconds([&]() { blendImagesAddition(top, bottom); }));
+            report("overlay", 3, bestSeconds([&]() { blendImagesOverlay(top, bottom); }));
+            report("addred", 2, bestSeconds([&]() { addToChannel(top, 'R', 20); }));
+            report("scalered", 2, bestSeconds([&]() { scaleChannel(top, 'R', 1.5f); }));
+            report("onlyred", 2, bestSeconds([&]() { extractChannel(top, 'R'); }));
+            report("combine", 4, bestSeconds([&]() { combineChannels(top, bottom, third); }));
+            if (channels == 4)
+            {
+                report("over", 3, bestSeconds([&]() { compositeImages(top, bottom, CompositeMode::Over); }));
+                report("c-overlay", 3, bestSeconds([&]() { compositeImages(top, bottom, CompositeMode::Overlay); }));
+            }
+            report("flip", 2, bestSeconds([&]() { rotate180(top); }));
+            report("mirrorh", 2, bestSeconds([&]() { geometricTransform(top, Transform::MirrorHorizontal); }));
+            report("rotate90", 2, bestSeconds([&]() { geometricTransform(top, Transform::Rotate90); }));
+            report("transpose", 2, bestSeconds([&]() { geometricTransform(top, Transform::Transpose); }));
+            report("blur 8", 2, bestSeconds([&]() { boxBlur(top, 8); }));
+            report("blur 64", 2, bestSeconds([&]() { boxBlur(top, 64); }));
+            report("gaussian 2", 2, bestSeconds([&]() { gaussianBlur(top, 2.0f); }));
+            report("edges", 2, bestSeconds([&]() { detectEdges(top); }));
+            report("downscale", 1.25, bestSeconds([&]() { downscale(top); }));
+            report("mipmaps", 1.33, bestSeconds([&]() { mipLevels(top); }));
+            report("histogram", 1, bestSeconds([&]() { histogram(top); }));
+            report("autolevels", 3, bestSeconds([&]() {
+                vector<Operation> levelling(1);
+                levelling[0].kind = OpKind::AutoLevels;
+                TGAImage levelled = top;
+                ostringstream ignored;
+                executeOperations(levelled, levelling, ignored);
+            }));
+            report("lanczos/3", 1.11,
+                   bestSeconds([&]() { resizeImage(top, size / 3, size / 3, ResampleFilter::Lanczos); }));
+
+            string path = temporaryPath("bench");
+            report("saveTGA", 1, bestSeconds([&]() { saveTGA(path, top); }));
+            report("loadTGA", 1, bestSeconds([&]() {
+                // Mapping is lazy, so touch every page to time the actual read
+                TGAImage loaded = loadTGA(path);
+                volatile uint64_t sum = checksum(loaded);
+                (void)sum;
+            }));
+            unlink(path.c_str());
+        }
+    }
+    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2 || strcmp(argv[1], "--help") == 0) {
-        cout << "Project 2: Image Processing, Spring 2023\n"
-                "Usage:\n"
-                "    ./project2.out [output] [firstImage] [method] [...]\n";
-        return 0;
+/* Direct separable convolution with repeated edges, for checking the banded filters; returns the unscaled sums */
+vector<int64_t> referenceConvolution(const TGAImage &image, const vector<int64_t> &horizontal,
+                                     const vector<int64_t> &vertical)
+{
+    int channels = image.header.pixelDepth / 8;
+    int width = image.header.width;
+    int height = image.header.height;
+    int hr = static_cast<int>(horizontal.size() / 2);
+    int vr = static_cast<int>(vertical.size() / 2);
+    auto index = [&](int x, int y, int c) {
+        return (static_cast<size_t>(min(max(y, 0), height - 1)) * width + min(max(x, 0), width - 1)) * channels + c;
+    };
+
+    vector<int64_t> rows(image.data.size());
+    vector<int64_t> sums(image.data.size());
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            for (int c = 0; c < channels; ++c)
+            {
+                for (int k = -hr; k <= hr; ++k)
+                {
+                    rows[index(x, y, c)] += horizontal[k + hr] * image.data.data()[index(x + k, y, c)];
+                }
+            }
+        }
+    }
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            for (int c = 0; c < channels; ++c)
+            {
+                for (int k = -vr; k <= vr; ++k)
+                {
+                    sums[index(x, y, c)] += vertical[k + vr] * rows[index(x, y + k, c)];
+                }
+            }
+        }
     }
+    return sums;
+}
 
-    string outputFilename(argv[1]);
-    string firstImageFilename(argv[2]);
+/* The image halved with a direct 2x2 average per pixel */
+TGAImage referenceHalve(const TGAImage &image)
+{
+    int channels = image.header.pixelDepth / 8;
+    size_t width = image.header.width;
+    size_t height = image.header.height;
+    TGAImage halved = halvedHeader(image);
+    size_t halvedWidth = halved.header.width;
+    size_t halvedHeight = halved.header.height;
+    halved.data.allocate(halvedWidth * halvedHeight * channels);
+    for (size_t y = 0; y < halvedHeight; ++y)
+    {
+        for (size_t x = 0; x < halvedWidth; ++x)
+        {
+            for (int c = 0; c < channels; ++c)
+            {
+                int sum = 2;
+                for (size_t dy = 0; dy < 2; ++dy)
+                {
+                    for (size_t dx = 0; dx < 2; ++dx)
+                    {
+                        size_t sx = min(2 * x + dx, width - 1);
+                        size_t sy = min(2 * y + dy, height - 1);
+                        sum += image.data.data()[(sy * width + sx) * channels + c];
+                    }
+                }
+                halved.data.data()[(y * halvedWidth + x) * channels + c] = static_cast<uint8_t>(sum >> 2);
+            }
+        }
+    }
+    return halved;
+}
 
-    TGAImage currentImage = loadTGA(firstImageFilename);
+/* The image resized through the same weight tables, one output byte at a time */
+TGAImage referenceResize(const TGAImage &image, int width, int height, ResampleFilter filter)
+{
+    int channels = image.header.pixelDepth / 8;
+    int sourceWidth = image.header.width;
+    ResampleTable columns = resampleTable(sourceWidth, width, filter);
+    ResampleTable rows = resampleTable(image.header.height, height, filter);
+    TGAImage resized;
+    resized.header = image.header;
+    resized.header.width = static_cast<uint16_t>(width);
+    resized.header.height = static_cast<uint16_t>(height);
+    resized.data.allocate(static_cast<size_t>(width) * height * channels);
+    const int rowShift = kResampleBits - kResampleRowBits;
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            for (int c = 0; c < channels; ++c)
+            {
+                int64_t sum = int64_t(1) << (kResampleBits + kResampleRowBits - 1);
+                for (int r = 0; r < rows.taps; ++r)
+                {
+                    int64_t across = 1 << (rowShift - 1);
+                    for (int t = 0; t < columns.taps; ++t)
+                    {
+                        size_t sx = static_cast<size_t>(columns.first[x] + t);
+                        size_t sy = static_cast<size_t>(rows.first[y] + r);
+                        across += columns.weights[static_cast<size_t>(x) * columns.taps + t] *
+                                  image.data.data()[(sy * sourceWidth + sx) * channels + c];
+                    }
+                    sum += rows.weights[static_cast<size_t>(y) * rows.taps + r] * (across >> rowShift);
+                }
+                int64_t value = sum >> (kResampleBits + kResampleRowBits);
+                resized.data.data()[(static_cast<size_t>(y) * width + x) * channels + c] =
+                    static_cast<uint8_t>(min<int64_t>(255, max<int64_t>(0, value)));
+            }
+        }
+    }
+    return resized;
+}
 
-    bool firstOperation = true;
-    for (int i = 3; i < argc; i++) {
-        string method = argv[i];
+/* The image levelled with percentiles read off each channel's sorted values instead of a histogram */
+TGAImage referenceLevels(const TGAImage &image, bool perChannel, float clip)
+{
+    int channels = image.header.pixelDepth / 8;
+    int colors = channels == 4 ? 3 : channels;
+    size_t pixels = image.data.size() / channels;
+    auto percentile = [&](const vector<uint8_t> &sorted, double fraction) {
+        size_t rank = max<size_t>(1, static_cast<size_t>(ceil(fraction * static_cast<double>(pixels))));
+        return static_cast<int>(sorted[rank - 1]);
+    };
 
-        if (method == "multiply" && i + 1 < argc) {
-            i++;
-            TGAImage otherImage = loadTGA(argv[i]);
-            currentImage = blendImagesMultiply(currentImage, otherImage);
+    int low[3];
+    int high[3];
+    for (int j = 0; j < colors; ++j)
+    {
+        vector<uint8_t> sorted(pixels);
+        for (size_t p = 0; p < pixels; ++p)
+        {
+            sorted[p] = image.data.data()[p * channels + j];
+        }
+        sort(sorted.begin(), sorted.end());
+        low[j] = percentile(sorted, clip / 100.0);
+        high[j] = percentile(sorted, 1.0 - clip / 100.0);
+    }
 
-            if (firstOperation) {
-                firstOperation = false;
-                cout << "Multiplying " << firstImageFilename << " and " << argv[i] << " ...\n";
-            } else {
-                cout << "... and multiplying " << argv[i] << " with result of previous step  ...\n";
+    TGAImage levelled = image;
+    for (size_t i = 0; i < image.data.size(); ++i)
+    {
+        int j = static_cast<int>(i % channels);
+        if (j >= colors)
+        {
+            continue;
+        }
+        int a = perChannel ? low[j] : *min_element(low, low + colors);
+        int b = perChannel ? high[j] : *max_element(high, high + colors);
+        int v = image.data.data()[i];
+        if (b > a)
+        {
+            v = v <= a ? 0 : v >= b ? 255 : ((v - a) * 255 + (b - a) / 2) / (b - a);
+        }
+        levelled.data.data()[i] = static_cast<uint8_t>(v);
+    }
+    return levelled;
+}
+
+int runGoldenTests(const string &goldenFilename)
+{
+    map<string, uint64_t> recorded;
+    bool haveRecorded = false;
+    if (!goldenFilename.empty())
+    {
+        ifstream golden(goldenFilename);
+        string name;
+        uint64_t value;
+        while (golden >> name >> hex >> value)
+        {
+            recorded[name] = value;
+            haveRecorded = true;
+        }
+    }
+
+    int failures = 0;
+    vector<pair<string, uint64_t>> results;
+    auto expect = [&](const string &name, const TGAImage &expected, const TGAImage &actual) {
+        uint64_t value = checksum(actual);
+        bool matches = expected.data.size() == actual.data.size() && value == checksum(expected);
+        if (haveRecorded && recorded.count(name) != 0 && recorded[name] != value)
+        {
+            matches = false;
+        }
+        printf("%-28s %016llx %s\n", name.c_str(), static_cast<unsigned long long>(value), matches ? "ok" : "FAIL");
+        failures += matches ? 0 : 1;
+        results.emplace_back(name, value);
+    };
+    // A SIMD tier against the scalar kernel; which tiers run depends on the CPU, so these are not recorded
+    auto expectSame = [&](const string &name, const uint8_t *expected, const uint8_t *actual, size_t size) {
+        bool matches = memcmp(expected, actual, size) == 0;
+        printf("%-45s %s\n", name.c_str(), matches ? "ok" : "FAIL");
+        failures += matches ? 0 : 1;
+    };
+
+    typedef void (*ScalarBlend)(uint8_t *, const uint8_t *, const uint8_t *, size_t, size_t, int);
+    typedef TGAImage (*BlendMethod)(const TGAImage &, const TGAImage &);
+    const struct
+    {
+        const char *name;
+        ScalarBlend reference;
+        BlendMethod method;
+    } blends[] = {{"multiply", multiplyPixels, blendImagesMultiply},
+                  {"screen", screenPixels, blendImagesScreen},
+                  {"subtract", subtractPixels, blendImagesSubtract},
+                  {"addition", additionPixels, blendImagesAddition},
+                  {"overlay", overlayPixels, blendImagesOverlay}};
+
+    // Odd sizes leave SIMD tails and partial tiles
+    const int sizes[][2] = {{257, 131}, {1031, 769}};
+    for (const auto &size : sizes)
+    {
+        for (int channels = 3; channels <= 4; ++channels)
+        {
+            string suffix = "_" + to_string(size[0]) + "x" + to_string(size[1]) + "x" + to_string(channels);
+            TGAImage top = makeSyntheticImage(size[0], size[1], channels, 1);
+            TGAImage bottom = makeSyntheticImage(size[0], size[1], channels, 2);
+            TGAImage third = makeSyntheticImage(size[0], size[1], channels, 3);
+            size_t imageSize = top.data.size();
+
+            for (const auto &blend : blends)
+            {
+                TGAImage expected = top;
+                blend.reference(expected.data.data(), top.data.data(), bottom.data.data(), 0, imageSize, channels);
+                expect(blend.name + suffix, expected, blend.method(top, bottom));
             }
-        } else if (method == "subtract" && i + 1 < argc) {
-            i++;
-            TGAImage otherImage = loadTGA(argv[i]);
-            currentImage = blendImagesSubtract(currentImage, otherImage);
 
-            if (firstOperation) {
-                firstOperation = false;
-                cout << "Subtracting " << firstImageFilename << " and " << argv[i] << " ...\n";
-            } else {
-                cout << " ... and subtracting " << argv[i] << " from previous step ...\n";
+            // Every SIMD tier the CPU has, called directly, not just the one the ops pick
+            for (size_t tier = 1; tier < supportedBlendKernels().size(); ++tier)
+            {
+                const BlendKernels &kernels = supportedBlendKernels()[tier];
+                const BlendKernel tierBlends[] = {kernels.multiply, kernels.screen, kernels.subtract,
+                                                  kernels.addition, kernels.overlay};
+                for (size_t b = 0; b < 5; ++b)
+                {
+                    TGAImage expected = top;
+                    blends[b].reference(expected.data.data(), top.data.data(), bottom.data.data(), 0, imageSize,
+                                        channels);
+                    TGAImage actual = top;
+                    tierBlends[b](actual.data.data(), top.data.data(), bottom.data.data(), 0, imageSize, channels);
+                    expectSame(blends[b].name + string("_") + kernels.name + suffix, expected.data.data(),
+                               actual.data.data(), imageSize);
+                }
             }
-        } else if (method == "overlay" && i + 1 < argc) {
-            i++;
-            TGAImage otherImage = loadTGA(argv[i]);
-            currentImage = blendImagesOverlay(currentImage, otherImage);
 
-            if (firstOperation) {
-                firstOperation = false;
-                cout << "Overlaying " << firstImageFilename << " and " << argv[i] << " ...\n";
-            } else {
-                cout << " ... and overlaying " << argv[i] << " with result of previous step ...\n";
+            // Point ops against their lookup-table compilation
+            const char *pointChains[][4] = {{"addred", "37", nullptr, nullptr},
+                                            {"scalegreen", "1.7", nullptr, nullptr},
+                                            {"onlyblue", nullptr, nullptr, nullptr},
+                                            {"addblue", "-90", "scalered", "0.4"}};
+            for (const auto &chain : pointChains)
+            {
+                vector<char *> args;
+                for (const char *arg : chain)
+                {
+                    if (arg != nullptr)
+                    {
+                        args.push_back(const_cast<char *>(arg));
+                    }
+                }
+                vector<Operation> operations;
+                ostringstream ignored;
+                parseOperations(static_cast<int>(args.size()), args.data(), 0, "", operations, ignored);
+
+                TGAImage expected = top;
+                for (const Operation &op : operations)
+                {
+                    if (op.kind == OpKind::AddToChannel)
+                    {
+                        addToChannelPixels(expected.data.data(), expected.data.data(), 0, imageSize, channels,
+                                           op.channel, op.amount);
+                    }
+                    else if (op.kind == OpKind::ScaleChannel)
+                    {
+                        scaleChannelPixels(expected.data.data(), expected.data.data(), 0, imageSize, channels,
+                                           op.channel, op.factor);
+                    }
+                    else
+                    {
+                        extractChannelPixels(expected.data.data(), expected.data.data(), 0, imageSize, channels,
+                                             op.channel);
+                    }
+                }
+
+                compilePointOps(operations);
+                TGAImage actual = top;
+                executeOperations(actual, operations, ignored);
+
+                string name = args[0];
+                for (size_t k = 1; k < args.size(); ++k)
+                {
+                    name += string("_") + args[k];
+                }
+                expect(name + suffix, expected, actual);
             }
-        } else if (method == "screen" && i + 1 < argc) {
-            i++;
-            TGAImage otherImage = loadTGA(argv[i]);
-            currentImage = blendImagesScreen(currentImage, otherImage);
-            cout << "Screen blending " << firstImageFilename << " and " << argv[i] << " ...\n";
-        } else if (method == "combine") {
-            if (i + 2 > argc - 1) {
-                cout << "Error: Not enough input files for combine operation.\n";
-                return 1;
+
+            if (channels == 4)
+            {
+                // The compositing kernels against the scalar ones, whole and on data that is not validly premultiplied
+                for (int mode = 0; mode < kCompositeModes; ++mode)
+                {
+                    TGAImage expectedComposite = top;
+                    uint8_t *pixels = expectedComposite.data.data();
+                    premultiplyPixels(pixels, pixels, 0, imageSize);
+                    kScalarCompositeKernels.modes[mode](pixels, pixels, bottom.data.data(), 0, imageSize);
+                    unpremultiplyPixels(pixels, pixels, 0, imageSize);
+                    expect(string("composite_") + kCompositeModeNames[mode] + suffix, expectedComposite,
+                           compositeImages(top, bottom, static_cast<CompositeMode>(mode)));
+                }
+
+                TGAImage expectedRaw = top;
+                TGAImage actualRaw = top;
+                for (int mode = 0; mode < kCompositeModes; ++mode)
+                {
+                    kScalarCompositeKernels.modes[mode](expectedRaw.data.data(), expectedRaw.data.data(),
+                                                        bottom.data.data(), 0, imageSize);
+                    compositeKernels().modes[mode](actualRaw.data.data(), actualRaw.data.data(), bottom.data.data(),
+                                                   0, imageSize);
+                }
+                unpremultiplyPixels(expectedRaw.data.data(), third.data.data(), 0, imageSize);
+                compositeKernels().unpremultiply(actualRaw.data.data(), third.data.data(), 0, imageSize);
+                expect("composite_raw" + suffix, expectedRaw, actualRaw);
+
+                // Every SIMD tier the CPU has, mode by mode and through both alpha conversions
+                for (size_t tier = 1; tier < supportedCompositeKernels().size(); ++tier)
+                {
+                    const CompositeKernels &kernels = supportedCompositeKernels()[tier];
+                    string tierSuffix = string("_") + kernels.name + suffix;
+                    for (int mode = 0; mode < kCompositeModes; ++mode)
+                    {
+                        TGAImage expectedMode = top;
+                        TGAImage actualMode = top;
+                        kScalarCompositeKernels.modes[mode](expectedMode.data.data(), top.data.data(),
+                                                            bottom.data.data(), 0, imageSize);
+                        kernels.modes[mode](actualMode.data.data(), top.data.data(), bottom.data.data(), 0, imageSize);
+                        expectSame(string("composite_") + kCompositeModeNames[mode] + tierSuffix,
+                                   expectedMode.data.data(), actualMode.data.data(), imageSize);
+                    }
+                    TGAImage expectedAlpha = top;
+                    TGAImage actualAlpha = top;
+                    premultiplyPixels(expectedAlpha.data.data(), top.data.data(), 0, imageSize);
+                    kernels.premultiply(actualAlpha.data.data(), top.data.data(), 0, imageSize);
+                    expectSame("premultiply" + tierSuffix, expectedAlpha.data.data(), actualAlpha.data.data(),
+                               imageSize);
+                    unpremultiplyPixels(expectedAlpha.data.data(), third.data.data(), 0, imageSize);
+                    kernels.unpremultiply(actualAlpha.data.data(), third.data.data(), 0, imageSize);
+                    expectSame("unpremultiply" + tierSuffix, expectedAlpha.data.data(), actualAlpha.data.data(),
+                               imageSize);
+                }
             }
 
-            string greenImageFilename = argv[i + 1];
-            string blueImageFilename = argv[i + 2];
+            TGAImage expectedCombine = top;
+            combineChannelsPixels(expectedCombine.data.data(), top.data.data(), bottom.data.data(),
+                                  third.data.data(), 0, imageSize, channels);
+            expect("combine" + suffix, expectedCombine, combineChannels(top, bottom, third));
 
-            TGAImage greenImage = loadTGA(greenImageFilename);
-            TGAImage blueImage = loadTGA(blueImageFilename);
+            // rotate180 against the original per-pixel index formula
+            TGAImage expectedFlip = top;
+            int width = size[0];
+            int height = size[1];
+            for (int y = 0; y < height; ++y)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    size_t srcIndex = (static_cast<size_t>(y) * width + x) * channels;
+                    size_t dstIndex = (static_cast<size_t>(height - y - 1) * width + (width - x - 1)) * channels;
+                    memcpy(expectedFlip.data.data() + dstIndex, top.data.data() + srcIndex, channels);
+                }
+            }
+            expect("flip" + suffix, expectedFlip, rotate180(top));
+            TGAImage flippedInPlace = top;
+            rotate180InPlace(flippedInPlace);
+            expect("flip_inplace" + suffix, expectedFlip, flippedInPlace);
 
-            currentImage = combineChannels(currentImage, greenImage, blueImage);
+            // The blocked and row-wise transforms against a per-pixel index formula
+            const struct
+            {
+                const char *name;
+                Transform transform;
+            } transforms[] = {{"rotate90", Transform::Rotate90},
+                              {"rotate270", Transform::Rotate270},
+                              {"mirrorh", Transform::MirrorHorizontal},
+                              {"mirrorv", Transform::MirrorVertical},
+                              {"transpose", Transform::Transpose}};
+            for (const auto &transform : transforms)
+            {
+                Orientation orientation = storageOrientation(transform.transform, top.header);
+                int outputWidth = orientation.swapAxes ? height : width;
+                TGAImage expected = top;
+                for (int y = 0; y < height; ++y)
+                {
+                    for (int x = 0; x < width; ++x)
+                    {
+                        int sx = orientation.reverseX ? width - 1 - x : x;
+                        int sy = orientation.reverseY ? height - 1 - y : y;
+                        size_t dstIndex = orientation.swapAxes
+                                              ? (static_cast<size_t>(x) * outputWidth + y) * channels
+                                              : (static_cast<size_t>(y) * outputWidth + x) * channels;
+                        memcpy(expected.data.data() + dstIndex,
+                               top.data.data() + (static_cast<size_t>(sy) * width + sx) * channels, channels);
+                    }
+                }
+                expect(transform.name + suffix, expected, geometricTransform(top, transform.transform));
+                TGAImage inPlace = top;
+                geometricTransformInPlace(inPlace, transform.transform);
+                expect(transform.name + string("_inplace") + suffix, expected, inPlace);
+            }
 
-            i += 2;
+            // A fused chain read from disk against the op wrappers applied one at a time
+            string topPath = temporaryPath("top");
+            string bottomPath = temporaryPath("bottom");
+            string thirdPath = temporaryPath("third");
+            saveTGA(topPath, top);
+            saveTGA(bottomPath, bottom, true);
+            saveTGA(thirdPath, third);
 
-            if (firstOperation) {
-                firstOperation = false;
-                cout << "Combining channels from " << "running image, " << greenImageFilename << ", and "
-                     << blueImageFilename << " ...\n";
-            } else {
-                cout << " ... and combining channels from running image " << " , " << greenImageFilename << ", and "
-                     << blueImageFilename << " to previous step ...\n";
+            TGAImage expectedChain = blendImagesMultiply(top, bottom);
+            expectedChain = blendImagesScreen(expectedChain, third);
+            expectedChain = addToChannel(expectedChain, 'G', 25);
+            expectedChain = rotate180(expectedChain);
+            expectedChain = blendImagesOverlay(expectedChain, bottom);
+            expectedChain = combineChannels(expectedChain, third, bottom);
+            expectedChain = blendImagesSubtract(expectedChain, third);
+
+            string chainArgs[] = {"multiply", bottomPath, "screen", thirdPath, "addgreen", "25", "flip",
+                                  "overlay", bottomPath, "combine", thirdPath, bottomPath, "subtract", thirdPath};
+            vector<char *> args;
+            for (string &arg : chainArgs)
+            {
+                args.push_back(&arg[0]);
             }
-        } else if (method == "flip") {
-            currentImage = rotate180(currentImage);
+            vector<Operation> operations;
+            ostringstream ignored;
+            parseOperations(static_cast<int>(args.size()), args.data(), 0, topPath, operations, ignored);
+            compilePointOps(operations);
+            TGAImage chained = loadTGA(topPath);
+            executeOperations(chained, operations, ignored);
+            expect("chain" + suffix, expectedChain, chained);
 
-            if (firstOperation) {
-                firstOperation = false;
-                cout << "Flipping " << firstImageFilename << " ...\n";
-            } else {
-                cout << " ... and flipping output of previous step ...\n";
+            // The rewritten chain against the same chain run as written
+            string rewriteArgs[] = {"rotate90", "addred", "40", "transpose", "onlygreen", "scalered", "2",
+                                    "multiply", bottomPath, "mirrorh", "addgreen", "-30", "addgreen", "-20", "flip"};
+            args.clear();
+            for (string &arg : rewriteArgs)
+            {
+                args.push_back(&arg[0]);
             }
-        } else if (method == "onlyred") {
-            currentImage = extractChannel(currentImage, 'R');
+            vector<Operation> asWritten;
+            parseOperations(static_cast<int>(args.size()), args.data(), 0, topPath, asWritten, ignored);
+            vector<Operation> rewritten = asWritten;
+            planOperations(asWritten, channels, false, false);
+            planOperations(rewritten, channels, true, false);
+            TGAImage expectedRewrite = top;
+            executeOperations(expectedRewrite, asWritten, ignored);
+            TGAImage actualRewrite = top;
+            executeOperations(actualRewrite, rewritten, ignored);
+            expect("optimized" + suffix, expectedRewrite, actualRewrite);
 
-            if (firstOperation) {
-                firstOperation = false;
-                cout << "Only Red " << firstImageFilename << " ...\n";
-            } else {
-                cout << " ... and getting only red output of previous step ...\n";
+            // Adds merged by the optimizer must saturate like the adds run one by one, however large they are
+            string hugeArgs[] = {"addred", "2000000000", "addred", "2000000000", "addgreen", "-2147483648",
+                                 "addgreen", "-2000000000", "addblue", "300", "addblue", "-1"};
+            args.clear();
+            for (string &arg : hugeArgs)
+            {
+                args.push_back(&arg[0]);
             }
-        } else if (method == "onlygreen") {
-            currentImage = extractChannel(currentImage, 'G');
+            asWritten.clear();
+            parseOperations(static_cast<int>(args.size()), args.data(), 0, topPath, asWritten, ignored);
+            rewritten = asWritten;
+            planOperations(asWritten, channels, false, false);
+            planOperations(rewritten, channels, true, false);
+            expectedRewrite = top;
+            executeOperations(expectedRewrite, asWritten, ignored);
+            actualRewrite = top;
+            executeOperations(actualRewrite, rewritten, ignored);
+            expect("optimized_huge" + suffix, expectedRewrite, actualRewrite);
 
-            if (firstOperation) {
-                firstOperation = false;
-                cout << "Only Green " << firstImageFilename << " ...\n";
-            } else {
-                cout << " ... and getting only green output of previous step ...\n";
+            // A stack against the same layers blended one whole image at a time, mixed by their opacities
+            TGAImage expectedStack = blendImagesMultiply(top, bottom);
+            TGAImage layer = blendImagesAddition(expectedStack, third);
+            mixPixels(expectedStack.data.data(), expectedStack.data.data(), layer.data.data(), imageSize, 64);
+            layer = blendImagesScreen(expectedStack, bottom);
+            mixPixels(expectedStack.data.data(), expectedStack.data.data(), layer.data.data(), imageSize, 128);
+            string stackArgs[] = {"stack", "3", "multiply", bottomPath, "addition:0.25", thirdPath, "screen:0.5",
+                                  bottomPath};
+            args.clear();
+            for (string &arg : stackArgs)
+            {
+                args.push_back(&arg[0]);
             }
-        } else if (method == "onlyblue") {
-            currentImage = extractChannel(currentImage, 'B');
+            operations.clear();
+            parseOperations(static_cast<int>(args.size()), args.data(), 0, topPath, operations, ignored);
+            TGAImage stacked = top;
+            executeOperations(stacked, operations, ignored);
+            expect("stack" + suffix, expectedStack, stacked);
 
-            if (firstOperation) {
-                firstOperation = false;
-                cout << "Only Blue " << firstImageFilename << " ...\n";
-            } else {
-                cout << " ... and getting only blue output of previous step ...\n";
+            // Filters against a direct convolution of the whole image
+            const int64_t boxWindow = 5 * 5;
+            vector<int64_t> boxSums = referenceConvolution(top, vector<int64_t>(5, 1), vector<int64_t>(5, 1));
+            TGAImage expectedFilter = top;
+            for (size_t i = 0; i < imageSize; ++i)
+            {
+                expectedFilter.data.data()[i] = static_cast<uint8_t>((boxSums[i] + boxWindow / 2) / boxWindow);
             }
-        } else if (method == "addred") {
-            if (i + 1 < argc) {
-                int amount = stoi(argv[i + 1]);
-                TGAImage modifiedImage = addToChannel(currentImage, 'R', amount);
-                currentImage = modifiedImage;
-                i++;
+            expect("blur" + suffix, expectedFilter, boxBlur(top, 2));
 
-                if (firstOperation) {
-                    firstOperation = false;
-                    cout << "Adding " << amount << " to the red channel of " << firstImageFilename << " ...\n";
-                } else {
-                    cout << " ... and adding " << amount << " to the red channel of previous step ...\n";
+            auto referenceGaussian = [&](float sigma) {
+                int radius;
+                vector<uint32_t> weights = gaussianWeights(sigma, radius);
+                vector<int64_t> taps(weights.begin(), weights.end());
+                vector<int64_t> sums = referenceConvolution(top, taps, taps);
+                TGAImage blurred = top;
+                for (size_t i = 0; i < imageSize; ++i)
+                {
+                    blurred.data.data()[i] = static_cast<uint8_t>((sums[i] + (1 << 23)) >> 24);
                 }
-            } else {
-                cout << "Error: Missing amount to add to the red channel.\n"; //fix
-                return 1;
-            }
-        } else if (method == "addgreen") {
-            if (i + 1 < argc) {
-                int amount = stoi(argv[i + 1]);
-                TGAImage modifiedImage = addToChannel(currentImage, 'G', amount);
-                currentImage = modifiedImage;
-                i++;
+                return blurred;
+            };
+            expect("gaussian" + suffix, referenceGaussian(1.3f), gaussianBlur(top, 1.3f));
 
-                if (firstOperation) {
-                    firstOperation = false;
-                    cout << "Adding " << amount << " to the green channel of " << firstImageFilename << " ...\n";
-                } else {
-                    cout << " ... and adding " << amount << " to the green channel of previous step ...\n";
+            TGAImage blurred = referenceGaussian(1.0f);
+            expectedFilter = top;
+            for (size_t i = 0; i < imageSize; ++i)
+            {
+                if (channels == 4 && i % 4 == 3)
+                {
+                    continue;
                 }
-            } else {
-                cout << "Error: Missing amount to add to the green channel.\n";
-                return 1;
+                int detail = (top.data.data()[i] - blurred.data.data()[i]) * 384;
+                int value = top.data.data()[i] + (detail >= 0 ? (detail + 128) / 256 : -((128 - detail) / 256));
+                expectedFilter.data.data()[i] = static_cast<uint8_t>(min(255, max(0, value)));
             }
-        } else if (method == "addblue") {
-            if (i + 1 < argc) {
-                int amount = stoi(argv[i + 1]);
-                TGAImage modifiedImage = addToChannel(currentImage, 'B', amount);
-                currentImage = modifiedImage;
-                i++;
+            expect("sharpen" + suffix, expectedFilter, sharpen(top, 1.5f));
 
-                if (firstOperation) {
-                    firstOperation = false;
-                    cout << "Adding " << amount << " to the blue channel of " << firstImageFilename << " ...\n";
-                } else {
-                    cout << " ... and adding " << amount << " to the blue channel of previous step ...\n";
+            vector<int64_t> gx = referenceConvolution(top, {-1, 0, 1}, {1, 2, 1});
+            vector<int64_t> gy = referenceConvolution(top, {1, 2, 1}, {-1, 0, 1});
+            expectedFilter = top;
+            for (size_t i = 0; i < imageSize; ++i)
+            {
+                if (channels != 4 || i % 4 != 3)
+                {
+                    int64_t magnitude = (llabs(gx[i]) + llabs(gy[i]) + 2) / 4;
+                    expectedFilter.data.data()[i] = static_cast<uint8_t>(min<int64_t>(255, magnitude));
                 }
-            } else {
-                cout << "Error: Missing amount to add to the blue channel.\n";
-                return 1;
             }
-        } else if (method == "scalered") {
-            if (i + 1 < argc) {
-                float amount = stof(argv[i + 1]);
-                TGAImage modifiedImage = scaleChannel(currentImage, 'R', amount);
-                currentImage = modifiedImage;
-                i++;
+            expect("edges" + suffix, expectedFilter, detectEdges(top));
 
-                if (firstOperation) {
-                    firstOperation = false;
-                    cout << "Scaling " << amount << " to the red channel of " << firstImageFilename << " ...\n";
-                } else {
-                    cout << " ... and scaling " << amount << " to the red channel of previous step ...\n";
-                }
-            } else {
-                cout << "Error: Missing amount to scale to the red channel.\n";
-                return 1;
+            // Every SIMD tier of the filter row kernels against the scalar ones, on sums wide enough to carry
+            vector<uint32_t> enter(imageSize);
+            vector<uint32_t> leave(imageSize);
+            for (size_t i = 0; i < imageSize; ++i)
+            {
+                enter[i] = top.data.data()[i] * 40503u + bottom.data.data()[i];
+                leave[i] = third.data.data()[i] * 9973u;
+            }
+            for (size_t tier = 1; tier < supportedFilterKernels().size(); ++tier)
+            {
+                const FilterKernels &kernels = supportedFilterKernels()[tier];
+                vector<uint32_t> expectedSums = leave;
+                vector<uint32_t> actualSums = leave;
+                kScalarFilterKernels.accumulate(expectedSums.data(), enter.data(), 517, imageSize);
+                kernels.accumulate(actualSums.data(), enter.data(), 517, imageSize);
+                expectSame(string("accumulate_") + kernels.name + suffix,
+                           reinterpret_cast<const uint8_t *>(expectedSums.data()),
+                           reinterpret_cast<const uint8_t *>(actualSums.data()), imageSize * sizeof(uint32_t));
+                kScalarFilterKernels.slide(expectedSums.data(), enter.data(), leave.data(), imageSize);
+                kernels.slide(actualSums.data(), enter.data(), leave.data(), imageSize);
+                expectSame(string("slide_") + kernels.name + suffix,
+                           reinterpret_cast<const uint8_t *>(expectedSums.data()),
+                           reinterpret_cast<const uint8_t *>(actualSums.data()), imageSize * sizeof(uint32_t));
             }
-        } else if (method == "scalegreen") {
-            if (i + 1 < argc) {
-                float amount = stof(argv[i + 1]);
-                TGAImage modifiedImage = scaleChannel(currentImage, 'G', amount);
-                currentImage = modifiedImage;
-                i++;
 
-                if (firstOperation) {
-                    firstOperation = false;
-                    cout << "Scaling " << amount << " to the green channel of " << firstImageFilename << " ...\n";
-                } else {
-                    cout << " ... and scaling " << amount << " to the green channel of previous step ...\n";
-                }
-            } else {
-                cout << "Error: Missing amount to scale to the green channel.\n";
-                return 1;
+            // Resampling against direct references; a mip chain crosses from its banded levels to the deeper ones
+            expect("downscale" + suffix, referenceHalve(top), downscale(top));
+            vector<TGAImage> levels = mipLevels(top);
+            TGAImage expectedLevel = top;
+            for (size_t k = 0; k < levels.size(); ++k)
+            {
+                expectedLevel = referenceHalve(expectedLevel);
+                expect("mip" + to_string(k + 1) + suffix, expectedLevel, levels[k]);
             }
-        } else if (method == "scaleblue") {
-            if (i + 1 < argc) {
-                float amount = stof(argv[i + 1]);
-                TGAImage modifiedImage = scaleChannel(currentImage, 'B', amount);
-                currentImage = modifiedImage;
-                i++;
+            expect("lanczos" + suffix, referenceResize(top, 300, 97, ResampleFilter::Lanczos),
+                   resizeImage(top, 300, 97, ResampleFilter::Lanczos));
+            expect("bilinear" + suffix, referenceResize(top, 700, 401, ResampleFilter::Bilinear),
+                   resizeImage(top, 700, 401, ResampleFilter::Bilinear));
 
-                if (firstOperation) {
-                    firstOperation = false;
-                    cout << "Scaling " << amount << " to the blue channel of " << firstImageFilename << " ...\n";
-                } else {
-                    cout << " ... and scaling " << amount << " to the blue channel of previous step ...\n";
-                }
-            } else {
-                cout << "Error: Missing amount to scale to the blue channel.\n";
+            // Levels through the counted histogram; the synthetic images span the full range, so squeeze them first
+            TGAImage squeezed = scaleChannel(addToChannel(scaleChannel(top, 'R', 0.6f), 'G', 70), 'B', 0.3f);
+            vector<Operation> levelling(1);
+            levelling[0].kind = OpKind::AutoLevels;
+            levelling[0].factor = 1.5f;
+            TGAImage actualLevels = squeezed;
+            executeOperations(actualLevels, levelling, ignored);
+            expect("autolevels" + suffix, referenceLevels(squeezed, true, 1.5f), actualLevels);
+            levelling[0].kind = OpKind::Normalize;
+            levelling[0].factor = 0.0f;
+            actualLevels = squeezed;
+            executeOperations(actualLevels, levelling, ignored);
+            expect("normalize" + suffix, referenceLevels(squeezed, false, 0.0f), actualLevels);
+
+            string rlePath = temporaryPath("rle");
+            saveTGA(rlePath, top, true);
+            expect("rle_roundtrip" + suffix, top, loadTGA(rlePath));
+
+            // Region reads against cropping the whole decoded image, raw and through the RLE row index
+            Region region = storageRegion(top.header, 13, 7, 101, 59);
+            expect("crop_raw" + suffix, cropImage(top, region), loadTGARegion(topPath, 13, 7, 101, 59, false));
+            expect("crop_rle" + suffix, cropImage(bottom, region), loadTGARegion(bottomPath, 13, 7, 101, 59, false));
+
+            // Tiled mode against the whole-image path, on an image padded out with a constant so most tiles are uniform
+            TGAImage padded = top;
+            size_t rowBytes = static_cast<size_t>(size[0]) * channels;
+            for (int y = 0; y < size[1]; ++y)
+            {
+                size_t from = y < size[1] / 2 ? 0 : (size[0] / 3) * channels;
+                fillPixels(padded.data.data() + y * rowBytes, from, rowBytes, channels, {9, 200, 77, 255});
+            }
+            string paddedPath = temporaryPath("padded");
+            string paddedRlePath = temporaryPath("padded_rle");
+            saveTGA(paddedPath, padded, false);
+            saveTGA(paddedRlePath, padded, true);
+            string tiledArgs[] = {"multiply", paddedPath, "addred", "40", "screen", bottomPath, "rotate90",
+                                  "autolevels", "crop", "5", "9", "120", "150", "transverse", "flip"};
+            args.clear();
+            for (string &arg : tiledArgs)
+            {
+                args.push_back(&arg[0]);
+            }
+            operations.clear();
+            parseOperations(static_cast<int>(args.size()), args.data(), 0, paddedRlePath, operations, ignored);
+            planOperations(operations, channels, true, false);
+            vector<Operation> tiledOperations = operations;
+            TGAImage expectedTiled = padded;
+            executeOperations(expectedTiled, operations, ignored);
+            TiledImage tiledImage = loadTiledTGA(paddedRlePath);
+            executeTiledOperations(tiledImage, tiledOperations, ignored);
+            expect("tiled" + suffix, expectedTiled, untileImage(tiledImage));
+            saveTiledTGA(rlePath, tiledImage, true);
+            expect("tiled_save" + suffix, expectedTiled, loadTGA(rlePath));
+
+            unlink(topPath.c_str());
+            unlink(bottomPath.c_str());
+            unlink(thirdPath.c_str());
+            unlink(rlePath.c_str());
+            unlink(paddedPath.c_str());
+            unlink(paddedRlePath.c_str());
+        }
+    }
+
+    if (!goldenFilename.empty() && !haveRecorded)
+    {
+        ofstream golden(goldenFilename);
+        for (const auto &result : results)
+        {
+            golden << result.first << " " << hex << setw(16) << setfill('0') << result.second << "\n";
+        }
+        cout << "Recorded " << results.size() << " checksums in " << goldenFilename << "\n";
+    }
+
+    cout << (failures == 0 ? "All golden checks passed.\n" : to_string(failures) + " golden checks FAILED.\n");
+    return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+#ifdef TGA_BENCH_MAIN
+    if (argc < 2) {
+        return runBenchmarks(4096);
+    }
+#endif
+    if (argc < 2 || strcmp(argv[1], "--help") == 0) {
+        cout << "Project 2: Image Processing, Spring 2023\n"
+                "Usage:\n"
+                "    ./project2.out [output] [firstImage] [method] [...]\n"
+                "Options:\n"
+                "    --threads N    Number of threads to use (default: all hardware threads)\n"
+                "    --rle          Write the output RLE-compressed\n"
+                "    --explain      Print the optimized plan instead of running it\n"
+                "    --no-optimize  Run the chain exactly as written\n"
+                "    --origin-bits  Do trailing flips and mirrors by changing the TGA origin bits\n"
+                "                   instead of moving pixels (for readers that honor them)\n"
+                "    --profile FILE Time every load, save and op; write a Chrome trace to FILE\n"
+                "    --row-index    Keep a row index next to RLE inputs (FILE.rowidx) so that chains\n"
+                "                   starting with a crop seek straight to the cropped rows\n"
+                "    --cache DIR    Reuse results of earlier runs kept in DIR, and keep this one\n"
+                "    --cache-size N Bound DIR to N megabytes, evicting the least recently used\n"
+                "                   results first (default 1024)\n"
+                "    --stream       Stream scanlines through the chain with bounded memory\n"
+                "                   (uncompressed 8/24/32-bit inputs only)\n"
+                "    --tiled        Run the chain over 64x64 tiles, keeping uniform ones as a single\n"
+                "                   value (for huge, mostly padded images; no filters or resampling)\n"
+                "    --batch FILE   Run one chain per line of FILE (\"-\" for stdin), each line\n"
+                "                   written as [output] [firstImage] [method] [...]\n"
+                "    --serve SOCKET Stay resident and run the chains clients send to SOCKET\n"
+                "    --serve-memory N\n"
+                "                   Keep up to N megabytes of decoded inputs resident (default 1024)\n"
+                "    --connect SOCKET\n"
+                "                   Run this chain on the server at SOCKET; an output of \"-\"\n"
+                "                   writes the image to stdout\n"
+                "    --bench [N]    Time every op on synthetic images up to NxN (default 4096,\n"
+                "                   at most 16384)\n"
+                "    --golden [F]   Check optimized ops against the scalar kernels; compare with or\n"
+                "                   record checksums in F\n";
+        return 0;
+    }
+
+    // Options may appear anywhere; everything else is the positional output/input/method chain
+    vector<char *> args;
+    bool rleOutput = false;
+    bool streaming = false;
+    bool tiled = false;
+    bool originBits = false;
+    bool explain = false;
+    bool optimize = true;
+    bool keepRowIndex = false;
+    string batchFilename;
+    string cacheDirectory;
+    string serveSocket;
+    string connectSocket;
+    uint64_t residentBytes = kDefaultResidentBytes;
+    uint64_t cacheBytes = kDefaultCacheBytes;
+    int benchmarkSize = 0;
+    bool golden = false;
+    string goldenFilename;
+    for (int i = 0; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads") {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                cout << "Error: --threads needs a positive thread count.\n";
+                return 1;
+            }
+            requestedThreadCount = static_cast<unsigned>(atoi(argv[++i]));
+        } else if (arg == "--rle") {
+            rleOutput = true;
+        } else if (arg == "--stream") {
+            streaming = true;
+        } else if (arg == "--tiled") {
+            tiled = true;
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profiler().start(argv[++i]);
+            atexit([]() { profiler().finish(); });
+        } else if (arg == "--explain") {
+            explain = true;
+        } else if (arg == "--no-optimize") {
+            optimize = false;
+        } else if (arg == "--origin-bits") {
+            originBits = true;
+        } else if (arg == "--row-index") {
+            keepRowIndex = true;
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cacheDirectory = argv[++i];
+        } else if (arg == "--cache-size") {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                cout << "Error: --cache-size needs a positive size in megabytes.\n";
                 return 1;
             }
+            cacheBytes = static_cast<uint64_t>(atoi(argv[++i])) << 20;
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serveSocket = argv[++i];
+        } else if (arg == "--serve-memory") {
+            if (i + 1 >= argc || atoi(argv[i + 1]) <= 0) {
+                cout << "Error: --serve-memory needs a positive size in megabytes.\n";
+                return 1;
+            }
+            residentBytes = static_cast<uint64_t>(atoi(argv[++i])) << 20;
+        } else if (arg == "--connect" && i + 1 < argc) {
+            connectSocket = argv[++i];
+        } else if (arg == "--batch" && i + 1 < argc) {
+            batchFilename = argv[++i];
+        } else if (arg == "--bench") {
+            benchmarkSize = 4096;
+            if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                benchmarkSize = min(atoi(argv[++i]), 16384);
+            }
+        } else if (arg == "--golden") {
+            golden = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                goldenFilename = argv[++i];
+            }
         } else {
-            cout << "Invalid method or missing arguments: " << method << endl;
+            args.push_back(argv[i]);
+        }
+    }
+    if (streaming && tiled) {
+        cout << "Error: --stream and --tiled cannot be combined.\n";
+        return 1;
+    }
+    // Only single chains run tiled, and the tiled loader decodes RLE inputs whole rather than through a row index
+    if (tiled && (!batchFilename.empty() || !serveSocket.empty() || !connectSocket.empty() || keepRowIndex)) {
+        cout << "Error: --tiled cannot be combined with --batch, --serve, --connect or --row-index.\n";
+        return 1;
+    }
+    if (benchmarkSize > 0) {
+        return runBenchmarks(benchmarkSize);
+    }
+    if (golden) {
+        return runGoldenTests(goldenFilename);
+    }
+    unique_ptr<ResultCache> cache;
+    if (!cacheDirectory.empty()) {
+        cache = make_unique<ResultCache>(cacheDirectory, cacheBytes, rleOutput, originBits);
+    }
+    if (!batchFilename.empty()) {
+        if (batchFilename == "-") {
+            return runBatch(cin, rleOutput, optimize, originBits, cache.get());
+        }
+        ifstream manifest(batchFilename);
+        if (!manifest) {
+            cout << "Error: Failed to open the batch manifest " << batchFilename << ".\n";
             return 1;
         }
+        return runBatch(manifest, rleOutput, optimize, originBits, cache.get());
+    }
+    if (!serveSocket.empty()) {
+        return runServer(serveSocket, residentBytes, ServerOptions{rleOutput, optimize, originBits, cache.get()});
+    }
+    if (args.size() < 3) {
+        cout << "Error: Missing output or input filename.\n";
+        return 1;
+    }
+    if (!connectSocket.empty()) {
+        // The server runs every chain with its own options, so the client's would be silently ignored
+        if (rleOutput || originBits || !optimize) {
+            cout << "Error: --rle, --origin-bits and --no-optimize apply to the whole server; pass them to --serve "
+                    "instead of --connect.\n";
+            return 1;
+        }
+        if (streaming) {
+            cout << "Error: The server does not stream; run without --stream or without --connect.\n";
+            return 1;
+        }
+        return runClient(connectSocket, args);
+    }
+
+    string outputFilename(args[1]);
+    string firstImageFilename(args[2]);
+
+    vector<Operation> operations;
+    if (!parseOperations(static_cast<int>(args.size()), args.data(), 3, firstImageFilename, operations)) {
+        return 1;
+    }
+    size_t parsedCount = operations.size();
+
+    // A cached prefix of the chain stands in for the first image; a cached whole chain is the output
+    vector<uint64_t> cacheKeys;
+    if (cache && !explain) {
+        size_t covered = 0;
+        string cachedPath;
+        if (cache->keys(firstImageFilename, operations, cacheKeys) &&
+            cache->lookup(cacheKeys, operations, covered, cachedPath)) {
+            string reused;
+            for (size_t k = 0; k < covered; ++k) {
+                reused += operations[k].message;
+            }
+            if (covered == operations.size() && cache->serve(cachedPath, outputFilename)) {
+                cout << reused << "... and saving output to " << outputFilename << "!\n";
+                return 0;
+            }
+            // Streaming reads only uncompressed inputs
+            if (covered < operations.size() && !(streaming && rleOutput)) {
+                cout << reused;
+                firstImageFilename = cachedPath;
+                operations.erase(operations.begin(), operations.begin() + static_cast<ptrdiff_t>(covered));
+            }
+        }
     }
 
-    saveTGA(outputFilename, currentImage);
-    cout << "... and saving output to " << outputFilename << "!\n";
+    // The plan depends on the pixel size, so the first image is opened before planning
+    int channels = loadedChannels(firstImageFilename);
+    string leftover = planOperations(operations, channels, optimize, originBits);
 
+    if (explain) {
+        explainOperations(operations, parsedCount, cout);
+        return 0;
+    }
+
+    if (streaming) {
+        streamOperations(outputFilename, firstImageFilename, operations, rleOutput);
+    } else if (tiled) {
+        TiledImage image = loadTiledTGA(firstImageFilename);
+        executeTiledOperations(image, operations);
+        saveTiledTGA(outputFilename, image, rleOutput);
+    } else {
+        // A leading crop reads just its region of the first image
+        TGAImage currentImage;
+        if (!operations.empty() && operations[0].kind == OpKind::Crop) {
+            const Operation &crop = operations[0];
+            currentImage =
+                loadTGARegion(firstImageFilename, crop.left, crop.top, crop.width, crop.height, keepRowIndex);
+            cout << crop.message;
+            operations.erase(operations.begin());
+        } else {
+            currentImage = loadTGA(firstImageFilename);
+        }
+        executeOperations(currentImage, operations);
+        saveTGA(outputFilename, currentImage, rleOutput);
+    }
+    cout << leftover << "... and saving output to " << outputFilename << "!\n";
+    if (cache && !cacheKeys.empty()) {
+        cache->store(cacheKeys.back(), outputFilename);
+    }
 
     return 0;
-}
\ No newline at end of file
+}